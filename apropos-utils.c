@@ -35,6 +35,7 @@ __RCSID("$NetBSD: apropos-utils.c,v 1.7 2012/10/06 15:33:59 wiz Exp $");
 
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <assert.h>
 #include <ctype.h>
@@ -43,11 +44,13 @@ __RCSID("$NetBSD: apropos-utils.c,v 1.7 2012/10/06 15:33:59 wiz Exp $");
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <util.h>
-#include <zlib.h>
 
 #include "apropos-utils.h"
 #include "manconf.h"
+#include "mandb-codec.h"
+#include "mandb-fold.h"
 #include "mandoc.h"
 #include "sqlite3.h"
 
@@ -86,6 +89,104 @@ static const double col_weights[] = {
 };
 
 #include "stopwords.c"
+
+#define NSTOPWORDS	(sizeof(stopwords) / sizeof(stopwords[0]))
+
+/*
+ * The stopwords which are the names of pages, such as at(1) and last(1),
+ * and which are indexed and searched for like the other words. makemandb
+ * picks them when it builds the index from scratch and keeps them in
+ * mandb_info, from where open_db reads them, so that the queries are
+ * tokenized like the pages were.
+ */
+static char name_stopwords[NSTOPWORDS];
+
+/*
+ * is_stopword --
+ *  Returns non-zero if the len bytes at word are one of the stopwords, and
+ *  not the name of a page.
+ */
+int
+is_stopword(const char *word, size_t len)
+{
+	size_t idx;
+
+	idx = stopwords_hash(word, len);
+	return strncmp(stopwords[idx], word, len) == 0 &&
+	    stopwords[idx][len] == '\0' && !name_stopwords[idx];
+}
+
+/*
+ * parse_name_stopwords --
+ *  Sets the stopwords kept as names of pages to those of the space
+ *  separated list.
+ */
+static void
+parse_name_stopwords(const char *list)
+{
+	size_t idx, len;
+
+	memset(name_stopwords, 0, sizeof(name_stopwords));
+	for (; *list != '\0'; list += len) {
+		list += strspn(list, " ");
+		if ((len = strcspn(list, " ")) == 0)
+			break;
+		idx = stopwords_hash(list, len);
+		if (strncmp(stopwords[idx], list, len) == 0 &&
+		    stopwords[idx][len] == '\0')
+			name_stopwords[idx] = 1;
+	}
+}
+
+/*
+ * load_name_stopwords --
+ *  Reads the stopwords kept as names of pages from mandb_info. They are
+ *  left as they are if the database does not have them, like the shards
+ *  which makemandb builds with the ones of the main database.
+ */
+static void
+load_name_stopwords(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *list;
+
+	if (sqlite3_prepare_v2(db, "SELECT value FROM mandb_info"
+	    " WHERE name = 'name_stopwords'", -1, &stmt, NULL) != SQLITE_OK)
+		return;
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    (list = (const char *) sqlite3_column_text(stmt, 0)) != NULL)
+		parse_name_stopwords(list);
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * set_name_stopwords --
+ *  Keeps the stopwords found in the space separated list of the names of
+ *  the pages as words of the index, and records them in mandb_info. It has
+ *  to be called before any page is indexed. Returns -1 on failure.
+ */
+int
+set_name_stopwords(sqlite3 *db, const char *names)
+{
+	char *list = NULL;
+	char *sqlstr;
+	size_t idx;
+	int rc;
+
+	parse_name_stopwords(names);
+	for (idx = 0; idx < NSTOPWORDS; idx++)
+		if (name_stopwords[idx])
+			concat(&list, stopwords[idx]);
+	sqlstr = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS mandb_info"
+	    "(name PRIMARY KEY, value); "
+	    "INSERT OR REPLACE INTO mandb_info VALUES ('name_stopwords', %Q)",
+	    list != NULL ? list : "");
+	rc = sqlite3_exec(db, sqlstr, NULL, NULL, NULL);
+	sqlite3_free(sqlstr);
+	free(list);
+	return rc == SQLITE_OK ? 0 : -1;
+}
+
 /*
  * remove_stopwords--
  *  Scans the query and removes any stop words from it.
@@ -95,7 +196,7 @@ static const double col_weights[] = {
 char *
 remove_stopwords(const char *query)
 {
-	size_t len, idx;
+	size_t len;
 	char *output, *buf;
 	const char *sep, *next;
 
@@ -112,9 +213,7 @@ remove_stopwords(const char *query)
 		}
 		if (len == 0)
 			continue;
-		idx = stopwords_hash(query, len);
-		if (memcmp(stopwords[idx], query, len) == 0 &&
-		    stopwords[idx][len] == '\0')
+		if (is_stopword(query, len))
 			continue;
 		memcpy(buf, query, len);
 		buf += len;
@@ -129,20 +228,295 @@ remove_stopwords(const char *query)
 	return output;
 }
 
+/*
+ * The interface of the FTS tokenizers, as declared in fts3_tokenizer.h of
+ * SQLite, which is not installed with it.
+ */
+typedef struct sqlite3_tokenizer_module sqlite3_tokenizer_module;
+typedef struct sqlite3_tokenizer sqlite3_tokenizer;
+typedef struct sqlite3_tokenizer_cursor sqlite3_tokenizer_cursor;
+
+struct sqlite3_tokenizer_module {
+	int iVersion;
+	int (*xCreate)(int, const char *const *, sqlite3_tokenizer **);
+	int (*xDestroy)(sqlite3_tokenizer *);
+	int (*xOpen)(sqlite3_tokenizer *, const char *, int,
+	    sqlite3_tokenizer_cursor **);
+	int (*xClose)(sqlite3_tokenizer_cursor *);
+	int (*xNext)(sqlite3_tokenizer_cursor *, const char **, int *, int *,
+	    int *, int *);
+};
+
+struct sqlite3_tokenizer {
+	const sqlite3_tokenizer_module *pModule;
+};
+
+struct sqlite3_tokenizer_cursor {
+	sqlite3_tokenizer *pTokenizer;
+};
+
+/* At least the length of the longest stopword, longer tokens are not */
+#define STOPWORD_MAXLEN 16
+
+/*
+ * The apropos tokenizer of mandb: the porter tokenizer of SQLite, with the
+ * text folded by fold_text first, so that it works on UTF-8, and with the
+ * stopwords left out, but for the names of pages and for a stopword which
+ * is the whole text, such as the value of the section column, e.g. 3.
+ * The words are still split and stemmed by porter, so the stems of ASCII
+ * words do not depend on the version of apropos. With the "words" argument the folded words are
+ * returned as they are, neither stemmed nor filtered, for mandb_dict.
+ */
+typedef struct stop_tokenizer {
+	sqlite3_tokenizer base;
+	sqlite3_tokenizer *porter;
+	int words;		// return the words, unstemmed
+} stop_tokenizer;
+
+typedef struct stop_cursor {
+	sqlite3_tokenizer_cursor base;
+	sqlite3_tokenizer_cursor *porter;
+	const char *text;	// the input, or the folded input
+	size_t len;
+	char *folded;		// the folded input, if it was not ASCII
+	int *offsets;		// offsets in the input of the bytes of folded
+	size_t next;		// with words, offset of the next word in text
+	char *word;		// with words, the last word returned
+	size_t wordsize;
+	int position;		// of the next token which is not a stopword
+} stop_cursor;
+
+/* The porter module, looked up in the first database opened */
+static const sqlite3_tokenizer_module *porter_module;
+
+static int
+stop_create(int argc, const char *const *argv, sqlite3_tokenizer **pp)
+{
+	stop_tokenizer *t;
+	int rc;
+
+	t = emalloc(sizeof(*t));
+	t->words = argc > 0 && strcmp(argv[0], "words") == 0;
+	rc = porter_module->xCreate(0, NULL, &t->porter);
+	if (rc != SQLITE_OK) {
+		free(t);
+		return rc;
+	}
+	t->porter->pModule = porter_module;
+	*pp = &t->base;
+	return SQLITE_OK;
+}
+
+static int
+stop_destroy(sqlite3_tokenizer *base)
+{
+	stop_tokenizer *t = (stop_tokenizer *) base;
+
+	porter_module->xDestroy(t->porter);
+	free(t);
+	return SQLITE_OK;
+}
+
+/*
+ * stop_open --
+ *  Starts tokenizing input. The text is only folded if it is not all
+ *  ASCII, porter lowers the ASCII letters itself.
+ */
+static int
+stop_open(sqlite3_tokenizer *base, const char *input, int len,
+    sqlite3_tokenizer_cursor **pp)
+{
+	stop_tokenizer *t = (stop_tokenizer *) base;
+	stop_cursor *c;
+	int rc;
+
+	c = emalloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->len = len < 0 ? strlen(input) : (size_t) len;
+	c->text = input;
+	if (ascii_span(input, c->len) < c->len) {
+		c->folded = fold_text(input, c->len, &c->len, &c->offsets);
+		c->text = c->folded;
+	}
+	if (!t->words) {
+		rc = porter_module->xOpen(t->porter, c->text, c->len,
+		    &c->porter);
+		if (rc != SQLITE_OK) {
+			free(c->folded);
+			free(c->offsets);
+			free(c);
+			return rc;
+		}
+		c->porter->pTokenizer = t->porter;
+	}
+	*pp = &c->base;
+	return SQLITE_OK;
+}
+
+static int
+stop_close(sqlite3_tokenizer_cursor *base)
+{
+	stop_cursor *c = (stop_cursor *) base;
+
+	if (c->porter != NULL)
+		porter_module->xClose(c->porter);
+	free(c->folded);
+	free(c->offsets);
+	free(c->word);
+	free(c);
+	return SQLITE_OK;
+}
+
+/*
+ * next_stop_word --
+ *  Returns the next word of the text, in lower case, for the "words"
+ *  variant of the tokenizer.
+ */
+static int
+next_stop_word(stop_cursor *c, const char **token, int *len, int *start,
+    int *end)
+{
+	size_t from, to, i;
+
+	from = c->next;
+	if (!next_word(c->text, c->len, &from, &to))
+		return SQLITE_DONE;
+	c->next = to;
+	if (to - from > c->wordsize) {
+		c->wordsize = to - from;
+		c->word = erealloc(c->word, c->wordsize);
+	}
+	for (i = from; i < to; i++)
+		c->word[i - from] = c->text[i] >= 'A' && c->text[i] <= 'Z' ?
+		    c->text[i] - 'A' + 'a' : c->text[i];
+	*token = c->word;
+	*len = to - from;
+	*start = from;
+	*end = to;
+	return SQLITE_OK;
+}
+
+/*
+ * stop_next --
+ *  Returns the next token of porter which is not a stopword. The stopwords
+ *  do not take positions, so that the words around them are next to each
+ *  other in phrases, as they are in the queries they are left out of.
+ */
+static int
+stop_next(sqlite3_tokenizer_cursor *base, const char **token, int *len,
+    int *start, int *end, int *position)
+{
+	stop_cursor *c = (stop_cursor *) base;
+	char word[STOPWORD_MAXLEN];
+	const char *p;
+	int n, i, pos;
+	int rc;
+
+	if (c->porter == NULL)
+		rc = next_stop_word(c, token, len, start, end);
+	else for (;;) {
+		rc = porter_module->xNext(c->porter, token, len, start, end,
+		    &pos);
+		if (rc != SQLITE_OK)
+			break;
+		/* The stopwords are ASCII, compared with the unstemmed word */
+		n = *end - *start;
+		if (n > STOPWORD_MAXLEN)
+			break;
+		p = c->text + *start;
+		for (i = 0; i < n; i++) {
+			if (p[i] & 0x80)
+				break;
+			word[i] = p[i] >= 'A' && p[i] <= 'Z' ?
+			    p[i] - 'A' + 'a' : p[i];
+		}
+		if (i < n || !is_stopword(word, n) ||
+		    (*start == 0 && (size_t) *end == c->len))
+			break;
+	}
+	if (rc != SQLITE_OK)
+		return rc;
+	if (c->offsets != NULL) {
+		*start = c->offsets[*start];
+		*end = c->offsets[*end];
+	}
+	*position = c->position++;
+	return SQLITE_OK;
+}
+
+static const sqlite3_tokenizer_module stop_module = {
+	0,
+	stop_create,
+	stop_destroy,
+	stop_open,
+	stop_close,
+	stop_next
+};
+
+/*
+ * register_tokenizer --
+ *  Registers the apropos tokenizer with the database connection. The
+ *  modules are passed to fts3_tokenizer as pointers, which it only takes
+ *  as bound parameters, or when it has been enabled. Returns -1 on failure.
+ */
+static int
+register_tokenizer(sqlite3 *db)
+{
+	const sqlite3_tokenizer_module *module = &stop_module;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (porter_module == NULL) {
+		rc = sqlite3_prepare_v2(db, "SELECT fts3_tokenizer('porter')",
+		    -1, &stmt, NULL);
+		if (rc != SQLITE_OK)
+			return -1;
+		if (sqlite3_step(stmt) == SQLITE_ROW &&
+		    sqlite3_column_bytes(stmt, 0) == sizeof(porter_module))
+			memcpy(&porter_module, sqlite3_column_blob(stmt, 0),
+			    sizeof(porter_module));
+		sqlite3_finalize(stmt);
+		if (porter_module == NULL)
+			return -1;
+	}
+
+	rc = sqlite3_prepare_v2(db, "SELECT fts3_tokenizer('apropos', ?)", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	sqlite3_bind_blob(stmt, 1, &module, sizeof(module), SQLITE_STATIC);
+#ifdef SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER
+	sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER, 1, NULL);
+#endif
+	rc = sqlite3_step(stmt);
+#ifdef SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER
+	sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER, 0, NULL);
+#endif
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_ROW ? 0 : -1;
+}
+
 /*
  * lower --
- *  Converts the string str to lower case
+ *  Converts the UTF-8 string str to lower case and folds its diacritics,
+ *  in place, the way the pages are indexed.
  */
 char *
 lower(char *str)
 {
 	assert(str);
-	int i = 0;
-	char c;
-	while (str[i] != '\0') {
-		c = tolower((unsigned char) str[i]);
-		str[i++] = c;
+	const char *s = str;
+	const char *end = str + strlen(str);
+	char *out = str;
+	char c[FOLD_MAX];
+	size_t n;
+
+	while (s < end) {
+		n = fold_char(&s, end, c);
+		memcpy(out, c, n);
+		out += n;
 	}
+	*out = '\0';
 	return str;
 }
 
@@ -191,6 +565,76 @@ close_db(sqlite3 *db)
 	sqlite3_shutdown();
 }
 
+/*
+ * Secondary indexes of the database. They are kept separate from the table
+ * definitions so that makemandb can drop them for a bulk load and build
+ * them in one go afterwards.
+ */
+static const struct {
+	const char *name;
+	const char *def;
+	int unique;
+} db_indexes[] = {
+	{ "index_mandb_links", "mandb_links (link)", 0 },
+	{ "index_mandb_meta_dev", "mandb_meta (device, inode)", 0 },
+	{ "index_mandb_links_md5", "mandb_links (md5_hash)", 0 },
+	{ "index_mandb_meta_file", "mandb_meta (file)", 1 },
+	{ "index_mandb_xrefs_name", "mandb_xrefs (name COLLATE NOCASE)", 0 },
+};
+
+/*
+ * create_db_indexes --
+ *  Creates the secondary indexes of the database, if they do not exist.
+ *  Returns -1 if an index could not be created, e.g. because a UNIQUE
+ *  index found duplicate entries.
+ */
+int
+create_db_indexes(sqlite3 *db)
+{
+	char *sqlstr;
+	char *errmsg = NULL;
+	size_t i;
+
+	for (i = 0; i < __arraycount(db_indexes); i++) {
+		sqlstr = sqlite3_mprintf("CREATE %s INDEX IF NOT EXISTS %s ON %s",
+		    db_indexes[i].unique ? "UNIQUE" : "", db_indexes[i].name,
+		    db_indexes[i].def);
+		sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+		sqlite3_free(sqlstr);
+		if (errmsg != NULL) {
+			warnx("%s", errmsg);
+			sqlite3_free(errmsg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * drop_db_indexes --
+ *  Drops the secondary indexes created by create_db_indexes.
+ */
+int
+drop_db_indexes(sqlite3 *db)
+{
+	char *sqlstr;
+	char *errmsg = NULL;
+	size_t i;
+
+	for (i = 0; i < __arraycount(db_indexes); i++) {
+		sqlstr = sqlite3_mprintf("DROP INDEX IF EXISTS %s",
+		    db_indexes[i].name);
+		sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+		sqlite3_free(sqlstr);
+		if (errmsg != NULL) {
+			warnx("%s", errmsg);
+			sqlite3_free(errmsg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
  * create_db --
  *  Creates the database schema.
@@ -220,28 +664,53 @@ create_db(sqlite3 *db)
 	sqlstr = "CREATE VIRTUAL TABLE mandb USING fts4(section, name, "
 			    "name_desc, desc, lib, return_vals, env, files, "
 			    "exit_status, diagnostics, errors, md5_hash UNIQUE, machine, "
-			    "compress=zip, uncompress=unzip, tokenize=porter); "	//mandb
+			    "compress=zip, uncompress=unzip, tokenize=apropos); "	//mandb
 			"CREATE TABLE IF NOT EXISTS mandb_meta(device, inode, mtime, "
-			    "file UNIQUE, md5_hash UNIQUE, id  INTEGER PRIMARY KEY); "
+			    "file, md5_hash UNIQUE, id  INTEGER PRIMARY KEY); "
 				//mandb_meta
 			"CREATE TABLE IF NOT EXISTS mandb_links(link, target, section, "
 			    "machine, md5_hash); "	//mandb_links
-			"CREATE TABLE mandb_dict(word UNIQUE, frequency);";	//mandb_dict;
+			"CREATE TABLE mandb_dict(word UNIQUE, frequency); "	//mandb_dict
+			"CREATE TABLE mandb_facets(kind, value, docids, "
+			    "PRIMARY KEY(kind, value)); "	//mandb_facets
+			"CREATE TABLE mandb_info(name PRIMARY KEY, value); "
+			"INSERT INTO mandb_info VALUES ('codec', '" CODEC_DEFAULT "'); "
+				//mandb_info
+			"CREATE TABLE mandb_names(name COLLATE NOCASE, section, "
+			    "machine, name_desc, docid, PRIMARY KEY(name, docid)) "
+			    "WITHOUT ROWID; "	//mandb_names
+			"CREATE TABLE mandb_catalog(docid INTEGER PRIMARY KEY, "
+			    "section, name, name_desc, machine, title, "
+			    "prior DEFAULT 1); "
+			"CREATE INDEX index_mandb_catalog_section ON "
+			    "mandb_catalog (section, title); "	//mandb_catalog
+			"CREATE TABLE mandb_symbols(symbol, kind, docid, "
+			    "PRIMARY KEY(symbol, kind, docid)) WITHOUT ROWID; "
+				//mandb_symbols
+			"CREATE TABLE mandb_xrefs(docid, name, section, "
+			    "PRIMARY KEY(docid, name, section)) WITHOUT ROWID; "
+				//mandb_xrefs
+			"CREATE TABLE mandb_graph(src, dst, "
+			    "PRIMARY KEY(src, dst)) WITHOUT ROWID; "
+			"CREATE INDEX index_mandb_graph_dst ON mandb_graph (dst); "
+				//mandb_graph
+			"CREATE TABLE mandb_signatures(name, section, docid, "
+			    "simhash, PRIMARY KEY(name, section, docid)) "
+			    "WITHOUT ROWID; "	//mandb_signatures
+			"CREATE TABLE mandb_variants(device, inode, mtime, "
+			    "file PRIMARY KEY, md5_hash, docid, machine);";
+				//mandb_variants
 
 
 	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
 	if (errmsg != NULL)
 		goto out;
 
-	sqlstr = "CREATE INDEX IF NOT EXISTS index_mandb_links ON mandb_links "
-			"(link); "
-			"CREATE INDEX IF NOT EXISTS index_mandb_meta_dev ON mandb_meta "
-			"(device, inode); "
-			"CREATE INDEX IF NOT EXISTS index_mandb_links_md5 ON mandb_links "
-			"(md5_hash);";
-	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
-	if (errmsg != NULL)
-		goto out;
+	if (create_db_indexes(db) < 0) {
+		sqlite3_close(db);
+		sqlite3_shutdown();
+		return -1;
+	}
 	return 0;
 
 out:
@@ -253,66 +722,23 @@ out:
 }
 
 /*
- * zip --
- *  User defined Sqlite function to compress the FTS table
- */
-static void
-zip(sqlite3_context *pctx, int nval, sqlite3_value **apval)
-{	
-	int nin;
-	long int nout;
-	const unsigned char * inbuf;
-	unsigned char *outbuf;
-
-	assert(nval == 1);
-	nin = sqlite3_value_bytes(apval[0]);
-	inbuf = (const unsigned char *) sqlite3_value_blob(apval[0]);
-	nout = nin + 13 + (nin + 999) / 1000;
-	outbuf = emalloc(nout);
-	compress(outbuf, (unsigned long *) &nout, inbuf, nin);
-	sqlite3_result_blob(pctx, outbuf, nout, free);
-}
-
-/*
- * unzip --
- *  User defined Sqlite function to uncompress the FTS table.
+ * get_db_generation --
+ *  Returns the generation number of the index, which makemandb increments
+ *  on every update of the index, or -1 if the index does not have one.
  */
-static void
-unzip(sqlite3_context *pctx, int nval, sqlite3_value **apval)
+sqlite3_int64
+get_db_generation(sqlite3 *db)
 {
-	unsigned int rc;
-	unsigned char *outbuf;
-	z_stream stream;
-
-	assert(nval == 1);
-	stream.next_in = __UNCONST(sqlite3_value_blob(apval[0]));
-	stream.avail_in = sqlite3_value_bytes(apval[0]);
-	stream.avail_out = stream.avail_in * 2 + 100;
-	stream.next_out = outbuf = emalloc(stream.avail_out);
-	stream.zalloc = NULL;
-	stream.zfree = NULL;
-
-	if (inflateInit(&stream) != Z_OK) {
-		free(outbuf);
-		return;
-	}
+	sqlite3_stmt *stmt;
+	sqlite3_int64 generation = -1;
 
-	while ((rc = inflate(&stream, Z_SYNC_FLUSH)) != Z_STREAM_END) {
-		if (rc != Z_OK ||
-		    (stream.avail_out != 0 && stream.avail_in == 0)) {
-			free(outbuf);
-			return;
-		}
-		outbuf = erealloc(outbuf, stream.total_out * 2);
-		stream.next_out = outbuf + stream.total_out;
-		stream.avail_out = stream.total_out;
-	}
-	if (inflateEnd(&stream) != Z_OK) {
-		free(outbuf);
-		return;
-	}
-	outbuf = erealloc(outbuf, stream.total_out);
-	sqlite3_result_text(pctx, (const char *) outbuf, stream.total_out, free);
+	if (sqlite3_prepare_v2(db, "SELECT value FROM mandb_info "
+	    "WHERE name = 'generation'", -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		generation = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return generation;
 }
 
 /*
@@ -354,6 +780,19 @@ get_dbpath(const char *manconf)
  */
 sqlite3 *
 init_db(int db_flag, const char *manconf)
+{
+	char *dbpath = get_dbpath(manconf);
+	if (dbpath == NULL)
+		errx(EXIT_FAILURE, "_mandb entry not found in man.conf");
+	return open_db(db_flag, dbpath);
+}
+
+/* open_db --
+ *   Same as init_db, but opens the database file at dbpath instead of the one
+ *   configured in man.conf.
+ */
+sqlite3 *
+open_db(int db_flag, const char *dbpath)
 {
 	sqlite3 *db = NULL;
 	sqlite3_stmt *stmt;
@@ -361,9 +800,6 @@ init_db(int db_flag, const char *manconf)
 	int rc;
 	int create_db_flag = 0;
 
-	char *dbpath = get_dbpath(manconf);
-	if (dbpath == NULL)
-		errx(EXIT_FAILURE, "_mandb entry not found in man.conf");
 	/* Check if the database exists or not */
 	if (!(stat(dbpath, &sb) == 0 && S_ISREG(sb.st_mode))) {
 		/* Database does not exist, check if DB_CREATE was specified, and set
@@ -387,6 +823,13 @@ init_db(int db_flag, const char *manconf)
 		return NULL;
 	}
 
+	/* The FTS table cannot be created or read without it */
+	if (register_tokenizer(db) < 0) {
+		warnx("Unable to register the tokenizer: %s",
+		    sqlite3_errmsg(db));
+		goto error;
+	}
+
 	if (create_db_flag && create_db(db) < 0) {
 		warnx("%s", "Unable to create database schema");
 		goto error;
@@ -413,22 +856,11 @@ init_db(int db_flag, const char *manconf)
 	sqlite3_finalize(stmt);
 
 	sqlite3_extended_result_codes(db, 1);
+	load_name_stopwords(db);
 	
 	/* Register the zip and unzip functions for FTS compression */
-	rc = sqlite3_create_function(db, "zip", 1, SQLITE_ANY, NULL, zip, NULL, NULL);
-	if (rc != SQLITE_OK) {
-		warnx("Unable to register function: compress: %s",
-		    sqlite3_errmsg(db));
-		goto error;
-	}
-
-	rc = sqlite3_create_function(db, "unzip", 1, SQLITE_ANY, NULL, 
-                                 unzip, NULL, NULL);
-	if (rc != SQLITE_OK) {
-		warnx("Unable to register function: uncompress: %s",
-		    sqlite3_errmsg(db));
+	if (codec_register(db) < 0)
 		goto error;
-	}
 	return db;
 
 error:
@@ -698,6 +1130,7 @@ get_suggestions(sqlite3 *db, char *query)
 	char *temp;
 	char *sqlstr;
 	int count;
+	int nrows;
 	int rc;
 	sqlite3_stmt *stmt;
 
@@ -715,17 +1148,20 @@ get_suggestions(sqlite3 *db, char *query)
 	easprintf(&sqlstr, "SELECT word FROM mandb_dict "
 						"WHERE word IN %s ORDER BY frequency DESC LIMIT 10", termlist);
 	rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+	free(sqlstr);
+	free(termlist);
 	if (rc != SQLITE_OK) {
 		warnx("%s", sqlite3_errmsg(db));
+		free_list(list, count);
 		return NULL;
 	}
 	easprintf(&temp, "{\n{ query:\'%s%s%s\',\n "
 			"suggestions:[", query ? query : "", query ? " " : "", term);
 	concat(&retval, temp);
 	free(temp);
-	count = 0;
+	nrows = 0;
 	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		if (count++)
+		if (nrows++)
 			concat(&retval, ",");
 		easprintf(&temp, "\'%s %s\'\n", query ? query : "",sqlite3_column_text(stmt, 0));
 		concat(&retval, temp);
@@ -733,8 +1169,6 @@ get_suggestions(sqlite3 *db, char *query)
 	}
 	concat(&retval, "]\n}");
 	sqlite3_finalize(stmt);
-	free(sqlstr);
-	free(termlist);
 	free_list(list, count);
 	return retval;
 }
@@ -753,6 +1187,10 @@ get_suggestions(sqlite3 *db, char *query)
  *
  *  Inverse document frequency of t = log(Total number of documents / 
  *										Number of documents in which t occurs)
+ *
+ *  If a second argument is given, it is the prior of the document, its
+ *  rank independent of the query computed by makemandb from the references
+ *  between the pages, and the score is multiplied by it.
  */
 static void
 rank_func(sqlite3_context *pctx, int nval, sqlite3_value **apval)
@@ -767,7 +1205,7 @@ rank_func(sqlite3_context *pctx, int nval, sqlite3_value **apval)
 	int doclen = 0;
 	const double k = 3.75;
 	/* Check that the number of arguments passed to this function is correct. */
-	assert(nval == 1);
+	assert(nval == 1 || nval == 2);
 
 	matchinfo = (const unsigned int *) sqlite3_value_blob(apval[0]);
 	nphrase = matchinfo[0];
@@ -808,375 +1246,2571 @@ rank_func(sqlite3_context *pctx, int nval, sqlite3_value **apval)
 	 *  The value of k is experimental
 	 */
 	double score = (tf * idf->value/ ( k + tf)) ;
+	if (nval == 2 && sqlite3_value_type(apval[1]) != SQLITE_NULL)
+		score *= sqlite3_value_double(apval[1]);
 	sqlite3_result_double(pctx, score);
 	return;
 }
 
 /*
- *  run_query --
- *  Performs the searches for the keywords entered by the user.
- *  The 2nd param: snippet_args is an array of strings providing values for the
- *  last three parameters to the snippet function of sqlite. (Look at the docs).
- *  The 3rd param: args contains rest of the search parameters. Look at 
- *  arpopos-utils.h for the description of individual fields.
- *  
+ * Number of prepared statements kept by a query session, and the bits of a
+ * statement's shape.
  */
-int
-run_query(sqlite3 *db, const char *snippet_args[3], query_args *args)
-{
-	const char *default_snippet_args[3];
-	char *section_clause = NULL;
-	char *limit_clause = NULL;
-	char *machine_clause = NULL;
-	char *query;
-	const char *section;
-	char *name;
-	const char *name_desc;
-	const char *machine;
-	const char *snippet;
-	const char *name_temp;
-	char *slash_ptr;
-	char *m = NULL;
-	int rc;
-	inverse_document_frequency idf = {0, 0};
-	sqlite3_stmt *stmt;
+#define SESSION_NSTMT	8
+#define SHAPE_FACETS	0x01
+#define SHAPE_PRIORS	0x02
 
-	if (args->machine)
-		easprintf(&machine_clause, "AND machine = \'%s\' ", args->machine);
+/*
+ * Number of matches whose snippets are fetched at once. The first batch is
+ * small so that the first screen of results can be shown right away, and
+ * every batch after it is twice as big, up to FETCH_MAX.
+ */
+#define FETCH_FIRST	32
+#define FETCH_MAX	1024
 
-	/* Register the rank function */
-	rc = sqlite3_create_function(db, "rank_func", 1, SQLITE_ANY, (void *)&idf, 
-	                             rank_func, NULL, NULL);
-	if (rc != SQLITE_OK) {
-		warnx("Unable to register the ranking function: %s",
-		    sqlite3_errmsg(db));
-		sqlite3_close(db);
-		sqlite3_shutdown();
-		exit(EXIT_FAILURE);
-	}
-	
-	/* We want to build a query of the form: "select x,y,z from mandb where
-	 * mandb match :query [AND (section LIKE '1' OR section LIKE '2' OR...)]
-	 * ORDER BY rank DESC..."
-	 * NOTES: 1. The portion in square brackets is optional, it will be there 
-	 * only if the user has specified an option on the command line to search in 
-	 * one or more specific sections.
-	 * 2. I am using LIKE operator because '=' or IN operators do not seem to be
-	 * working with the compression option enabled.
-	 */
+/*
+ * Number of virtual machine instructions between two checks of the time
+ * budget of a query.
+ */
+#define PROGRESS_OPS	1000
 
-	if (args->sec_nums) {
-		char *temp;
-		int i;
+/*
+ * Most words of mandb_dict read to tell how often the words with a given
+ * stem occur.
+ */
+#define DICT_SCAN	256
 
-		for (i = 0; i < SECMAX; i++) {
-			if (args->sec_nums[i] == 0)
-				continue;
-			easprintf(&temp, " OR section = \'%d\'", i + 1);
-			if (section_clause) {
-				concat(&section_clause, temp);
-				free(temp);
-			} else {
-				section_clause = temp;
-			}
-		}
-		if (section_clause) {
-			/*
-			 * At least one section requested, add glue for query.
-			 */
-			temp = section_clause;
-			/* Skip " OR " before first term. */
-			easprintf(&section_clause, " AND (%s)", temp + 4);
-			free(temp);
-		}
-	}
-	if (args->nrec >= 0) {
-		/* Use the provided number of records and offset */
-		easprintf(&limit_clause, " LIMIT %d OFFSET %d",
-		    args->nrec, args->offset);
-	}
+/*
+ * Added to the rank of the pages named exactly like a one word query, so
+ * that they come before all the other matches.
+ */
+#define EXACT_BOOST	1e12
 
-	if (snippet_args == NULL) {
-		default_snippet_args[0] = "";
-		default_snippet_args[1] = "";
-		default_snippet_args[2] = "...";
-		snippet_args = default_snippet_args;
-	}
-	query = sqlite3_mprintf("SELECT section, name, name_desc, machine,"
-	    " snippet(mandb, %Q, %Q, %Q, -1, 40 ),"
-	    " rank_func(matchinfo(mandb, \"pclxn\")) AS rank"
-	    " FROM mandb"
-	    " WHERE mandb MATCH %Q %s "
-	    "%s"
-	    " ORDER BY rank DESC"
-	    "%s",
-	    snippet_args[0], snippet_args[1], snippet_args[2], args->search_str,
-	    machine_clause ? machine_clause : "",
-	    section_clause ? section_clause : "",
-	    limit_clause ? limit_clause : "");
-
-	free(machine_clause);
-	free(section_clause);
-	free(limit_clause);
-
-	if (query == NULL) {
-		*args->errmsg = estrdup("malloc failed");
-		return -1;
-	}
-	rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-	if (rc == SQLITE_IOERR) {
-		warnx("Corrupt database. Please rerun makemandb");
-		sqlite3_free(query);
-		return -1;
-	} else if (rc != SQLITE_OK) {
-		warnx("%s", sqlite3_errmsg(db));
-		sqlite3_free(query);
-		return -1;
-	}
+/*
+ * Number of tokens of the DESCRIPTION shown in a snippet, how many of them
+ * come before the first match, and the most query words it highlights.
+ */
+#define SNIPPET_TOKENS	40
+#define SNIPPET_LEAD	4
+#define SNIPPET_MAXTERMS	32
+
+/* Parameter of the ranking statement */
+#define QPARAM_MATCH	1
+
+typedef struct cached_stmt {
+	sqlite3_stmt *stmt;
+	unsigned int shape;
+	unsigned long lastuse;
+} cached_stmt;
+
+/* A docid bitmap of mandb_facets */
+typedef struct facet {
+	char *kind;
+	char *value;
+	unsigned char *bits;
+	size_t len;
+} facet;
+
+/*
+ * The facets a query is restricted to, and where to count its matches in
+ * every section. It is the user data of facet_filter.
+ */
+typedef struct facet_query {
+	int has_machine;
+	const facet *machine;
+	int has_sections;
+	unsigned char *sections;
+	size_t sections_len;
+	const facet *secfacets[SECMAX];
+	int *counts;
+} facet_query;
+
+/* A word of the query, as the apropos tokenizer indexes it */
+typedef struct snippet_term {
+	char *text;
+	size_t len;
+	int prefix;		// matches every token starting with text
+	size_t lead;		// number of bytes a word matching it starts
+				// with, before it is stemmed
+} snippet_term;
+
+/* A token of the text being snippeted */
+typedef struct snippet_token {
+	int start;		// byte offsets of the token in the text
+	int end;
+	int term;		// index of the matching query word, or -1
+} snippet_token;
+
+/* The columns of a fetched match */
+typedef struct page_row {
+	char *section;
+	char *name;
+	char *name_desc;
+	char *snippet;
+} page_row;
+
+struct query_session {
+	sqlite3 *db;
+	int owndb;
+	char *dbpath;			// path of the database, if opened by
+	dev_t dev;			// init_session, and its file
+	ino_t ino;
+	sqlite3_int64 generation;	// generation of the index when opened
+	inverse_document_frequency idf;
+	cached_stmt stmts[SESSION_NSTMT];
+	unsigned long clock;
+	facet *facets;
+	size_t nfacets;
+	int facets_loaded;
+	facet_query fq;
+	struct timespec deadline;	// end of the time budget of a search
+	int interrupted;		// set once query_progress stops a query
+	int preflight;			// 1 if the statements below work, -1 if
+					// not, 0 if not tried yet
+	sqlite3_stmt *stem_stmt;
+	sqlite3_stmt *hits_stmt;
+	int dict_complete;		// 1 if mandb_dict has the words of all
+					// the pages
+	int names_state;		// 1 if names_stmt works, -1 if not
+	sqlite3_stmt *names_stmt;
+	int catalog_state;		// 1 if the database has mandb_catalog,
+					// -1 if not
+	sqlite3_stmt *row_stmt;		// reads the columns of a match
+	int snippet_state;		// 1 if desc_stmt works, -1 if not, 0 if
+					// not tried yet
+	sqlite3_stmt *desc_stmt;
+	snippet_term *terms;		// words of the query to highlight, set
+	size_t nterms;			// if has_terms is
+	int has_terms;
+};
+
+/*
+ * facet_has --
+ *  Returns non-zero if the page with the given docid is set in the bitmap.
+ */
+static int
+facet_has(const unsigned char *bits, size_t len, sqlite3_int64 docid)
+{
+	return docid >= 0 && (size_t) (docid >> 3) < len &&
+	    (bits[docid >> 3] & (1 << (docid & 7)));
+}
+
+/*
+ * facet_filter --
+ *  Sqlite user defined function taking the docid of a matching page.
+ *  It counts the page in its section and returns whether the page belongs
+ *  to the machine and sections the query is restricted to. The counts are
+ *  taken before restricting the sections, so that they tell how many
+ *  matches the other sections have.
+ */
+static void
+facet_filter(sqlite3_context *pctx, int nval, sqlite3_value **apval)
+{
+	facet_query *fq = sqlite3_user_data(pctx);
+	sqlite3_int64 docid;
+	const facet *f;
+	int i;
+
+	assert(nval == 1);
+	docid = sqlite3_value_int64(apval[0]);
+
+	if (fq->has_machine && (fq->machine == NULL ||
+	    !facet_has(fq->machine->bits, fq->machine->len, docid))) {
+		sqlite3_result_int(pctx, 0);
+		return;
+	}
+	if (fq->counts) {
+		for (i = 0; i < SECMAX; i++) {
+			f = fq->secfacets[i];
+			if (f && facet_has(f->bits, f->len, docid))
+				fq->counts[i]++;
+		}
+	}
+	sqlite3_result_int(pctx, !fq->has_sections ||
+	    facet_has(fq->sections, fq->sections_len, docid));
+}
+
+
+/*
+ * new_session --
+ *  Creates a session on top of the connection db and registers the ranking
+ *  and filter functions for it. The connection is closed along with the
+ *  session if owndb is set.
+ */
+static query_session *
+new_session(sqlite3 *db, int owndb)
+{
+	query_session *session;
+	int rc;
+
+	session = emalloc(sizeof(*session));
+	memset(session, 0, sizeof(*session));
+	session->db = db;
+	session->owndb = owndb;
+	session->generation = get_db_generation(db);
+
+	rc = sqlite3_create_function(db, "rank_func", -1, SQLITE_ANY,
+	    (void *)&session->idf, rank_func, NULL, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_create_function(db, "facet_filter", 1, SQLITE_ANY,
+		    (void *)&session->fq, facet_filter, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		warnx("Unable to register the ranking function: %s",
+		    sqlite3_errmsg(db));
+		free(session);
+		return NULL;
+	}
+	return session;
+}
+
+/*
+ * init_session --
+ *  Opens the database like init_db and returns a query session owning the
+ *  connection, or NULL on failure.
+ */
+query_session *
+init_session(int db_flag, const char *manconf)
+{
+	query_session *session;
+	sqlite3 *db;
+	char *dbpath;
+	struct stat sb;
+
+	if ((dbpath = get_dbpath(manconf)) == NULL)
+		errx(EXIT_FAILURE, "_mandb entry not found in man.conf");
+	/* Before opening, so that a file replaced in between is noticed */
+	memset(&sb, 0, sizeof(sb));
+	stat(dbpath, &sb);
+	if ((db = open_db(db_flag, dbpath)) == NULL)
+		return NULL;
+	if ((session = new_session(db, 1)) == NULL) {
+		close_db(db);
+		return NULL;
+	}
+	session->dbpath = estrdup(dbpath);
+	session->dev = sb.st_dev;
+	session->ino = sb.st_ino;
+	return session;
+}
+
+/*
+ * session_stale --
+ *  Returns non-zero if the index was updated since the session was opened,
+ *  or its file was replaced, e.g. by makemandb -f. The session then keeps
+ *  answering from what it read before, and should be opened again.
+ */
+int
+session_stale(query_session *session)
+{
+	struct stat sb;
+
+	if (get_db_generation(session->db) != session->generation)
+		return 1;
+	if (session->dbpath == NULL)
+		return 0;
+	if (stat(session->dbpath, &sb) == -1)
+		return 1;
+	return sb.st_dev != session->dev || sb.st_ino != session->ino;
+}
+
+/*
+ * free_terms --
+ *  Forgets the query words collected for snippets by the last query.
+ */
+static void
+free_terms(query_session *session)
+{
+	size_t i;
+
+	for (i = 0; i < session->nterms; i++)
+		free(session->terms[i].text);
+	free(session->terms);
+	session->terms = NULL;
+	session->nterms = 0;
+	session->has_terms = 0;
+}
+
+/*
+ * close_session --
+ *  Finalizes the cached statements of the session and closes its database
+ *  connection, if it owns one.
+ */
+void
+close_session(query_session *session)
+{
+	size_t i;
+
+	for (i = 0; i < SESSION_NSTMT; i++)
+		sqlite3_finalize(session->stmts[i].stmt);
+	sqlite3_finalize(session->stem_stmt);
+	sqlite3_finalize(session->hits_stmt);
+	sqlite3_finalize(session->names_stmt);
+	sqlite3_finalize(session->row_stmt);
+	sqlite3_finalize(session->desc_stmt);
+	free_terms(session);
+	for (i = 0; i < session->nfacets; i++) {
+		free(session->facets[i].kind);
+		free(session->facets[i].value);
+		free(session->facets[i].bits);
+	}
+	free(session->facets);
+	free(session->fq.sections);
+	free(session->dbpath);
+	if (session->owndb)
+		close_db(session->db);
+	free(session);
+}
+
+/*
+ * session_db --
+ *  Returns the database connection of the session, for the functions which
+ *  take one directly, like spell.
+ */
+sqlite3 *
+session_db(query_session *session)
+{
+	return session->db;
+}
+
+/*
+ * load_facets --
+ *  Reads the bitmaps of mandb_facets into the session, the first time a
+ *  query of the session needs them.
+ */
+static int
+load_facets(query_session *session)
+{
+	sqlite3_stmt *stmt;
+	facet *f;
+	const void *bits;
+	int rc;
+
+	if (session->facets_loaded)
+		return 0;
+
+	rc = sqlite3_prepare_v2(session->db,
+	    "SELECT kind, value, docids FROM mandb_facets", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(session->db));
+		return -1;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		session->facets = erealloc(session->facets,
+		    (session->nfacets + 1) * sizeof(*session->facets));
+		f = &session->facets[session->nfacets++];
+		f->kind = estrdup((const char *) sqlite3_column_text(stmt, 0));
+		f->value = estrdup((const char *) sqlite3_column_text(stmt, 1));
+		bits = sqlite3_column_blob(stmt, 2);
+		f->len = sqlite3_column_bytes(stmt, 2);
+		f->bits = emalloc(f->len + 1);
+		memcpy(f->bits, bits, f->len);
+	}
+	sqlite3_finalize(stmt);
+	session->facets_loaded = 1;
+	return 0;
+}
+
+/*
+ * find_facet --
+ *  Returns the bitmap of the given kind and value, or NULL if no page has
+ *  that value.
+ */
+static const facet *
+find_facet(const query_session *session, const char *kind, const char *value)
+{
+	size_t i;
+
+	for (i = 0; i < session->nfacets; i++)
+		if (strcmp(session->facets[i].kind, kind) == 0 &&
+		    strcmp(session->facets[i].value, value) == 0)
+			return &session->facets[i];
+	return NULL;
+}
+
+/*
+ * set_facet_query --
+ *  Sets up the facet filter of the session for the machine and sections
+ *  of args. The bitmaps of the requested sections are merged into a single
+ *  one. Returns -1 if the facets could not be read.
+ */
+static int
+set_facet_query(query_session *session, const query_args *args)
+{
+	facet_query *fq = &session->fq;
+	const facet *f;
+	char secname[2];
+	size_t j;
+	int i;
+
+	if (load_facets(session) < 0)
+		return -1;
+
+	free(fq->sections);
+	memset(fq, 0, sizeof(*fq));
+	if (args->machine) {
+		fq->has_machine = 1;
+		fq->machine = find_facet(session, "machine", args->machine);
+	}
+	secname[1] = '\0';
+	for (i = 0; i < SECMAX; i++) {
+		secname[0] = '1' + i;
+		fq->secfacets[i] = f = find_facet(session, "section", secname);
+		if (args->sec_nums == NULL || args->sec_nums[i] == 0)
+			continue;
+		fq->has_sections = 1;
+		if (f == NULL)
+			continue;
+		if (f->len > fq->sections_len) {
+			fq->sections = erealloc(fq->sections, f->len);
+			memset(fq->sections + fq->sections_len, 0,
+			    f->len - fq->sections_len);
+			fq->sections_len = f->len;
+		}
+		for (j = 0; j < f->len; j++)
+			fq->sections[j] |= f->bits[j];
+	}
+	if ((fq->counts = args->sec_counts) != NULL)
+		memset(fq->counts, 0, SECMAX * sizeof(*fq->counts));
+	return 0;
+}
+
+/*
+ * query_shape --
+ *  Returns the shape of the statement needed to run the query described by
+ *  args. Queries of the same shape only differ in the bound values.
+ */
+static unsigned int
+query_shape(const query_args *args)
+{
+	unsigned int shape = 0;
+	int i;
+
+	if (args->machine || args->sec_counts)
+		shape |= SHAPE_FACETS;
+	if (args->sec_nums) {
+		for (i = 0; i < SECMAX; i++)
+			if (args->sec_nums[i])
+				shape |= SHAPE_FACETS;
+	}
+	return shape;
+}
+
+/*
+ * build_query_sql --
+ *  Builds the text of the ranking statement for the given shape.
+ *  A search runs in two phases. The ranking statement only computes the
+ *  rank of every match:
+ *  "select docid, rank from mandb where mandb match :query
+ *  [AND facet_filter(docid)]"
+ *  The portion in square brackets is there only if the user has restricted
+ *  the search to some sections or to a machine, or wants the matches
+ *  counted by section. facet_filter only looks at the docid, so the pages
+ *  it rejects are never read from the content table.
+ *  fetch_page then reads the columns and makes the snippets of just the
+ *  pages of the requested page of results, by their docid.
+ *  With SHAPE_PRIORS, the rank is multiplied by the prior of the page in
+ *  mandb_catalog, looked up by its docid for every match.
+ */
+static char *
+build_query_sql(unsigned int shape)
+{
+	char *sql;
+
+	if (shape & SHAPE_PRIORS)
+		sql = estrdup("SELECT docid,"
+		    " rank_func(matchinfo(mandb, \"pclxn\"),"
+		    " (SELECT prior FROM mandb_catalog AS c"
+		    " WHERE c.docid = mandb.docid)) AS rank"
+		    " FROM mandb"
+		    " WHERE mandb MATCH ?1");
+	else
+		sql = estrdup("SELECT docid,"
+		    " rank_func(matchinfo(mandb, \"pclxn\")) AS rank"
+		    " FROM mandb"
+		    " WHERE mandb MATCH ?1");
+	if (shape & SHAPE_FACETS)
+		concat(&sql, "AND facet_filter(docid)");
+	return sql;
+}
+
+/*
+ * session_stmt --
+ *  Returns the prepared statement of the session for the given shape,
+ *  preparing it if it is not cached. The least recently used statement is
+ *  replaced when the cache is full.
+ */
+static sqlite3_stmt *
+session_stmt(query_session *session, unsigned int shape)
+{
+	cached_stmt *cs;
+	cached_stmt *victim = &session->stmts[0];
+	sqlite3_stmt *stmt;
+	char *sql;
+	int rc;
+
+	for (cs = session->stmts; cs < &session->stmts[SESSION_NSTMT]; cs++) {
+		if (cs->stmt && cs->shape == shape) {
+			cs->lastuse = ++session->clock;
+			return cs->stmt;
+		}
+		if (victim->stmt && (cs->stmt == NULL ||
+		    cs->lastuse < victim->lastuse))
+			victim = cs;
+	}
+
+	sql = build_query_sql(shape);
+	rc = sqlite3_prepare_v2(session->db, sql, -1, &stmt, NULL);
+	free(sql);
+	if (rc == SQLITE_IOERR) {
+		warnx("Corrupt database. Please rerun makemandb");
+		return NULL;
+	} else if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(session->db));
+		return NULL;
+	}
+
+	sqlite3_finalize(victim->stmt);
+	victim->stmt = stmt;
+	victim->shape = shape;
+	victim->lastuse = ++session->clock;
+	return stmt;
+}
+
+/*
+ * ranked_before --
+ *  Returns non-zero if the match a comes before b in the results: it has
+ *  a higher rank, or the same rank and a lower docid.
+ */
+static int
+ranked_before(const query_cursor *a, const query_cursor *b)
+{
+	return a->rank > b->rank || (a->rank == b->rank && a->docid < b->docid);
+}
+
+static int
+cmp_ranked(const void *a, const void *b)
+{
+	if (ranked_before(a, b))
+		return -1;
+	return ranked_before(b, a);
+}
+
+/*
+ * heap_push --
+ *  Adds doc to the heap of the n best matches seen so far, whose root is
+ *  the match ranked last.
+ */
+static void
+heap_push(query_cursor *heap, size_t n, const query_cursor *doc)
+{
+	size_t i, parent;
+
+	for (i = n; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!ranked_before(&heap[parent], doc))
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = *doc;
+}
+
+/*
+ * heap_replace --
+ *  Replaces the root of the heap, the match ranked last, with doc.
+ */
+static void
+heap_replace(query_cursor *heap, size_t n, const query_cursor *doc)
+{
+	size_t i, child;
+
+	for (i = 0; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && ranked_before(&heap[child], &heap[child + 1]))
+			child++;
+		if (!ranked_before(doc, &heap[child]))
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = *doc;
+}
+
+/* Whether the deadline of the session has passed */
+static int
+past_deadline(query_session *session)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespeccmp(&now, &session->deadline, >=);
+}
+
+/*
+ * query_progress --
+ *  Progress handler of sqlite, installed while a search with a time budget
+ *  runs. It interrupts the statement being run once the deadline of the
+ *  session has passed.
+ */
+static int
+query_progress(void *data)
+{
+	query_session *session = data;
+
+	if (!past_deadline(session))
+		return 0;
+	session->interrupted = 1;
+	return 1;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+	const sqlite3_int64 *ia = a;
+	const sqlite3_int64 *ib = b;
+
+	return *ia < *ib ? -1 : *ia > *ib;
+}
+
+/*
+ * exact_names --
+ *  If the query is a single word, looks up the pages known by that name in
+ *  mandb_names, and returns their docids sorted, with their number in *np.
+ *  Returns NULL if there are none, or the database has no mandb_names.
+ */
+static sqlite3_int64 *
+exact_names(query_session *session, const char *query, size_t *np)
+{
+	sqlite3_int64 *docids = NULL;
+	size_t n = 0;
+	size_t size = 0;
+
+	*np = 0;
+	if (*query == '\0' || query[strcspn(query, " \"*:()")] != '\0')
+		return NULL;
+	if (session->names_state == 0) {
+		session->names_state = -1;
+		if (sqlite3_prepare_v2(session->db,
+		    "SELECT docid FROM mandb_names WHERE name = ?", -1,
+		    &session->names_stmt, NULL) == SQLITE_OK)
+			session->names_state = 1;
+	}
+	if (session->names_state < 0)
+		return NULL;
+
+	sqlite3_bind_text(session->names_stmt, 1, query, -1, NULL);
+	while (sqlite3_step(session->names_stmt) == SQLITE_ROW) {
+		if (n == size) {
+			size = size ? 2 * size : 8;
+			docids = erealloc(docids, size * sizeof(*docids));
+		}
+		docids[n++] = sqlite3_column_int64(session->names_stmt, 0);
+	}
+	sqlite3_reset(session->names_stmt);
+	qsort(docids, n, sizeof(*docids), cmp_int64);
+	*np = n;
+	return docids;
+}
+
+/*
+ * has_catalog --
+ *  Returns non-zero if the database has mandb_catalog, which makemandb
+ *  builds since it was added.
+ */
+static int
+has_catalog(query_session *session)
+{
+	sqlite3_stmt *stmt;
+
+	if (session->catalog_state != 0)
+		return session->catalog_state > 0;
+	session->catalog_state = -1;
+	if (sqlite3_prepare_v2(session->db, "SELECT 1 FROM sqlite_master "
+	    "WHERE type = 'table' AND name = 'mandb_catalog'", -1, &stmt,
+	    NULL) != SQLITE_OK)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		session->catalog_state = 1;
+	sqlite3_finalize(stmt);
+	return session->catalog_state > 0;
+}
+
+/*
+ * rank_matches --
+ *  The first phase of a search. Ranks all the matches of the query and
+ *  returns the docids and ranks of the requested page of results, best
+ *  first, in *docsp. Only the best offset + nrec matches after the cursor
+ *  are kept while ranking, so deep pages cost about the same as the first.
+ *  The number of matches is stored in args->nhits.
+ *  If the query runs out of its time budget or scans more than the maximum
+ *  number of matches, the ranking stops there and the best of the matches
+ *  scanned so far are returned, with args->truncated set.
+ */
+static int
+rank_matches(query_session *session, query_args *args, query_cursor **docsp,
+    size_t *ndocsp)
+{
+	sqlite3_stmt *stmt;
+	unsigned int shape;
+	query_cursor doc;
+	query_cursor *docs = NULL;
+	sqlite3_int64 *exact;
+	size_t nexact;
+	size_t ndocs = 0;
+	size_t maxdocs = 0;
+	size_t offset;
+	size_t keep = 0;
+	int rc;
+
+	shape = query_shape(args);
+	if (has_catalog(session))
+		shape |= SHAPE_PRIORS;
+	if ((stmt = session_stmt(session, shape)) == NULL)
+		return -1;
+	if ((shape & SHAPE_FACETS) && set_facet_query(session, args) < 0)
+		return -1;
+	sqlite3_bind_text(stmt, QPARAM_MATCH, args->search_str, -1, NULL);
+
+	offset = args->offset > 0 ? args->offset : 0;
+	if (args->nrec >= 0)
+		keep = offset + args->nrec;
+
+	/* rank_func computes the idf afresh from the first row */
+	session->idf.value = 0;
+	session->idf.status = 0;
+
+	/* The pages named like the query come first, without being outranked */
+	exact = exact_names(session, args->search_str, &nexact);
+
+	args->nhits = 0;
+	args->truncated = 0;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (args->maxscan > 0 && args->nhits == args->maxscan) {
+			args->truncated = 1;
+			break;
+		}
+		doc.docid = sqlite3_column_int64(stmt, 0);
+		doc.rank = sqlite3_column_double(stmt, 1);
+		if (exact != NULL && bsearch(&doc.docid, exact, nexact,
+		    sizeof(*exact), cmp_int64) != NULL)
+			doc.rank += EXACT_BOOST;
+		args->nhits++;
+		if (args->after && !ranked_before(args->after, &doc))
+			continue;
+		if (args->nrec >= 0 && ndocs == keep) {
+			if (keep && ranked_before(&doc, &docs[0]))
+				heap_replace(docs, ndocs, &doc);
+			continue;
+		}
+		if (ndocs == maxdocs) {
+			maxdocs = maxdocs ? 2 * maxdocs : 64;
+			if (args->nrec >= 0 && maxdocs > keep)
+				maxdocs = keep;
+			docs = erealloc(docs, maxdocs * sizeof(*docs));
+		}
+		if (args->nrec >= 0)
+			heap_push(docs, ndocs, &doc);
+		else
+			docs[ndocs] = doc;
+		ndocs++;
+	}
+	if (rc == SQLITE_INTERRUPT)
+		args->truncated = 1;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	free(exact);
+
+	qsort(docs, ndocs, sizeof(*docs), cmp_ranked);
+	if (offset >= ndocs) {
+		ndocs = 0;
+	} else if (offset) {
+		ndocs -= offset;
+		memmove(docs, docs + offset, ndocs * sizeof(*docs));
+	}
+	*docsp = docs;
+	*ndocsp = ndocs;
+	return 0;
+}
+
+static char *
+column_strdup(sqlite3_stmt *stmt, int col)
+{
+	const char *s = (const char *) sqlite3_column_text(stmt, col);
+
+	return s ? estrdup(s) : NULL;
+}
+
+/*
+ * stem_word --
+ *  Returns the len bytes at word as the apropos tokenizer indexes them,
+ *  folded and stemmed, or only folded and in lower case if the tokenizer
+ *  cannot be queried. Returns NULL if the word has no stem.
+ */
+static char *
+stem_word(query_session *session, const char *word, size_t len)
+{
+	char *text;
+	size_t i;
+
+	if (session->stem_stmt == NULL) {
+		text = fold_text(word, len, &len, NULL);
+		for (i = 0; i < len; i++)
+			text[i] = tolower((unsigned char) text[i]);
+		return text;
+	}
+	sqlite3_bind_text(session->stem_stmt, 1, word, len, NULL);
+	text = sqlite3_step(session->stem_stmt) == SQLITE_ROW ?
+	    column_strdup(session->stem_stmt, 0) : NULL;
+	sqlite3_reset(session->stem_stmt);
+	return text;
+}
+
+/*
+ * stem_lead --
+ *  Returns the number of leading bytes which a stem of len bytes shares
+ *  with every word stemmed to it. The porter stemmer changes the last byte
+ *  of a word at most. The words it does not stem, those of more than 20
+ *  bytes and those with digits, are cut down to their first and last ten
+ *  or three bytes, so a stem of six bytes or less may keep only three of
+ *  them: "__m68k__" becomes "__mk__".
+ */
+static size_t
+stem_lead(size_t len)
+{
+	size_t lead = len < 2 ? len : len - 1;
+	size_t cap = len <= 6 ? 3 : 10;
+
+	return lead < cap ? lead : cap;
+}
+
+/*
+ * init_preflight --
+ *  Prepares the statements looking up how often a word occurs in the
+ *  pages: fts3tokenize stems the word with the tokenizer of mandb, which
+ *  drops the stopwords, and the words of mandb_dict which may have the same
+ *  stem are read from its index. The FTS index itself is not read. The
+ *  tokenizer table is in the temp schema, so this works on a read-only
+ *  database as well. Returns -1 if the statements are not available.
+ */
+static int
+init_preflight(query_session *session)
+{
+	sqlite3_stmt *stmt;
+
+	if (session->preflight)
+		return session->preflight > 0 ? 0 : -1;
+
+	session->preflight = -1;
+	if (sqlite3_exec(session->db,
+	    "CREATE VIRTUAL TABLE IF NOT EXISTS temp.mandb_tok "
+	    "USING fts3tokenize(apropos)", NULL, NULL, NULL) != SQLITE_OK)
+		return -1;
+	if (sqlite3_prepare_v2(session->db,
+	    "SELECT token FROM temp.mandb_tok WHERE input = ?", -1,
+	    &session->stem_stmt, NULL) != SQLITE_OK)
+		return -1;
+	if (sqlite3_prepare_v2(session->db,
+	    "SELECT word, frequency FROM mandb_dict"
+	    " WHERE word >= ?1 AND word < ?2", -1,
+	    &session->hits_stmt, NULL) != SQLITE_OK)
+		return -1;
+
+	/* makemandb marks mandb_dict once it has the words of all the pages */
+	if (sqlite3_prepare_v2(session->db, "SELECT 1 FROM mandb_info"
+	    " WHERE name = 'dict_complete'", -1, &stmt, NULL) == SQLITE_OK) {
+		session->dict_complete = sqlite3_step(stmt) == SQLITE_ROW;
+		sqlite3_finalize(stmt);
+	}
+	session->preflight = 1;
+	return 0;
+}
+
+/*
+ * word_hits --
+ *  Returns the number of occurrences in the pages of the len bytes at word,
+ *  once stemmed, or -1 if it cannot be told. They are summed over the words
+ *  of mandb_dict with the same stem, which all start with the first
+ *  stem_lead() bytes of it; a stem shared by too many of them is not
+ *  looked up. The number is an upper bound, as mandb_dict keeps the words
+ *  of the pages removed from the index, and 0 is only returned if
+ *  mandb_dict is complete.
+ */
+static sqlite3_int64
+word_hits(query_session *session, const char *word, size_t len)
+{
+	sqlite3_stmt *stmt = session->hits_stmt;
+	sqlite3_int64 hits = 0;
+	char *stem;
+	char *other;
+	char *upper;
+	size_t lead;
+	size_t n = 0;
+
+	if ((stem = stem_word(session, word, len)) == NULL)
+		return -1;
+	lead = stem_lead(strlen(stem));
+	if (lead == 0 || (unsigned char) stem[lead - 1] == 0xff) {
+		free(stem);
+		return -1;
+	}
+	upper = estrdup(stem);
+	upper[lead - 1]++;
+	sqlite3_bind_text(stmt, 1, stem, lead, NULL);
+	sqlite3_bind_text(stmt, 2, upper, lead, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (++n > DICT_SCAN) {
+			hits = -1;
+			break;
+		}
+		other = stem_word(session,
+		    (const char *) sqlite3_column_text(stmt, 0),
+		    sqlite3_column_bytes(stmt, 0));
+		if (other != NULL && strcmp(other, stem) == 0)
+			hits += sqlite3_column_int64(stmt, 1);
+		free(other);
+	}
+	sqlite3_reset(stmt);
+	free(upper);
+	free(stem);
+	if (hits == 0 && !session->dict_complete)
+		return -1;
+	return hits;
+}
+
+/* Whether an estimate of hits a is known to be below the estimate b */
+static int
+fewer_hits(sqlite3_int64 a, sqlite3_int64 b)
+{
+	return a >= 0 && (b < 0 || a < b);
+}
+
+/*
+ * plan_node --
+ *  Estimates how often the node matches from the number of occurrences of
+ *  each of its words, and puts the operands of AND in increasing order of
+ *  their estimates, so that FTS starts with the most selective doclist.
+ *  The estimate is an upper bound, 0 means that nothing can match. The
+ *  estimates ignore column scopes, and prefixes are not looked up.
+ *  Returns -1 if the number cannot be told.
+ */
+static sqlite3_int64
+plan_node(query_session *session, query_node *node)
+{
+	sqlite3_int64 *hits;
+	sqlite3_int64 total = -1;
+	sqlite3_int64 h;
+	query_node *kid;
+	const char *word;
+	const char *end;
+	size_t i, j;
+
+	switch (node->op) {
+	case QUERY_TERM:
+		for (word = node->text; *word != '\0'; word = end) {
+			end = word + strcspn(word, " ");
+			if (node->prefix && *end == '\0')
+				break;
+			h = word_hits(session, word, end - word);
+			if (fewer_hits(h, total))
+				total = h;
+			if (*end == ' ')
+				end++;
+		}
+		return total;
+	case QUERY_OR:
+		total = 0;
+		for (i = 0; i < node->nkids; i++) {
+			h = plan_node(session, node->kids[i]);
+			if (h < 0)
+				total = -1;
+			else if (total >= 0)
+				total += h;
+		}
+		return total;
+	case QUERY_NOT:
+		total = plan_node(session, node->kids[0]);
+		for (i = 1; i < node->nkids; i++)
+			plan_node(session, node->kids[i]);
+		return total;
+	case QUERY_NEAR:
+		for (i = 0; i < node->nkids; i++) {
+			h = plan_node(session, node->kids[i]);
+			if (fewer_hits(h, total))
+				total = h;
+		}
+		return total;
+	case QUERY_AND:
+		break;
+	}
+
+	hits = emalloc(node->nkids * sizeof(*hits));
+	for (i = 0; i < node->nkids; i++) {
+		hits[i] = plan_node(session, node->kids[i]);
+		if (fewer_hits(hits[i], total))
+			total = hits[i];
+	}
+	/* A stable insertion sort, the operands are few */
+	for (i = 1; i < node->nkids; i++) {
+		for (j = i; j > 0 && fewer_hits(hits[j], hits[j - 1]); j--) {
+			h = hits[j];
+			hits[j] = hits[j - 1];
+			hits[j - 1] = h;
+			kid = node->kids[j];
+			node->kids[j] = node->kids[j - 1];
+			node->kids[j - 1] = kid;
+		}
+	}
+	free(hits);
+	return total;
+}
+/*
+ * add_term --
+ *  Adds the len bytes at word to the query words highlighted in snippets,
+ *  stemmed unless they are a prefix. The words of the query are folded
+ *  already.
+ */
+static void
+add_term(query_session *session, const char *word, size_t len, int prefix)
+{
+	snippet_term *term;
+	char *text;
+	size_t i;
+
+	if (session->nterms == SNIPPET_MAXTERMS)
+		return;
+	if (prefix) {
+		text = emalloc(len + 1);
+		for (i = 0; i < len; i++)
+			text[i] = tolower((unsigned char) word[i]);
+		text[len] = '\0';
+	} else if ((text = stem_word(session, word, len)) == NULL)
+		return;
+	len = strlen(text);
+	for (i = 0; i < session->nterms; i++) {
+		term = &session->terms[i];
+		if (term->len == len && term->prefix == prefix &&
+		    memcmp(term->text, text, len) == 0) {
+			free(text);
+			return;
+		}
+	}
+	session->terms = erealloc(session->terms,
+	    (session->nterms + 1) * sizeof(*session->terms));
+	term = &session->terms[session->nterms++];
+	term->text = text;
+	term->len = len;
+	term->prefix = prefix;
+	/* The stem of the words matching a prefix may be shorter than it */
+	if (prefix)
+		term->lead = len < 3 ? len : 3;
+	else
+		term->lead = stem_lead(len);
+}
+
+/*
+ * collect_terms --
+ *  Collects the words of the query which a page may match, to highlight
+ *  them in the snippets of the DESCRIPTION. The words of the operands of
+ *  NOT, after the first one, are left out, and so are the words scoped to
+ *  other columns.
+ */
+static void
+collect_terms(query_session *session, const query_node *node)
+{
+	const char *word;
+	const char *end;
+	size_t i;
+
+	if (node->op != QUERY_TERM) {
+		for (i = 0; i < node->nkids; i++) {
+			if (node->op == QUERY_NOT && i > 0)
+				break;
+			collect_terms(session, node->kids[i]);
+		}
+		return;
+	}
+	if (node->column != NULL && strcmp(node->column, "desc") != 0)
+		return;
+	for (word = node->text; *word != '\0'; word = end) {
+		end = word + strcspn(word, " ");
+		add_term(session, word, end - word,
+		    node->prefix && *end == '\0');
+		if (*end == ' ')
+			end++;
+	}
+}
+
+/*
+ * init_snippets --
+ *  Prepares the statement of the snippets made from the DESCRIPTION only,
+ *  which decompresses just that column of a page. Its words are stemmed
+ *  with the statement of the preflight, if it is available. Returns -1 if
+ *  the statement cannot be prepared.
+ */
+static int
+init_snippets(query_session *session)
+{
+	if (session->snippet_state)
+		return session->snippet_state > 0 ? 0 : -1;
+
+	session->snippet_state = -1;
+	if (sqlite3_prepare_v2(session->db,
+	    "SELECT unzip(c3desc) FROM mandb_content WHERE docid = ?", -1,
+	    &session->desc_stmt, NULL) != SQLITE_OK &&
+	    sqlite3_prepare_v2(session->db,
+	    "SELECT desc FROM mandb WHERE docid = ?", -1,
+	    &session->desc_stmt, NULL) != SQLITE_OK)
+		return -1;
+	session->snippet_state = 1;
+	return 0;
+}
+
+/*
+ * token_term --
+ *  Returns the index of the query word matching the len bytes of token,
+ *  or -1 if none does. The token is only stemmed if it starts like one of
+ *  the query words, or with a character which may fold like one.
+ */
+static int
+token_term(query_session *session, const char *token, size_t len)
+{
+	const snippet_term *term;
+	char *stem = NULL;
+	size_t stemlen = 0;
+	size_t i, j, n;
+	int stepped = 0;
+	int found = -1;
+
+	for (i = 0; i < session->nterms; i++) {
+		term = &session->terms[i];
+		n = term->lead;
+		if (n > len)
+			continue;
+		for (j = 0; j < n; j++)
+			if (tolower((unsigned char) token[j]) != term->text[j])
+				break;
+		/* A word which is not ASCII has to be folded first */
+		if (j < n && (token[j] & 0x80) == 0)
+			continue;
+		if (!stepped) {
+			stepped = 1;
+			if ((stem = stem_word(session, token, len)) == NULL)
+				break;
+			stemlen = strlen(stem);
+		}
+		if ((term->len == stemlen ||
+		    (term->prefix && term->len < stemlen)) &&
+		    memcmp(term->text, stem, term->len) == 0) {
+			found = i;
+			break;
+		}
+	}
+	free(stem);
+	return found;
+}
+
+/*
+ * window_score --
+ *  Scores the window of SNIPPET_TOKENS tokens starting at from: the number
+ *  of different query words it contains, then the number of its matches.
+ */
+static size_t
+window_score(const snippet_token *toks, size_t ntoks, size_t from)
+{
+	unsigned long seen = 0;
+	size_t distinct = 0;
+	size_t matches = 0;
+	size_t i;
+
+	for (i = from; i < ntoks && i < from + SNIPPET_TOKENS; i++) {
+		if (toks[i].term < 0)
+			continue;
+		matches++;
+		if (!(seen & (1UL << toks[i].term))) {
+			seen |= 1UL << toks[i].term;
+			distinct++;
+		}
+	}
+	return distinct * (SNIPPET_TOKENS + 1) + matches;
+}
+
+/*
+ * make_snippet --
+ *  Builds the snippet of a page from the offsets of the query words in its
+ *  DESCRIPTION, like the snippet function of FTS does for all the columns.
+ *  The window of SNIPPET_TOKENS tokens with the most different words is
+ *  shown, the matches are wrapped in the first two of snippet_args and the
+ *  text left out on either side is marked with the third one. A page whose
+ *  DESCRIPTION has no match gets the start of it.
+ */
+static char *
+make_snippet(query_session *session, sqlite3_int64 docid,
+    const char *snippet_args[3])
+{
+	snippet_token *toks = NULL;
+	snippet_token *tok;
+	const char *text;
+	char *snippet;
+	char *p;
+	size_t ntoks = 0;
+	size_t len, size, from, to, start, end, prev, i;
+	size_t best = 0;
+	size_t score = 0;
+	size_t s;
+
+	if (init_snippets(session) < 0)
+		return estrdup("");
+	sqlite3_bind_int64(session->desc_stmt, 1, docid);
+	if (sqlite3_step(session->desc_stmt) != SQLITE_ROW ||
+	    (text = (const char *) sqlite3_column_text(session->desc_stmt,
+	    0)) == NULL) {
+		sqlite3_reset(session->desc_stmt);
+		return estrdup("");
+	}
+	len = sqlite3_column_bytes(session->desc_stmt, 0);
+
+	/* The words are split like the apropos tokenizer does */
+	for (i = 0; next_word(text, len, &i, &end); i = end) {
+		if (ntoks % 256 == 0)
+			toks = erealloc(toks, (ntoks + 256) * sizeof(*toks));
+		tok = &toks[ntoks++];
+		tok->start = i;
+		tok->end = end;
+		tok->term = token_term(session, text + i, end - i);
+	}
+	if (ntoks == 0) {
+		sqlite3_reset(session->desc_stmt);
+		free(toks);
+		return estrdup("");
+	}
+
+	for (i = 0; i < ntoks; i++) {
+		if (toks[i].term < 0)
+			continue;
+		from = i > SNIPPET_LEAD ? i - SNIPPET_LEAD : 0;
+		if (ntoks > SNIPPET_TOKENS && from > ntoks - SNIPPET_TOKENS)
+			from = ntoks - SNIPPET_TOKENS;
+		if ((s = window_score(toks, ntoks, from)) > score) {
+			score = s;
+			best = from;
+		}
+	}
+	from = best;
+	to = from + SNIPPET_TOKENS < ntoks ? from + SNIPPET_TOKENS : ntoks;
+
+	/* The text around the window is kept if nothing is left out there */
+	start = from > 0 ? (size_t) toks[from].start : 0;
+	end = to < ntoks ? (size_t) toks[to - 1].end : len;
+	size = end - start + 2 * strlen(snippet_args[2]) +
+	    (to - from) * (strlen(snippet_args[0]) + strlen(snippet_args[1])) + 1;
+	p = snippet = emalloc(size);
+	if (from > 0)
+		p = stpcpy(p, snippet_args[2]);
+	for (i = from; i < to; i++) {
+		tok = &toks[i];
+		prev = i > from ? (size_t) toks[i - 1].end : start;
+		memcpy(p, text + prev, tok->start - prev);
+		p += tok->start - prev;
+		if (tok->term >= 0)
+			p = stpcpy(p, snippet_args[0]);
+		memcpy(p, text + tok->start, tok->end - tok->start);
+		p += tok->end - tok->start;
+		if (tok->term >= 0)
+			p = stpcpy(p, snippet_args[1]);
+	}
+	memcpy(p, text + toks[to - 1].end, end - toks[to - 1].end);
+	p += end - toks[to - 1].end;
+	if (to < ntoks)
+		p = stpcpy(p, snippet_args[2]);
+	*p = '\0';
+
+	sqlite3_reset(session->desc_stmt);
+	free(toks);
+	return snippet;
+}
+
+/*
+ * fetch_page --
+ *  The second phase of a search. Reads the columns of the ndocs matches in
+ *  docs by their docid, from mandb_catalog if the database has it, and
+ *  makes their snippets from the DESCRIPTION with make_snippet. The query
+ *  is not run again, and only the DESCRIPTION of the pages is decompressed,
+ *  or nothing at all if the caller does not want snippets. The rows are
+ *  returned in the order of docs, and their number is stored in *nrowsp.
+ *  Once the time budget of the search has run out, the fetching stops
+ *  there and fewer than ndocs rows are returned. If first is set, the
+ *  first row is fetched anyway, without its snippet, so that the best
+ *  match is shown even when the ranking took the whole budget.
+ */
+static page_row *
+fetch_page(query_session *session, const char *snippet_args[3],
+    const query_args *args, const query_cursor *docs, size_t ndocs,
+    int first, size_t *nrowsp)
+{
+	sqlite3_stmt *stmt;
+	page_row *rows;
+	page_row *row;
+	const char *name;
+	const char *machine;
+	const char *slash;
+	char *m;
+	size_t i;
+	int late = 0;
+	int rc;
+
+	if (session->row_stmt == NULL && sqlite3_prepare_v2(session->db,
+	    has_catalog(session) ?
+	    "SELECT section, title, name_desc, NULL FROM mandb_catalog"
+	    " WHERE docid = ?" :
+	    "SELECT section, name, name_desc, machine FROM mandb"
+	    " WHERE docid = ?", -1, &session->row_stmt, NULL) != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(session->db));
+		return NULL;
+	}
+	stmt = session->row_stmt;
+
+	rows = emalloc(ndocs * sizeof(*rows));
+	memset(rows, 0, ndocs * sizeof(*rows));
+	for (i = 0; i < ndocs && !late; i++) {
+		if (args->timeout > 0 && past_deadline(session)) {
+			if (i > 0 || !first)
+				break;
+			late = 1;
+			sqlite3_progress_handler(session->db, 0, NULL, NULL);
+		}
+		session->interrupted = 0;
+		row = &rows[i];
+		sqlite3_bind_int64(stmt, 1, docs[i].docid);
+		if ((rc = sqlite3_step(stmt)) == SQLITE_INTERRUPT) {
+			sqlite3_reset(stmt);
+			break;
+		}
+		if (rc != SQLITE_ROW || (name =
+		    (const char *) sqlite3_column_text(stmt, 1)) == NULL) {
+			sqlite3_reset(stmt);
+			continue;
+		}
+		row->section = column_strdup(stmt, 0);
+		row->name_desc = args->omit & QUERY_NO_NAME_DESC ?
+		    estrdup("") : column_strdup(stmt, 2);
+		/* The titles of the catalog have their machine already */
+		machine = (const char *) sqlite3_column_text(stmt, 3);
+		if (machine != NULL && machine[0] != '\0') {
+			if ((slash = strrchr(name, '/')) != NULL)
+				name = slash + 1;
+			m = estrdup(machine);
+			easprintf(&row->name, "%s/%s", lower(m), name);
+			free(m);
+		} else
+			row->name = estrdup(name);
+		sqlite3_reset(stmt);
+		row->snippet = (args->omit & QUERY_NO_SNIPPET) || late ?
+		    estrdup("") :
+		    make_snippet(session, docs[i].docid, snippet_args);
+		/* A snippet cut short by the deadline is not shown */
+		if (session->interrupted) {
+			free(row->section);
+			free(row->name);
+			free(row->name_desc);
+			free(row->snippet);
+			row->name = NULL;
+			break;
+		}
+	}
+	*nrowsp = i;
+	return rows;
+}
+
+/*
+ * plan_query --
+ *  The preflight of a search, run before FTS is. It parses the MATCH
+ *  expression of the query and looks up how often each of its words
+ *  occurs. Returns 0 if no page can match the query; otherwise returns
+ *  1, with the expression rewritten to have the rarest operands of AND
+ *  first in *exprp, or NULL there if the query could not be planned.
+ *  The words of the query are kept in the session for the snippets, even
+ *  if the number of pages cannot be looked up.
+ */
+static int
+plan_query(query_session *session, const char *query, char **exprp)
+{
+	query_node *node;
+	sqlite3_int64 hits = -1;
+
+	*exprp = NULL;
+	if ((node = parse_query(query)) == NULL)
+		return 1;
+	if (init_preflight(session) == 0) {
+		hits = plan_node(session, node);
+		if (hits != 0)
+			*exprp = compile_query(node);
+	}
+	if (hits != 0) {
+		collect_terms(session, node);
+		session->has_terms = 1;
+	}
+	free_query(node);
+	return hits != 0;
+}
+
+/*
+ * run_search --
+ *  Ranks the matches of the query, and fetches and passes them to the
+ *  callback in batches. The body of session_query.
+ *  The time budget of args covers both: if it runs out while the page is
+ *  fetched, the rows fetched so far are returned, with args->truncated
+ *  set.
+ */
+static int
+run_search(query_session *session, const char *snippet_args[3],
+    query_args *args)
+{
+	query_cursor *docs = NULL;
+	page_row *rows;
+	page_row *row;
+	size_t ndocs = 0;
+	size_t nrows = 0;
+	size_t batch = FETCH_FIRST;
+	size_t i, j, n;
+	struct timespec budget;
+	int failed = 0;
+	int rc = 0;
+
+	if (args->timeout > 0) {
+		budget.tv_sec = args->timeout / 1000;
+		budget.tv_nsec = (args->timeout % 1000) * 1000000L;
+		clock_gettime(CLOCK_MONOTONIC, &session->deadline);
+		timespecadd(&session->deadline, &budget, &session->deadline);
+		sqlite3_progress_handler(session->db, PROGRESS_OPS,
+		    query_progress, session);
+	}
+
+	if (rank_matches(session, args, &docs, &ndocs) < 0)
+		failed = 1;
+	for (i = 0; !failed && i < ndocs && rc == 0; i += n) {
+		n = ndocs - i < batch ? ndocs - i : batch;
+		rows = fetch_page(session, snippet_args, args, docs + i, n,
+		    i == 0, &nrows);
+		if (rows == NULL) {
+			failed = 1;
+			break;
+		}
+		if (nrows < n) {
+			args->truncated = 1;
+			n = ndocs - i;
+		}
+		for (j = 0; j < nrows; j++) {
+			row = &rows[j];
+			if (rc == 0 && row->name != NULL) {
+				rc = (args->callback)(args->callback_data,
+				    row->section, row->name, row->name_desc,
+				    row->snippet, strlen(row->snippet));
+				args->last = docs[i + j];
+			}
+			free(row->section);
+			free(row->name);
+			free(row->name_desc);
+			free(row->snippet);
+		}
+		free(rows);
+		if (batch < FETCH_MAX)
+			batch *= 2;
+	}
+
+	if (args->timeout > 0)
+		sqlite3_progress_handler(session->db, 0, NULL, NULL);
+	free(docs);
+	return failed || rc != 0 ? -1 : 0;
+}
+
+/*
+ *  session_query --
+ *  Performs the searches for the keywords entered by the user.
+ *  The 2nd param: snippet_args is an array of strings providing values for the
+ *  last three parameters to the snippet function of sqlite. (Look at the docs).
+ *  The 3rd param: args contains rest of the search parameters. Look at 
+ *  arpopos-utils.h for the description of individual fields.
+ *  The matches are ranked first, and only the ones which make it into the
+ *  requested page of results are read and snippeted. They are fetched and
+ *  passed to the callback in batches, so a long list of results, like
+ *  the one of apropos -p, starts coming out as soon as it is ranked. The
+ *  search stops as soon as the callback returns non-zero.
+ */
+int
+session_query(query_session *session, const char *snippet_args[3],
+    query_args *args)
+{
+	static const char *default_snippet_args[3] = {"", "", "..."};
+	const char *search_str = args->search_str;
+	char *expr;
+	int rc;
+
+	if (snippet_args == NULL)
+		snippet_args = default_snippet_args;
+
+	free_terms(session);
+	if (plan_query(session, search_str, &expr) == 0) {
+		args->nhits = 0;
+		args->truncated = 0;
+		if (args->sec_counts != NULL)
+			memset(args->sec_counts, 0,
+			    SECMAX * sizeof(*args->sec_counts));
+		return 0;
+	}
+	if (expr != NULL)
+		args->search_str = expr;
+	rc = run_search(session, snippet_args, args);
+	args->search_str = search_str;
+	free(expr);
+	if (rc < 0)
+		return -1;
+	return *(args->errmsg) == NULL ? 0 : -1;
+}
+
+/*
+ * callback_html --
+ *  Callback function for run_query_html. It builds the html output and then
+ *  calls the actual user supplied callback function.
+ */
+static int
+callback_html(void *data, const char *section, const char *name,
+	const char *name_desc, const char *snippet, size_t snippet_length)
+{
+	const char *temp = snippet;
+	int i = 0;
+	size_t sz = 0;
+	int count = 0;
+	int rc;
+	struct orig_callback_data *orig_data = (struct orig_callback_data *) data;
+	int (*callback) (void *, const char *, const char *, const char *, 
+		const char *, size_t) = orig_data->callback;
+
+	/* First scan the snippet to find out the number of occurrences of {'>', '<'
+	 * '"', '&'}.
+	 * Then allocate a new buffer with sufficient space to be able to store the
+	 * quoted versions of the special characters {&gt;, &lt;, &quot;, &amp;}.
+	 * Copy over the characters from the original snippet to this buffer while
+	 * replacing the special characters with their quoted versions.
+	 */
+
+	while (*temp) {
+		sz = strcspn(temp, "<>\"&\002\003");
+		temp += sz;
+		if (*temp == '\0')
+			break;
+		temp++;
+		count++;
+	}
+	size_t qsnippet_length = snippet_length + count * 5;
+	char *qsnippet = emalloc(qsnippet_length + 1);
+	sz = 0;
+	while (*snippet) {
+		sz = strcspn(snippet, "<>\"&\002\003");
+		if (sz) {
+			memcpy(&qsnippet[i], snippet, sz);
+			snippet += sz;
+			i += sz;
+		}
+		if (*snippet == '\0')
+			break;
+
+		switch (*snippet++) {
+		case '<':
+			memcpy(&qsnippet[i], "&lt;", 4);
+			i += 4;
+			break;
+		case '>':
+			memcpy(&qsnippet[i], "&gt;", 4);
+			i += 4;
+			break;
+		case '\"':
+			memcpy(&qsnippet[i], "&quot;", 6);
+			i += 6;
+			break;
+		case '&':
+			/* Don't perform the quoting if this & is part of an mdoc escape
+			 * sequence, e.g. \&
+			 */
+			if (i && *(snippet - 2) != '\\') {
+				memcpy(&qsnippet[i], "&amp;", 5);
+				i += 5;
+			} else {
+				qsnippet[i++] = '&';
+			}
+			break;
+		case '\002':
+			memcpy(&qsnippet[i], "<b>", 3);
+			i += 3;
+			break;
+		case '\003':
+			memcpy(&qsnippet[i], "</b>", 4);
+			i += 4;
+			break;
+		default:
+			break;
+		}
+	}
+	qsnippet[i] = 0;
+	rc = (*callback)(orig_data->data, section, name, name_desc,
+		(const char *)qsnippet,	qsnippet_length);
+	free(qsnippet);
+	return rc;
+}
+
+/*
+ * callback_pager --
+ *  A callback similar to callback_html. It overstrikes the matching text in
+ *  the snippet so that it appears emboldened when viewed using a pager like
+ *  more or less.
+ */
+static int
+callback_pager(void *data, const char *section, const char *name, 
+	const char *name_desc, const char *snippet, size_t snippet_length)
+{
+	struct orig_callback_data *orig_data = (struct orig_callback_data *) data;
+	char *psnippet;
+	const char *temp = snippet;
+	int count = 0;
+	int i = 0;
+	int rc;
+	size_t sz = 0;
+	size_t psnippet_length;
+
+	/* Count the number of bytes of matching text. For each of these bytes we
+	 * will use 2 extra bytes to overstrike it so that it appears bold when
+	 * viewed using a pager.
+	 */
+	while (*temp) {
+		sz = strcspn(temp, "\002\003");
+		temp += sz;
+		if (*temp == '\003') {
+			count += 2 * (sz);
+		}
+		if (*temp)
+			temp++;
+	}
+
+	psnippet_length = snippet_length + count;
+	psnippet = emalloc(psnippet_length + 1);
+
+	/* Copy the bytes from snippet to psnippet:
+	 * 1. Copy the bytes before \002 as it is.
+	 * 2. The bytes after \002 need to be overstriked till we encounter \003.
+	 * 3. To overstrike a byte 'A' we need to write 'A\bA', and the bytes
+	 *    of a UTF-8 character are overstruck together, which takes fewer
+	 *    bytes than counted above.
+	 */
+	while (*snippet) {
+		sz = strcspn(snippet, "\002");
+		memcpy(&psnippet[i], snippet, sz);
+		snippet += sz;
+		i += sz;
+
+		/* Don't change this. Advancing the pointer without reading the byte
+		 * is causing strange behavior.
+		 */
+		if (*snippet == '\002')
+			snippet++;
+		while (*snippet && *snippet != '\003') {
+			for (sz = 1; (snippet[sz] & 0xc0) == 0x80; sz++)
+				continue;
+			memcpy(&psnippet[i], snippet, sz);
+			psnippet[i + sz] = '\b';
+			memcpy(&psnippet[i + sz + 1], snippet, sz);
+			i += 2 * sz + 1;
+			snippet += sz;
+		}
+		if (*snippet)
+			snippet++;
+	}
+
+	psnippet[i] = 0;
+	psnippet_length = i;
+	rc = (orig_data->callback)(orig_data->data, section, name, name_desc,
+		psnippet, psnippet_length);
+	free(psnippet);
+	return rc;
+}
+
+/*
+ * session_query_filtered --
+ *  Runs the query with the matching text of the snippets delimited by \002
+ *  and \003, and passes every row through the given callback, which
+ *  processes the snippet before delegating to the user supplied callback.
+ */
+static int
+session_query_filtered(query_session *session, query_args *args,
+	int (*filter) (void *, const char *, const char *, const char *,
+	const char *, size_t))
+{
+	static const char *snippet_args[] = {"\002", "\003", "..."};
+	struct orig_callback_data orig_data;
+	int rc;
+
+	orig_data.callback = args->callback;
+	orig_data.data = args->callback_data;
+	args->callback = filter;
+	args->callback_data = (void *) &orig_data;
+	rc = session_query(session, snippet_args, args);
+	args->callback = orig_data.callback;
+	args->callback_data = orig_data.data;
+	return rc;
+}
+
+/*
+ * session_query_html --
+ *  Utility function to output query result in HTML format.
+ *  It internally calls session_query only, but it first passes the output to
+ *  it's own custom callback function, which preprocess the snippet for
+ *  quoting inline HTML fragments.
+ *  After that it delegates the call the actual user supplied callback function.
+ */
+int
+session_query_html(query_session *session, query_args *args)
+{
+	return session_query_filtered(session, args, &callback_html);
+}
+
+/*
+ * session_query_pager --
+ *  Utility function similar to session_query_html. This function tries to
+ *  pre-process the result assuming it will be piped to a pager.
+ *  For this purpose it first calls it's own callback function callback_pager
+ *  which then delegates the call to the user supplied callback.
+ */
+int
+session_query_pager(query_session *session, query_args *args)
+{
+	return session_query_filtered(session, args, &callback_pager);
+}
+
+/*
+ * session_browse --
+ *  Lists the pages of a section in the order of their names, as shown in
+ *  the results of a query, from mandb_catalog. The listing is paged with a
+ *  cursor: the name and docid of the last page of the previous call, which
+ *  is stored in args->last_docid. An index on the section and name makes
+ *  every page of the listing cost the same. The callback is called like
+ *  for a query, with an empty snippet. With a machine, the pages whose
+ *  near-duplicates are for it are listed as well.
+ */
+int
+session_browse(query_session *session, browse_args *args)
+{
+	static const char sqlstr[] = "SELECT docid, section, title, name_desc"
+	    " FROM mandb_catalog WHERE section = ?1"
+	    " AND (?2 IS NULL OR machine = ?2 COLLATE NOCASE"
+	    " OR EXISTS (SELECT 1 FROM mandb_variants AS v"
+	    "  WHERE v.docid = mandb_catalog.docid"
+	    "  AND v.machine = ?2 COLLATE NOCASE))";
+	sqlite3_stmt *stmt;
+	sqlite3_int64 docid;
+	char *sql;
+	int rc;
+
+	if (!has_catalog(session)) {
+		*(args->errmsg) = estrdup("The database has no catalog of the "
+		    "pages, please rerun makemandb");
+		return -1;
+	}
+
+	sql = estrdup(sqlstr);
+	if (args->after_name)
+		concat(&sql, "AND title >= ?3 AND (title > ?3 OR docid > ?4)");
+	concat(&sql, "ORDER BY title, docid LIMIT ?5");
+	rc = sqlite3_prepare_v2(session->db, sql, -1, &stmt, NULL);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		*(args->errmsg) = estrdup(sqlite3_errmsg(session->db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, args->section, -1, NULL);
+	if (args->machine)
+		sqlite3_bind_text(stmt, 2, args->machine, -1, NULL);
+	if (args->after_name) {
+		sqlite3_bind_text(stmt, 3, args->after_name, -1,
+		    SQLITE_TRANSIENT);
+		sqlite3_bind_int64(stmt, 4, args->after_docid);
+	}
+	sqlite3_bind_int(stmt, 5, args->nrec);
+
+	rc = 0;
+	while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+		docid = sqlite3_column_int64(stmt, 0);
+		rc = (args->callback)(args->callback_data,
+		    (const char *) sqlite3_column_text(stmt, 1),
+		    (const char *) sqlite3_column_text(stmt, 2),
+		    (const char *) sqlite3_column_text(stmt, 3), "", 0);
+		args->last_docid = docid;
+	}
+	sqlite3_finalize(stmt);
+	return rc != 0 ? -1 : 0;
+}
+
+/*
+ * session_related --
+ *  Lists the pages related to the page with the given name, in the given
+ *  section if any: the pages it refers to and the pages referring to it,
+ *  from the graph of the references makemandb builds in mandb_graph. They
+ *  are passed to the callback like the matches of a query, with an empty
+ *  snippet, the ones with the highest prior first.
+ */
+int
+session_related(query_session *session, related_args *args)
+{
+	static const char sqlstr[] = "WITH page(docid) AS"
+	    " (SELECT docid FROM mandb_names WHERE name = ?1"
+	    " AND (?2 IS NULL OR section = substr(?2, 1, 1)))"
+	    " SELECT c.section, c.title, c.name_desc"
+	    " FROM mandb_catalog AS c WHERE c.docid IN"
+	    " (SELECT g.dst FROM mandb_graph AS g, page WHERE g.src = page.docid"
+	    " UNION SELECT g.src FROM mandb_graph AS g, page"
+	    " WHERE g.dst = page.docid)"
+	    " AND c.docid NOT IN page"
+	    " ORDER BY c.prior DESC, c.title LIMIT ?3";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (!has_catalog(session)) {
+		*(args->errmsg) = estrdup("The database has no catalog of the "
+		    "pages, please rerun makemandb");
+		return -1;
+	}
+
+	rc = sqlite3_prepare_v2(session->db, sqlstr, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		*(args->errmsg) = estrdup(sqlite3_errmsg(session->db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, args->name, -1, NULL);
+	if (args->section)
+		sqlite3_bind_text(stmt, 2, args->section, -1, NULL);
+	sqlite3_bind_int(stmt, 3, args->nrec);
+
+	rc = 0;
+	while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW)
+		rc = (args->callback)(args->callback_data,
+		    (const char *) sqlite3_column_text(stmt, 0),
+		    (const char *) sqlite3_column_text(stmt, 1),
+		    (const char *) sqlite3_column_text(stmt, 2), "", 0);
+	sqlite3_finalize(stmt);
+	return rc != 0 ? -1 : 0;
+}
+
+/*
+ * lookup_symbol --
+ *  Looks up the pages documenting a symbol (a function, a flag, an error
+ *  code and so on) in mandb_symbols, which makemandb fills from the macros
+ *  marking them up. The symbol is matched exactly, case included, by a
+ *  probe of the primary key of the table. It may be prefixed with its kind
+ *  and a colon to look only for that kind, e.g. error:EAGAIN, and the dash
+ *  of a flag may then be left out. The pages are passed to the callback in
+ *  the order of their section and name, with the kind and the symbol as
+ *  the snippet. A page is for a machine if it or one of the near-duplicates
+ *  folded into it is.
+ */
+int
+lookup_symbol(sqlite3 *db, symbol_args *args)
+{
+	static const char *kinds[] = {
+		SYMBOL_FUNCTION, SYMBOL_FLAG, SYMBOL_ENV, SYMBOL_ERROR,
+		SYMBOL_CONSTANT, SYMBOL_HEADER, SYMBOL_TYPE
+	};
+	sqlite3_stmt *stmt;
+	const char *symbol = args->symbol;
+	const char *kind = NULL;
+	const char *colon;
+	char *name;
+	char *sql;
+	char *snippet;
+	char secs[4 * SECMAX + 2];
+	size_t i, n;
+	int rc;
+
+	if ((colon = strchr(symbol, ':')) != NULL) {
+		n = colon - symbol;
+		for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+			if (strncmp(symbol, kinds[i], n) == 0 &&
+			    kinds[i][n] == '\0') {
+				kind = kinds[i];
+				symbol = colon + 1;
+				break;
+			}
+		}
+	}
+	if (kind != NULL && strcmp(kind, SYMBOL_FLAG) == 0 && *symbol != '-')
+		easprintf(&name, "-%s", symbol);
+	else
+		name = estrdup(symbol);
+
+	/* The sections to look in, as a list of their numbers */
+	for (i = 0, n = 0; args->sec_nums != NULL && i < SECMAX; i++) {
+		if (args->sec_nums[i]) {
+			secs[n] = n == 0 ? '(' : ',';
+			secs[n + 1] = '\'';
+			secs[n + 2] = '1' + i;
+			secs[n + 3] = '\'';
+			n += 4;
+		}
+	}
+	if (n > 0)
+		secs[n++] = ')';
+	secs[n] = '\0';
+
+	sql = estrdup("SELECT c.section, c.title, c.name_desc, s.kind, s.symbol"
+	    " FROM mandb_symbols AS s JOIN mandb_catalog AS c"
+	    " ON c.docid = s.docid WHERE s.symbol = ?1"
+	    " AND (?2 IS NULL OR s.kind = ?2)"
+	    " AND (?3 IS NULL OR c.machine = ?3 COLLATE NOCASE"
+	    " OR EXISTS (SELECT 1 FROM mandb_variants AS v"
+	    "  WHERE v.docid = c.docid AND v.machine = ?3 COLLATE NOCASE))");
+	if (n > 0) {
+		concat(&sql, "AND c.section IN");
+		concat2(&sql, secs, n);
+	}
+	concat(&sql, "ORDER BY c.section, c.title, s.kind");
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		*(args->errmsg) = estrdup(sqlite3_errmsg(db));
+		free(name);
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, name, -1, NULL);
+	if (kind != NULL)
+		sqlite3_bind_text(stmt, 2, kind, -1, NULL);
+	if (args->machine)
+		sqlite3_bind_text(stmt, 3, args->machine, -1, NULL);
+
+	rc = 0;
+	while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+		easprintf(&snippet, "%s %s", sqlite3_column_text(stmt, 3),
+		    sqlite3_column_text(stmt, 4));
+		rc = (args->callback)(args->callback_data,
+		    (const char *) sqlite3_column_text(stmt, 0),
+		    (const char *) sqlite3_column_text(stmt, 1),
+		    (const char *) sqlite3_column_text(stmt, 2), snippet,
+		    strlen(snippet));
+		free(snippet);
+	}
+	sqlite3_finalize(stmt);
+	free(name);
+	return rc != 0 ? -1 : 0;
+}
+
+/*
+ * run_query --
+ *  Runs a single query over db, through a session which lives only as long
+ *  as the query. Use a query_session for running several queries.
+ */
+int
+run_query(sqlite3 *db, const char *snippet_args[3], query_args *args)
+{
+	query_session *session;
+	int rc;
+
+	if ((session = new_session(db, 0)) == NULL)
+		return -1;
+	rc = session_query(session, snippet_args, args);
+	close_session(session);
+	return rc;
+}
+
+/*
+ * run_query_html --
+ *  Like run_query, but runs the query through session_query_html.
+ */
+int
+run_query_html(sqlite3 *db, query_args *args)
+{
+	query_session *session;
+	int rc;
+
+	if ((session = new_session(db, 0)) == NULL)
+		return -1;
+	rc = session_query_html(session, args);
+	close_session(session);
+	return rc;
+}
+
+/*
+ * run_query_pager --
+ *  Like run_query, but runs the query through session_query_pager.
+ */
+int
+run_query_pager(sqlite3 *db, query_args *args)
+{
+	query_session *session;
+	int rc;
+
+	if ((session = new_session(db, 0)) == NULL)
+		return -1;
+	rc = session_query_pager(session, args);
+	close_session(session);
+	return rc;
+}
+
+/*
+ * The parser of the queries typed by the users. A query is made of words,
+ * quoted phrases and prefixes (a word or phrase ending with a '*'),
+ * combined with AND (or just a space), OR, NOT and NEAR[/n], grouped with
+ * parentheses, and restricted to a column of mandb with a "column:" scope
+ * in front of a word, phrase or group. The operators bind as in the
+ * enhanced query syntax of FTS: NEAR tightest, then NOT, AND and OR.
+ * The parser never fails: operators which have nothing to operate on are
+ * taken for words, and unbalanced parentheses are ignored.
+ */
 
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		section = (const char *) sqlite3_column_text(stmt, 0);
-		name_temp = (const char *) sqlite3_column_text(stmt, 1);
-		name_desc = (const char *) sqlite3_column_text(stmt, 2);
-		machine = (const char *) sqlite3_column_text(stmt, 3);
-		snippet = (const char *) sqlite3_column_text(stmt, 4);
-		if ((slash_ptr = strrchr(name_temp, '/')) != NULL)
-			name_temp = slash_ptr + 1;
-		if (machine && machine[0]) {
-			m = estrdup(machine);
-			easprintf(&name, "%s/%s", lower(m),
-				name_temp);
-			free(m);
-		} else {
-			name = estrdup((const char *) sqlite3_column_text(stmt, 1));
+/* The columns of mandb a query may be restricted to */
+static const char *query_columns[] = {
+	"section", "name", "name_desc", "desc", "lib", "return_vals", "env",
+	"files", "exit_status", "diagnostics", "errors", "machine"
+};
+
+/* Distance of NEAR when the query does not give one */
+#define NEAR_DISTANCE	10
+
+enum query_token {
+	QTOK_END,
+	QTOK_LPAREN,
+	QTOK_RPAREN,
+	QTOK_AND,
+	QTOK_OR,
+	QTOK_NOT,
+	QTOK_NEAR,
+	QTOK_SCOPE,
+	QTOK_WORD,
+	QTOK_PHRASE
+};
+
+typedef struct query_parser {
+	const char *p;		// rest of the query
+	enum query_token tok;	// current token
+	const char *text;	// text of the current token
+	size_t len;
+	int distance;		// distance of a NEAR
+	const char *column;	// column of a scope
+} query_parser;
+
+/*
+ * next_token --
+ *  Reads the next token of the query.
+ */
+static void
+next_token(query_parser *qp)
+{
+	const char *p = qp->p;
+	const char *colon;
+	size_t len;
+	size_t i;
+
+	while (isspace((unsigned char) *p))
+		p++;
+	qp->text = p;
+	switch (*p) {
+	case '\0':
+		qp->tok = QTOK_END;
+		qp->len = 0;
+		qp->p = p;
+		return;
+	case '(':
+	case ')':
+		qp->tok = *p == '(' ? QTOK_LPAREN : QTOK_RPAREN;
+		qp->len = 1;
+		qp->p = p + 1;
+		return;
+	case '"':
+		/* A phrase is the text up to the closing quote, and a '*' after */
+		qp->tok = QTOK_PHRASE;
+		qp->text = ++p;
+		p += strcspn(p, "\"");
+		qp->len = p - qp->text;
+		if (*p == '"')
+			p++;
+		if (*p == '*')
+			qp->len = ++p - qp->text;
+		qp->p = p;
+		return;
+	}
+
+	/* A word runs up to a space, a parenthesis or a quote */
+	len = strcspn(p, " \t\n\v\f\r()\"");
+	qp->len = len;
+	qp->p = p + len;
+	qp->tok = QTOK_WORD;
+	if (len == 3 && strncasecmp(p, "and", 3) == 0)
+		qp->tok = QTOK_AND;
+	else if (len == 2 && strncasecmp(p, "or", 2) == 0)
+		qp->tok = QTOK_OR;
+	else if (len == 3 && strncasecmp(p, "not", 3) == 0)
+		qp->tok = QTOK_NOT;
+	else if (len >= 4 && strncasecmp(p, "near", 4) == 0) {
+		if (len == 4) {
+			qp->tok = QTOK_NEAR;
+			qp->distance = NEAR_DISTANCE;
+		} else if (p[4] == '/' && len > 5 &&
+		    strspn(p + 5, "0123456789") == len - 5 && len < 10) {
+			qp->tok = QTOK_NEAR;
+			qp->distance = atoi(p + 5);
+		}
+	} else if ((colon = memchr(p, ':', len)) != NULL) {
+		for (i = 0; i < __arraycount(query_columns); i++) {
+			if (strlen(query_columns[i]) == (size_t) (colon - p) &&
+			    strncasecmp(p, query_columns[i], colon - p) == 0) {
+				qp->tok = QTOK_SCOPE;
+				qp->column = query_columns[i];
+				qp->p = colon + 1;
+				break;
+			}
 		}
+	}
+}
 
-		(args->callback)(args->callback_data, section, name, name_desc, snippet,
-			strlen(snippet));
+static query_node *
+new_node(enum query_op op)
+{
+	query_node *node;
 
-		free(name);
+	node = emalloc(sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->op = op;
+	return node;
+}
+
+static void
+add_kid(query_node *node, query_node *kid)
+{
+	node->kids = erealloc(node->kids,
+	    (node->nkids + 1) * sizeof(*node->kids));
+	node->kids[node->nkids++] = kid;
+}
+
+/*
+ * new_term --
+ *  Makes a term out of the len bytes of text, folded like the pages are.
+ *  It is split into words the way the porter tokenizer splits the pages,
+ *  i.e. on anything but letters, digits, '_' and non-ASCII characters
+ *  other than punctuation, so that "foo-bar" becomes the phrase "foo bar".
+ *  The stopwords are left out, as the apropos tokenizer does not index
+ *  them, except for a prefix and in the section column, whose values it
+ *  indexes whole, so that section:3 still restricts the search.
+ *  Returns NULL if there is no word left.
+ */
+static query_node *
+new_term(const char *text, size_t len, int quoted, const char *column)
+{
+	query_node *node;
+	const char *s;
+	const char *stop = text + len;
+	char *words;
+	char *w, *word = NULL;
+	char c[FOLD_MAX];
+	int nwords = 0;
+	int inword = 0;
+	int prefix;
+	size_t n, end;
+
+	end = len;
+	while (end > 0 && isspace((unsigned char) text[end - 1]))
+		end--;
+	prefix = end > 0 && text[end - 1] == '*';
+
+	/* The folded text is never longer */
+	words = w = emalloc(len + 1);
+	for (s = text; inword || s < stop; ) {
+		if (s < stop)
+			n = fold_char(&s, stop, c);
+		else {
+			/* The end of the text ends the last word */
+			c[0] = ' ';
+			n = 1;
+		}
+		if (n == 0)
+			continue;
+		if (!isalnum((unsigned char) c[0]) && c[0] != '_' &&
+		    (c[0] & 0x80) == 0) {
+			/* Only the last word of the text may be a prefix */
+			if (inword && is_stopword(word, w - word) &&
+			    !(prefix && s >= text + end) &&
+			    (column == NULL || strcmp(column, "section") != 0)) {
+				w = word > words ? word - 1 : word;
+				nwords--;
+			}
+			inword = 0;
+			continue;
+		}
+		if (!inword) {
+			if (nwords++)
+				*w++ = ' ';
+			word = w;
+			inword = 1;
+		}
+		memcpy(w, c, n);
+		w += n;
+	}
+	*w = '\0';
+	if (nwords == 0) {
+		free(words);
+		return NULL;
 	}
 
-	sqlite3_finalize(stmt);
-	sqlite3_free(query);
-	return *(args->errmsg) == NULL ? 0 : -1;
+	node = new_node(QUERY_TERM);
+	node->text = words;
+	node->nwords = nwords;
+	node->quoted = quoted;
+	node->prefix = prefix;
+	node->column = column;
+	return node;
 }
 
 /*
- * callback_html --
- *  Callback function for run_query_html. It builds the html output and then
- *  calls the actual user supplied callback function.
+ * join --
+ *  Combines left and right with the operator op and returns the result.
+ *  Operands which are the same operator are merged into one node, so that
+ *  a chain of ANDs becomes a single node for instance. An empty (NULL)
+ *  operand is left out. NEAR only works between terms, it falls back to
+ *  AND for anything else.
  */
+static query_node *
+join(enum query_op op, query_node *left, query_node *right, int distance)
+{
+	query_node *node;
+	size_t i;
+
+	if (right == NULL)
+		return left;
+	if (left == NULL) {
+		/* Nothing to take the pages of the right operand out of */
+		if (op == QUERY_NOT) {
+			free_query(right);
+			return NULL;
+		}
+		return right;
+	}
+
+	if (op == QUERY_NEAR) {
+		if (right->op != QUERY_TERM ||
+		    (left->op != QUERY_TERM && left->op != QUERY_NEAR))
+			op = QUERY_AND;
+		else
+			right->distance = distance;
+	}
+	if (left->op == op)
+		node = left;
+	else {
+		node = new_node(op);
+		add_kid(node, left);
+	}
+	if (right->op == op && (op == QUERY_AND || op == QUERY_OR)) {
+		for (i = 0; i < right->nkids; i++)
+			add_kid(node, right->kids[i]);
+		free(right->kids);
+		free(right);
+	} else
+		add_kid(node, right);
+	return node;
+}
+
 static int
-callback_html(void *data, const char *section, const char *name,
-	const char *name_desc, const char *snippet, size_t snippet_length)
+starts_operand(enum query_token tok)
 {
-	const char *temp = snippet;
-	int i = 0;
-	size_t sz = 0;
-	int count = 0;
-	struct orig_callback_data *orig_data = (struct orig_callback_data *) data;
-	int (*callback) (void *, const char *, const char *, const char *, 
-		const char *, size_t) = orig_data->callback;
+	return tok == QTOK_LPAREN || tok == QTOK_SCOPE || tok == QTOK_WORD ||
+	    tok == QTOK_PHRASE;
+}
 
-	/* First scan the snippet to find out the number of occurrences of {'>', '<'
-	 * '"', '&'}.
-	 * Then allocate a new buffer with sufficient space to be able to store the
-	 * quoted versions of the special characters {&gt;, &lt;, &quot;, &amp;}.
-	 * Copy over the characters from the original snippet to this buffer while
-	 * replacing the special characters with their quoted versions.
-	 */
+static query_node *parse_or(query_parser *, const char *);
 
-	while (*temp) {
-		sz = strcspn(temp, "<>\"&\002\003");
-		temp += sz + 1;
-		count++;
-	}
-	size_t qsnippet_length = snippet_length + count * 5;
-	char *qsnippet = emalloc(qsnippet_length + 1);
-	sz = 0;
-	while (*snippet) {
-		sz = strcspn(snippet, "<>\"&\002\003");
-		if (sz) {
-			memcpy(&qsnippet[i], snippet, sz);
-			snippet += sz;
-			i += sz;
-		}
+/*
+ * parse_operand --
+ *  Parses a word, a phrase or a parenthesized group, restricted to the
+ *  given column if it is not NULL.
+ */
+static query_node *
+parse_operand(query_parser *qp, const char *column)
+{
+	query_node *node;
 
-		switch (*snippet++) {
-		case '<':
-			memcpy(&qsnippet[i], "&lt;", 4);
-			i += 4;
-			break;
-		case '>':
-			memcpy(&qsnippet[i], "&gt;", 4);
-			i += 4;
-			break;
-		case '\"':
-			memcpy(&qsnippet[i], "&quot;", 6);
-			i += 6;
-			break;
-		case '&':
-			/* Don't perform the quoting if this & is part of an mdoc escape
-			 * sequence, e.g. \&
-			 */
-			if (i && *(snippet - 2) != '\\') {
-				memcpy(&qsnippet[i], "&amp;", 5);
-				i += 5;
-			} else {
-				qsnippet[i++] = '&';
-			}
-			break;
-		case '\002':
-			memcpy(&qsnippet[i], "<b>", 3);
-			i += 3;
-			break;
-		case '\003':
-			memcpy(&qsnippet[i], "</b>", 4);
-			i += 4;
+	for (;;) {
+		switch (qp->tok) {
+		case QTOK_END:
+		case QTOK_RPAREN:
+			return NULL;
+		case QTOK_LPAREN:
+			next_token(qp);
+			node = parse_or(qp, column);
+			if (qp->tok == QTOK_RPAREN)
+				next_token(qp);
+			return node;
+		case QTOK_SCOPE:
+			column = qp->column;
+			next_token(qp);
 			break;
 		default:
-			break;
+			/* An operator where an operand is expected is a word */
+			node = new_term(qp->text, qp->len, qp->tok == QTOK_PHRASE,
+			    column);
+			next_token(qp);
+			return node;
 		}
 	}
-	qsnippet[++i] = 0;
-	(*callback)(orig_data->data, section, name, name_desc,
-		(const char *)qsnippet,	qsnippet_length);
-	free(qsnippet);
-	return 0;
 }
 
-/*
- * run_query_html --
- *  Utility function to output query result in HTML format.
- *  It internally calls run_query only, but it first passes the output to it's 
- *  own custom callback function, which preprocess the snippet for quoting
- *  inline HTML fragments.
- *  After that it delegates the call the actual user supplied callback function.
- */
-int
-run_query_html(sqlite3 *db, query_args *args)
+static query_node *
+parse_near(query_parser *qp, const char *column)
 {
-	struct orig_callback_data orig_data;
-	orig_data.callback = args->callback;
-	orig_data.data = args->callback_data;
-	const char *snippet_args[] = {"\002", "\003", "..."};
-	args->callback = &callback_html;
-	args->callback_data = (void *) &orig_data;
-	return run_query(db, snippet_args, args);
+	query_node *node;
+	int distance;
+
+	node = parse_operand(qp, column);
+	while (qp->tok == QTOK_NEAR) {
+		distance = qp->distance;
+		next_token(qp);
+		node = join(QUERY_NEAR, node, parse_operand(qp, column),
+		    distance);
+	}
+	return node;
+}
+
+static query_node *
+parse_not(query_parser *qp, const char *column)
+{
+	query_node *node;
+
+	node = parse_near(qp, column);
+	while (qp->tok == QTOK_NOT) {
+		next_token(qp);
+		node = join(QUERY_NOT, node, parse_near(qp, column), 0);
+	}
+	return node;
 }
 
 /*
- * callback_pager --
- *  A callback similar to callback_html. It overstrikes the matching text in
- *  the snippet so that it appears emboldened when viewed using a pager like
- *  more or less.
+ * parse_and --
+ *  Parses operands joined by AND or by nothing.
  */
-static int
-callback_pager(void *data, const char *section, const char *name, 
-	const char *name_desc, const char *snippet, size_t snippet_length)
+static query_node *
+parse_and(query_parser *qp, const char *column)
 {
-	struct orig_callback_data *orig_data = (struct orig_callback_data *) data;
-	char *psnippet;
-	const char *temp = snippet;
-	int count = 0;
-	int i = 0;
-	size_t sz = 0;
-	size_t psnippet_length;
+	query_node *node = NULL;
+	int first = 1;
 
-	/* Count the number of bytes of matching text. For each of these bytes we
-	 * will use 2 extra bytes to overstrike it so that it appears bold when
-	 * viewed using a pager.
-	 */
-	while (*temp) {
-		sz = strcspn(temp, "\002\003");
-		temp += sz;
-		if (*temp == '\003') {
-			count += 2 * (sz);
-		}
-		temp++;
+	for (;;) {
+		if (!first && qp->tok == QTOK_AND)
+			next_token(qp);
+		else if (!first && !starts_operand(qp->tok))
+			break;
+		first = 0;
+		node = join(QUERY_AND, node, parse_not(qp, column), 0);
 	}
+	return node;
+}
 
-	psnippet_length = snippet_length + count;
-	psnippet = emalloc(psnippet_length + 1);
+static query_node *
+parse_or(query_parser *qp, const char *column)
+{
+	query_node *node;
 
-	/* Copy the bytes from snippet to psnippet:
-	 * 1. Copy the bytes before \002 as it is.
-	 * 2. The bytes after \002 need to be overstriked till we encounter \003.
-	 * 3. To overstrike a byte 'A' we need to write 'A\bA'
-	 */
-	while (*snippet) {
-		sz = strcspn(snippet, "\002");
-		memcpy(&psnippet[i], snippet, sz);
-		snippet += sz;
-		i += sz;
+	node = parse_and(qp, column);
+	while (qp->tok == QTOK_OR) {
+		next_token(qp);
+		node = join(QUERY_OR, node, parse_and(qp, column), 0);
+	}
+	return node;
+}
 
-		/* Don't change this. Advancing the pointer without reading the byte
-		 * is causing strange behavior.
-		 */
-		if (*snippet == '\002')
-			snippet++;
-		while (*snippet && *snippet != '\003') {
-			psnippet[i++] = *snippet;
-			psnippet[i++] = '\b';
-			psnippet[i++] = *snippet++;
-		}
-		if (*snippet)
-			snippet++;
+/*
+ * parse_query --
+ *  Parses the query typed by the user into a tree. Returns NULL if nothing
+ *  is left to search for, e.g. if the query was made of stopwords only.
+ *  The tree should be freed with free_query.
+ */
+query_node *
+parse_query(const char *query)
+{
+	query_parser qp;
+	query_node *node = NULL;
+
+	qp.p = query;
+	next_token(&qp);
+	for (;;) {
+		node = join(QUERY_AND, node, parse_or(&qp, NULL), 0);
+		if (qp.tok == QTOK_END)
+			break;
+		/* Skip an unbalanced ')' */
+		next_token(&qp);
 	}
+	return node;
+}
 
-	psnippet[i] = 0;
-	(orig_data->callback)(orig_data->data, section, name, name_desc, psnippet,
-		psnippet_length);
-	free(psnippet);
-	return 0;
+void
+free_query(query_node *node)
+{
+	size_t i;
+
+	if (node == NULL)
+		return;
+	for (i = 0; i < node->nkids; i++)
+		free_query(node->kids[i]);
+	free(node->kids);
+	free(node->text);
+	free(node);
 }
 
 /*
- * run_query_pager --
- *  Utility function similar to run_query_html. This function tries to
- *  pre-process the result assuming it will be piped to a pager.
- *  For this purpose it first calls it's own callback function callback_pager
- *  which then delegates the call to the user supplied callback.
+ * query_prec --
+ *  Returns the precedence of the operator of the node in the FTS syntax.
  */
-int
-run_query_pager(sqlite3 *db, query_args *args)
+static int
+query_prec(const query_node *node)
 {
-	struct orig_callback_data orig_data;
-	orig_data.callback = args->callback;
-	orig_data.data = args->callback_data;
-	const char *snippet_args[] = {"\002", "\003", "..."};
-	args->callback = &callback_pager;
-	args->callback_data = (void *) &orig_data;
-	return run_query(db, snippet_args, args);
+	switch (node->op) {
+	case QUERY_OR:
+		return 1;
+	case QUERY_AND:
+		return 2;
+	case QUERY_NOT:
+		return 3;
+	case QUERY_NEAR:
+		return 4;
+	default:
+		/* A phrase restricted to a column is written as a NEAR group */
+		return node->column != NULL && node->nwords > 1 ? 4 : 5;
+	}
+}
+
+/*
+ * compile_term --
+ *  Writes a term in the FTS syntax. FTS cannot restrict a quoted phrase to
+ *  a column, so the words of such a phrase are required to be next to each
+ *  other in that column with NEAR/0 instead.
+ */
+static char *
+compile_term(const query_node *node)
+{
+	char *s = NULL;
+	char *t;
+	char *words;
+	char *word;
+	char *next;
+
+	if (node->column == NULL) {
+		/*
+		 * Stopwords and the words read as operators are quoted, so
+		 * that the result parses back to the same query.
+		 */
+		if (node->nwords == 1 &&
+		    !is_stopword(node->text, strlen(node->text)) &&
+		    strcasecmp(node->text, "and") != 0 &&
+		    strcasecmp(node->text, "or") != 0 &&
+		    strcasecmp(node->text, "not") != 0 &&
+		    strcasecmp(node->text, "near") != 0)
+			easprintf(&s, "%s%s", node->text, node->prefix ? "*" : "");
+		else
+			easprintf(&s, "\"%s%s\"", node->text,
+			    node->prefix ? "*" : "");
+		return s;
+	}
+
+	words = estrdup(node->text);
+	for (word = words; word != NULL; word = next) {
+		if ((next = strchr(word, ' ')) != NULL)
+			*next++ = '\0';
+		easprintf(&t, "%s%s%s:%s%s", s ? s : "", s ? " NEAR/0 " : "",
+		    node->column, word, next == NULL && node->prefix ? "*" : "");
+		free(s);
+		s = t;
+	}
+	free(words);
+	return s;
 }
 
+/*
+ * compile_query --
+ *  Writes the parsed query as an FTS MATCH expression, with parentheses
+ *  only where the precedence of the operators requires them and without
+ *  the operands of AND and OR which repeat an earlier one. Returns NULL
+ *  for an empty query.
+ */
 char *
-build_boolean_query(char *query)
-{
-	char *boolop_ptr;
-	char *str;
-	str = query;
-	while ((boolop_ptr = strstr(str, "and")) || (boolop_ptr = strstr(str, "not"))
-			|| (boolop_ptr = strstr(str, "or"))) {
-		switch (boolop_ptr[0]) {
-			case 'a':
-				boolop_ptr[0] = 'A';
-				boolop_ptr[1] = 'N';
-				boolop_ptr[2] = 'D';
+compile_query(const query_node *node)
+{
+	char **kids;
+	char *s = NULL;
+	char *t;
+	char near[16];
+	const char *sep;
+	int prec, kidprec;
+	size_t i, j;
+
+	if (node == NULL)
+		return NULL;
+	if (node->op == QUERY_TERM)
+		return compile_term(node);
+
+	prec = query_prec(node);
+	kids = emalloc(node->nkids * sizeof(*kids));
+	for (i = 0; i < node->nkids; i++) {
+		kids[i] = compile_query(node->kids[i]);
+		kidprec = query_prec(node->kids[i]);
+		if (kidprec < prec ||
+		    (node->op == QUERY_NOT && i > 0 && kidprec == prec)) {
+			easprintf(&t, "(%s)", kids[i]);
+			free(kids[i]);
+			kids[i] = t;
+		}
+		if (node->op != QUERY_AND && node->op != QUERY_OR)
+			continue;
+		for (j = 0; j < i; j++) {
+			if (kids[j] != NULL && strcmp(kids[j], kids[i]) == 0) {
+				free(kids[i]);
+				kids[i] = NULL;
 				break;
+			}
+		}
+	}
 
-			case 'n':
-				boolop_ptr[0] = 'N';
-				boolop_ptr[1] = 'O';
-				boolop_ptr[2] = 'T';
-				break;
-			case 'o':
-				boolop_ptr[0] = 'O';
-				boolop_ptr[1] = 'R';
-				break;
+	for (i = 0; i < node->nkids; i++) {
+		if (kids[i] == NULL)
+			continue;
+		switch (node->op) {
+		case QUERY_OR:
+			sep = " OR ";
+			break;
+		case QUERY_NOT:
+			sep = " NOT ";
+			break;
+		case QUERY_NEAR:
+			if (node->kids[i]->distance == NEAR_DISTANCE)
+				sep = " NEAR ";
+			else {
+				snprintf(near, sizeof(near), " NEAR/%d ",
+				    node->kids[i]->distance);
+				sep = near;
+			}
+			break;
+		default:
+			sep = " ";
+			break;
 		}
-		str = boolop_ptr + 1;
+		easprintf(&t, "%s%s%s", s ? s : "", s ? sep : "", kids[i]);
+		free(s);
+		free(kids[i]);
+		s = t;
 	}
-	return query;
+	free(kids);
+	return s;
+}
+
+/*
+ * build_query --
+ *  Parses the query typed by the user and returns it as an FTS MATCH
+ *  expression, or NULL if nothing is left to search for.
+ */
+char *
+build_query(const char *query)
+{
+	query_node *node;
+	char *expr;
+
+	node = parse_query(query);
+	expr = compile_query(node);
+	free_query(node);
+	return expr;
 }
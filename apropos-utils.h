@@ -43,7 +43,7 @@
 #define MANDB_WRITE SQLITE_OPEN_READWRITE
 #define MANDB_CREATE SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
 
-#define APROPOS_SCHEMA_VERSION 20120507
+#define APROPOS_SCHEMA_VERSION 20261025
 
 /*
  * Used to identify the section of a man(7) page.
@@ -66,9 +66,29 @@ enum man_sec {
 	MANSEC_BUGS,
 	MANSEC_AUTHORS,
 	MANSEC_COPYRIGHT,
+	MANSEC_SEE_ALSO,
 	MANSEC_NONE
 };
 
+/* Kinds of the symbols in mandb_symbols */
+#define SYMBOL_FUNCTION	"function"	// .Fn and .Fo
+#define SYMBOL_FLAG	"flag"		// .Fl
+#define SYMBOL_ENV	"env"		// .Ev
+#define SYMBOL_ERROR	"error"		// .Er
+#define SYMBOL_CONSTANT	"constant"	// .Dv and the #define lines of .Fd
+#define SYMBOL_HEADER	"header"	// .In and the #include lines of .Fd
+#define SYMBOL_TYPE	"type"		// .Vt
+
+/* Fields of the results a query may leave out with query_args.omit */
+#define QUERY_NO_NAME_DESC	0x01	// the one line description of the page
+#define QUERY_NO_SNIPPET	0x02	// the text around the matches
+
+/* Position of a match in the ranked results, used as a keyset cursor */
+typedef struct query_cursor {
+	double rank;
+	sqlite3_int64 docid;
+} query_cursor;
+
 typedef struct query_args {
 	const char *search_str;		// user query
 	int *sec_nums;		// Section in which to do the search
@@ -79,19 +99,114 @@ typedef struct query_args {
 		const char *, size_t);	// The callback function
 	void *callback_data;	// data to pass to the callback function
 	char **errmsg;		// buffer for storing the error msg
+	int *sec_counts;	// if not NULL, filled with the number of matches
+				// in each section
+	const query_cursor *after;	// if not NULL, only return the matches
+					// ranked after this one
+	query_cursor last;	// set to the position of the last row returned
+	int nhits;		// set to the total number of matches
+	int timeout;		// time budget of the search in milliseconds,
+				// 0 for no limit
+	int maxscan;		// maximum number of matches to rank, 0 for
+				// no limit
+	int truncated;		// set if the search was cut short by timeout
+				// or maxscan
+	int omit;		// QUERY_NO_* fields not to fetch, they are
+				// passed to the callback as empty strings
 } query_args;
 
+/* The parameters of a listing of the pages of a section */
+typedef struct browse_args {
+	const char *section;	// the section to list
+	const char *machine;	// if not NULL, only list the pages for it
+	const char *after_name;	// if not NULL, only list the pages after the
+	sqlite3_int64 after_docid;	// one with this name and docid
+	int nrec;		// number of pages to list, -1 for all
+	int (*callback) (void *, const char *, const char *, const char *,
+		const char *, size_t);	// called like for a query
+	void *callback_data;	// data to pass to the callback function
+	char **errmsg;		// buffer for storing the error msg
+	sqlite3_int64 last_docid;	// set to the docid of the last page listed
+} browse_args;
+
+/* The parameters of a lookup of the pages documenting a symbol */
+typedef struct symbol_args {
+	const char *symbol;	// the symbol, optionally prefixed with its kind
+				// and a colon, e.g. error:EAGAIN
+	int *sec_nums;		// if not NULL, the sections to look in
+	const char *machine;	// if not NULL, only the pages for it
+	int (*callback) (void *, const char *, const char *, const char *,
+		const char *, size_t);	// called like for a query, with the
+					// kind and the symbol as the snippet
+	void *callback_data;	// data to pass to the callback function
+	char **errmsg;		// buffer for storing the error msg
+} symbol_args;
+
+/* The parameters of a listing of the pages related to a page */
+typedef struct related_args {
+	const char *name;	// the name of the page
+	const char *section;	// its section, or NULL for any
+	int nrec;		// number of pages to list, -1 for all
+	int (*callback) (void *, const char *, const char *, const char *,
+		const char *, size_t);	// called like for a query
+	void *callback_data;	// data to pass to the callback function
+	char **errmsg;		// buffer for storing the error msg
+} related_args;
+
+typedef struct query_session query_session;
+
+/* The operators of a parsed query */
+enum query_op {
+	QUERY_TERM,
+	QUERY_AND,
+	QUERY_OR,
+	QUERY_NOT,
+	QUERY_NEAR
+};
+
+typedef struct query_node {
+	enum query_op op;
+	char *text;		// words of a term, separated by single spaces
+	int nwords;
+	int quoted;		// the term was a quoted phrase
+	int prefix;		// the last word of the term is a prefix
+	const char *column;	// column the term is restricted to, or NULL
+	int distance;		// for the operands of NEAR, how far they may be
+				// from the previous one
+	struct query_node **kids;	// operands of an operator
+	size_t nkids;
+} query_node;
+
 char *lower(char *);
 void concat(char **, const char *);
 void concat2(char **, const char *, size_t);
 sqlite3 *init_db(int, const char *);
+sqlite3 *open_db(int, const char *);
 void close_db(sqlite3 *);
+int create_db_indexes(sqlite3 *);
+int drop_db_indexes(sqlite3 *);
 char *get_dbpath(const char *);
+sqlite3_int64 get_db_generation(sqlite3 *);
 int run_query(sqlite3 *, const char *[3], query_args *);
 int run_query_html(sqlite3 *, query_args *);
 int run_query_pager(sqlite3 *, query_args *);
+query_session *init_session(int, const char *);
+void close_session(query_session *);
+int session_stale(query_session *);
+sqlite3 *session_db(query_session *);
+int session_query(query_session *, const char *[3], query_args *);
+int session_query_html(query_session *, query_args *);
+int session_query_pager(query_session *, query_args *);
+int session_browse(query_session *, browse_args *);
+int session_related(query_session *, related_args *);
+int lookup_symbol(sqlite3 *, symbol_args *);
+int is_stopword(const char *, size_t);
+int set_name_stopwords(sqlite3 *, const char *);
 char *remove_stopwords(const char *);
-char *build_boolean_query(char *);
+query_node *parse_query(const char *);
+char *compile_query(const query_node *);
+void free_query(query_node *);
+char *build_query(const char *);
 char *spell(sqlite3*, char *);
 char *get_suggestions(sqlite3 *, char *);
 #endif 
@@ -35,6 +35,7 @@ __RCSID("$NetBSD: apropos.c,v 1.8 2012/10/06 15:33:59 wiz Exp $");
 
 #include <err.h>
 #include <search.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +50,9 @@ typedef struct apropos_flags {
 	int nresults;
 	int pager;
 	int no_context;
+	int batch;
+	int list;
+	int symbol;
 	const char *machine;
 } apropos_flags;
 
@@ -56,10 +60,20 @@ typedef struct callback_data {
 	int count;
 	FILE *out;
 	apropos_flags *aflags;
+	char *last_name;	// name of the last page listed by -L
 } callback_data;
 
+/* Number of pages fetched at once when listing sections */
+#define LIST_BATCH	256
+
 static int query_callback(void *, const char * , const char *, const char *,
 	const char *, size_t);
+static int search(query_session *, const char *, callback_data *);
+static int lookup(query_session *, const char *, callback_data *);
+static int batch(query_session *, callback_data *);
+static int list_callback(void *, const char *, const char *, const char *,
+	const char *, size_t);
+static int list_sections(query_session *, callback_data *);
 __dead static void usage(void);
 
 #define _PATH_PAGER	"/usr/bin/more -s"
@@ -67,23 +81,19 @@ __dead static void usage(void);
 int
 main(int argc, char *argv[])
 {
-#ifdef NOTYET
-	static const char *snippet_args[] = {"\033[1m", "\033[0m", "..."};
-#endif
-	query_args args;
 	char *query = NULL;	// the user query
-	char *errmsg = NULL;
 	char *str;
-	int ch, rc = 0;
+	int ch;
 	char *correct_query;
 	char *correct;
 	int s;
 	callback_data cbdata;
 	cbdata.out = stdout;		// the default output stream
 	cbdata.count = 0;
+	cbdata.last_name = NULL;
 	apropos_flags aflags;
 	cbdata.aflags = &aflags;
-	sqlite3 *db;
+	query_session *session;
 	setprogname(argv[0]);
 	if (argc < 2)
 		usage();
@@ -94,7 +104,7 @@ main(int argc, char *argv[])
 	 * index element in sec_nums is set to the string representing that 
 	 * section number.
 	 */
-	while ((ch = getopt(argc, argv, "123456789Ccn:pS:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "123456789bCcLn:pS:s:y")) != -1) {
 		switch (ch) {
 		case '1':
 		case '2':
@@ -107,12 +117,18 @@ main(int argc, char *argv[])
 		case '9':
 			aflags.sec_nums[ch - '1'] = 1;
 			break;
+		case 'b':
+			aflags.batch = 1;
+			break;
 		case 'C':
 			aflags.no_context = 1;
 			break;
 		case 'c':
 			aflags.no_context = 0;
 			break;
+		case 'L':
+			aflags.list = 1;
+			break;
 		case 'n':
 			aflags.nresults = atoi(optarg);
 			break;
@@ -129,6 +145,9 @@ main(int argc, char *argv[])
 				errx(EXIT_FAILURE, "Invalid section");
 			aflags.sec_nums[s - 1] = 1;
 			break;
+		case 'y':
+			aflags.symbol = 1;
+			break;
 		case '?':
 		default:
 			usage();
@@ -138,23 +157,65 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 	
+	if (aflags.batch) {
+		/* One line of output per result, and no pager */
+		if (argc)
+			usage();
+		aflags.no_context = 1;
+		aflags.pager = 0;
+		if ((session = init_session(MANDB_READONLY, MANCONF)) == NULL)
+			exit(EXIT_FAILURE);
+		if (batch(session, &cbdata) < 0) {
+			close_session(session);
+			exit(EXIT_FAILURE);
+		}
+		close_session(session);
+		return 0;
+	}
+
+	if (aflags.list) {
+		if (argc)
+			usage();
+		if ((session = init_session(MANDB_READONLY, MANCONF)) == NULL)
+			exit(EXIT_FAILURE);
+		if (list_sections(session, &cbdata) < 0) {
+			close_session(session);
+			exit(EXIT_FAILURE);
+		}
+		close_session(session);
+		return 0;
+	}
+
 	if (!argc)
 		usage();
 
+	if (aflags.symbol) {
+		if ((session = init_session(MANDB_READONLY, MANCONF)) == NULL)
+			exit(EXIT_FAILURE);
+		s = 0;
+		while (argc--)
+			if (lookup(session, *argv++, &cbdata) < 0)
+				s = 1;
+		close_session(session);
+		return s;
+	}
+
+	/* The database tells which stopwords are names of pages */
+	if ((session = init_session(MANDB_READONLY, MANCONF)) == NULL)
+		exit(EXIT_FAILURE);
+
 	str = NULL;
 	while (argc--)
 		concat(&str, *argv++);
-	/* Eliminate any stopwords from the query */
-	query = remove_stopwords(lower(str));
+	/* Parse the query, leaving out the stopwords */
+	query = build_query(str);
 	free(str);
 
-	/* if any error occured in remove_stopwords, exit */
-	if (query == NULL)
+	/* Exit if nothing was left to search for */
+	if (query == NULL) {
+		close_session(session);
 		errx(EXIT_FAILURE, "Try using more relevant keywords");
-
-	build_boolean_query(query);
-	if ((db = init_db(MANDB_READONLY, MANCONF)) == NULL)
-		exit(EXIT_FAILURE);
+	}
 
 	/* If user wants to page the output, then set some settings */
 	if (aflags.pager) {
@@ -163,31 +224,22 @@ main(int argc, char *argv[])
 			pager = _PATH_PAGER;
 		/* Open a pipe to the pager */
 		if ((cbdata.out = popen(pager, "w")) == NULL) {
-			close_db(db);
+			close_session(session);
 			err(EXIT_FAILURE, "pipe failed");
 		}
+		/*
+		 * The results are fetched in batches; hand every result to
+		 * the pager as it comes, so the first screen shows up
+		 * without waiting for the rest. A full pipe blocks us until
+		 * the pager reads more.
+		 */
+		setvbuf(cbdata.out, NULL, _IOLBF, 0);
+		signal(SIGPIPE, SIG_IGN);
 	}
 
-	args.search_str = query;
-	args.sec_nums = aflags.sec_nums;
-	args.nrec = aflags.nresults ? aflags.nresults : 10;
-	args.offset = 0;
-	args.machine = aflags.machine;
-	args.callback = &query_callback;
-	args.callback_data = &cbdata;
-	args.errmsg = &errmsg;
-
-#ifdef NOTYET
-	rc = run_query(db, snippet_args, &args);
-#else
-	rc = run_query_pager(db, &args);
-#endif
-
-	if (errmsg || rc < 0) {
-		warnx("%s", errmsg);
-		free(errmsg);
+	if (search(session, query, &cbdata) < 0) {
 		free(query);
-		close_db(db);
+		close_session(session);
 		exit(EXIT_FAILURE);
 	}
 
@@ -196,7 +248,7 @@ main(int argc, char *argv[])
 	if (cbdata.count == 0) {
 		correct_query = NULL;
 		for (term = strtok(query, " "); term; term = strtok(NULL, " ")) {
-			if ((correct = spell(db, term)))
+			if ((correct = spell(session_db(session), term)))
 				concat(&correct_query, correct);
 			else
 				concat(&correct_query, term);
@@ -210,16 +262,211 @@ main(int argc, char *argv[])
 		free(correct_query);
 	}
 	free(orig_query);
-	close_db(db);
+	close_session(session);
 	return 0;
 }
 
+/*
+ * search --
+ *  Runs the query through the session and prints the results using
+ *  query_callback.
+ */
+static int
+search(query_session *session, const char *query, callback_data *cbdata)
+{
+#ifdef NOTYET
+	static const char *snippet_args[] = {"\033[1m", "\033[0m", "..."};
+#endif
+	apropos_flags *aflags = cbdata->aflags;
+	query_args args;
+	char *errmsg = NULL;
+	int rc;
+
+	args.search_str = query;
+	args.sec_nums = aflags->sec_nums;
+	args.nrec = aflags->nresults ? aflags->nresults : 10;
+	args.offset = 0;
+	args.machine = aflags->machine;
+	args.callback = &query_callback;
+	args.callback_data = cbdata;
+	args.errmsg = &errmsg;
+	args.sec_counts = NULL;
+	args.after = NULL;
+	args.timeout = 0;
+	args.maxscan = 0;
+	args.omit = 0;
+	if (aflags->no_context)
+		args.omit |= QUERY_NO_SNIPPET;
+
+#ifdef NOTYET
+	rc = session_query(session, snippet_args, &args);
+#else
+	rc = session_query_pager(session, &args);
+#endif
+
+	/* The pager was quit before all the results were shown */
+	if (rc < 0 && errmsg == NULL && ferror(cbdata->out))
+		return 0;
+
+	if (errmsg || rc < 0) {
+		if (errmsg)
+			warnx("%s", errmsg);
+		free(errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * lookup --
+ *  Prints the pages documenting a symbol, as found in the symbol index,
+ *  with the kind of the symbol as the context.
+ */
+static int
+lookup(query_session *session, const char *symbol, callback_data *cbdata)
+{
+	apropos_flags *aflags = cbdata->aflags;
+	symbol_args args;
+	char *errmsg = NULL;
+	int count = cbdata->count;
+
+	args.symbol = symbol;
+	args.sec_nums = aflags->sec_nums;
+	args.machine = aflags->machine;
+	args.callback = &query_callback;
+	args.callback_data = cbdata;
+	args.errmsg = &errmsg;
+	if (lookup_symbol(session_db(session), &args) < 0 && errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		return -1;
+	}
+	if (cbdata->count == count)
+		warnx("%s: not found", symbol);
+	return 0;
+}
+
+/*
+ * batch --
+ *  Reads queries from stdin, one per line, and runs them in the same
+ *  session, so that only the first query of every shape is prepared.
+ *  The results of every query are terminated by an empty line, and flushed,
+ *  so that the output can be consumed as it comes.
+ */
+static int
+batch(query_session *session, callback_data *cbdata)
+{
+	char *line = NULL;
+	char *query;
+	size_t linesize = 0;
+	ssize_t len;
+	int rc = 0;
+
+	while ((len = getline(&line, &linesize, stdin)) != -1) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (cbdata->aflags->symbol) {
+			if (*line != '\0' && lookup(session, line, cbdata) < 0)
+				rc = -1;
+		} else if ((query = build_query(line)) != NULL) {
+			cbdata->count = 0;
+			if (search(session, query, cbdata) < 0)
+				rc = -1;
+			free(query);
+		}
+		fputc('\n', cbdata->out);
+		fflush(cbdata->out);
+	}
+	free(line);
+	return rc;
+}
+
+/*
+ * list_sections --
+ *  Prints the pages of the sections given with the options, or of all the
+ *  sections, in the order of their names. Every section is read from the
+ *  catalog LIST_BATCH pages at a time, each batch starting after the last
+ *  page of the one before, so that the listing starts right away and
+ *  costs the same for every batch.
+ */
+static int
+list_sections(query_session *session, callback_data *cbdata)
+{
+	apropos_flags *aflags = cbdata->aflags;
+	browse_args args;
+	char section[2];
+	char *errmsg = NULL;
+	int left = aflags->nresults > 0 ? aflags->nresults : -1;
+	int all = 1;
+	int count;
+	int i;
+
+	for (i = 0; i < SECMAX; i++)
+		if (aflags->sec_nums[i])
+			all = 0;
+
+	for (i = 0; i < SECMAX && left != 0; i++) {
+		if (!all && !aflags->sec_nums[i])
+			continue;
+		section[0] = '1' + i;
+		section[1] = '\0';
+		memset(&args, 0, sizeof(args));
+		args.section = section;
+		args.machine = aflags->machine;
+		args.callback = &list_callback;
+		args.callback_data = cbdata;
+		args.errmsg = &errmsg;
+		do {
+			args.nrec = left < 0 || left > LIST_BATCH ?
+			    LIST_BATCH : left;
+			count = cbdata->count;
+			if (session_browse(session, &args) < 0) {
+				free(cbdata->last_name);
+				cbdata->last_name = NULL;
+				if (errmsg == NULL)
+					return 0;
+				warnx("%s", errmsg);
+				free(errmsg);
+				return -1;
+			}
+			count = cbdata->count - count;
+			if (left > 0)
+				left -= count;
+			args.after_name = cbdata->last_name;
+			args.after_docid = args.last_docid;
+		} while (count == LIST_BATCH && left != 0);
+	}
+	free(cbdata->last_name);
+	cbdata->last_name = NULL;
+	return 0;
+}
+
+/*
+ * list_callback --
+ *  Callback function for session_browse. It prints a page like
+ *  query_callback does without a snippet, and remembers its name for
+ *  fetching the next batch.
+ */
+static int
+list_callback(void *data, const char *section, const char *name,
+	const char *name_desc, const char *snippet, size_t snippet_length)
+{
+	callback_data *cbdata = (callback_data *) data;
+
+	cbdata->count++;
+	fprintf(cbdata->out, "%s (%s)\t%s\n", name, section, name_desc);
+	free(cbdata->last_name);
+	cbdata->last_name = estrdup(name);
+	return ferror(cbdata->out) ? -1 : 0;
+}
+
 /*
  * query_callback --
  *  Callback function for run_query.
  *  It simply outputs the results from do_query. If the user specified the -p
  *  option, then the output is sent to a pager, otherwise stdout is the default
- *  output stream.
+ *  output stream. Returns -1 to stop the search once the output cannot be
+ *  written anymore, e.g. because the pager was quit.
  */
 static int
 query_callback(void *data, const char *section, const char *name,
@@ -233,7 +480,7 @@ query_callback(void *data, const char *section, const char *name,
 	if (cbdata->aflags->no_context == 0)
 		fprintf(out, "%s\n\n", snippet);
 
-	return 0;
+	return ferror(out) ? -1 : 0;
 }
 
 /*
@@ -244,7 +491,10 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-n Number of records] [-123456789Ccp] [-S machine] query\n",
-		getprogname());
+		"Usage: %s [-n Number of records] [-123456789Ccp] [-S machine] query\n"
+		"       %s -y [-123456789C] [-S machine] symbol ...\n"
+		"       %s -b [-n Number of records] [-123456789y] [-S machine]\n"
+		"       %s -L [-n Number of records] [-123456789] [-S machine]\n",
+		getprogname(), getprogname(), getprogname(), getprogname());
 	exit(1);
 }
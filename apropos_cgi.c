@@ -32,22 +32,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <util.h>
 
 #include "apropos-utils.h"
+#include "cgi-cache.h"
 #include "cgi-utils.h"
 
+/*
+ * Budget of a search, so that a pathological query cannot tie up the
+ * server: the time in milliseconds and the number of matches it may rank.
+ */
+#define QUERY_TIMEOUT	500
+#define QUERY_MAXSCAN	100000
+
 typedef struct callback_data {
 	int count;
+	int nhits;		// Total number of matches
+	int truncated;		// Whether the search ran out of its budget
+	query_cursor last;	// Position of the last result shown
+	char *rows;		// The rendered results
+	size_t rowslen;
 } callback_data;
+
+/* A page of results as it is stored in the cache, followed by its rows */
+typedef struct cached_page {
+	int count;
+	int nhits;
+	query_cursor last;
+	int sec_counts[SECMAX];
+} cached_page;
 static const char *HTMLTAB = "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;";
 
 /*
  * print_form --
- *   Generates the beginning HTML body of the search form.
+ *   Generates the beginning HTML body of the search form, with the query
+ *   as typed by the user in the search box.
  */   
 static void
-print_form(char *query)
+print_form(const char *query)
 {
+	char *value;
+
+
 	printf("<html>\n");
 	printf("<head>\n");
 	printf("<title> NetBSD apropos </title>\n");
@@ -63,8 +89,10 @@ print_form(char *query)
 	printf("<table style=\"%s\">\n", "margin:10px;>\n"); 
 	printf("<form action=\"/cgi-bin/apropos.cgi\">\n");
 	printf("<tr >\n");
+	value = html_escape(query ? query : "");
 	printf("<td> <input type=\"text\" name=\"q\" value=\"%s\" size=\"30\" id=\"query\"></td>\n",
-			query ? query : "" );
+			value);
+	free(value);
 	printf("<td> <input type=\"submit\" value=\"Search\"> </td>\n");
 	printf("</tr>\n");
 	printf("</table>");
@@ -75,82 +103,398 @@ static int
 query_callback(void *data, const char *section, const char *name,
 	const char *name_desc, const char *snippet, size_t snippet_length)
 {
-	printf("<div style=\"%s\">\n<tr>\n", "margin:20px; width: 60%");
-	printf("<td> <a href=\"/man/%s.html\">%s(%s) </a> %s%s</tr><tr><td>%s</tr> "
-			"<tr></tr></div>", name, name, section, HTMLTAB, name_desc, 
-			snippet);
 	callback_data *cbdata = (callback_data *) data;
+	const char *base;
+	char *row;
+	char *basename;
+	char *r;
+	char *s;
+	int len;
+	int namelen;
+
+	/*
+	 * A page folded with its near-duplicates for other machines is named
+	 * like amd64/io, i386/io, the links go to the first one.
+	 */
+	namelen = strcspn(name, ",");
+	for (base = name + namelen; base > name && base[-1] != '/'; base--)
+		continue;
+	basename = estrndup(base, name + namelen - base);
+	r = url_encode(basename);
+	s = url_encode(section);
+	len = easprintf(&row, "<div style=\"%s\">\n<tr>\n"
+			"<td> <a href=\"/man/%.*s.html\">%s(%s) </a> %s%s %s"
+			"<a href=\"/cgi-bin/apropos.cgi?r=%s&amp;s=%s\">related</a>"
+			"</tr><tr><td>%s</tr> "
+			"<tr></tr></div>", "margin:20px; width: 60%", namelen, name,
+			name, section, HTMLTAB, name_desc, HTMLTAB, r, s, snippet);
+	free(basename);
+	free(r);
+	free(s);
+	cbdata->rows = erealloc(cbdata->rows, cbdata->rowslen + len + 1);
+	memcpy(cbdata->rows + cbdata->rowslen, row, len + 1);
+	cbdata->rowslen += len;
+	free(row);
 	cbdata->count++;
 	return 0;
 }
 
+/*
+ * print_section_counts --
+ *  Prints how many of the matches of the query are in every section.
+ */
 static void
-search(sqlite3 *db, char *query, struct callback_data *cbdata, int page)
+print_section_counts(const int *sec_counts)
 {
-	char *errmsg;
+	int i;
+
+	for (i = 0; i < SECMAX; i++)
+		if (sec_counts[i])
+			printf("<div>%d results in section %d</div>\n",
+			    sec_counts[i], i + 1);
+}
+
+/*
+ * format_cursor --
+ *  Encodes the position of the last result of a page for the link to the
+ *  next one. The rank is written as the bits of the double, so that it
+ *  compares equal once parsed back.
+ */
+static void
+format_cursor(const query_cursor *cursor, char *buf, size_t len)
+{
+	unsigned long long bits;
+
+	memcpy(&bits, &cursor->rank, sizeof(bits));
+	snprintf(buf, len, "%016llx.%lld", bits, (long long) cursor->docid);
+}
+
+/*
+ * parse_cursor --
+ *  Parses a cursor written by format_cursor. Returns -1 if str is not one.
+ */
+static int
+parse_cursor(const char *str, query_cursor *cursor)
+{
+	unsigned long long bits;
+	long long docid;
+	char *end;
+
+	bits = strtoull(str, &end, 16);
+	if (end == str || *end != '.')
+		return -1;
+	str = end + 1;
+	docid = strtoll(str, &end, 10);
+	if (end == str || *end != '\0')
+		return -1;
+	memcpy(&cursor->rank, &bits, sizeof(cursor->rank));
+	cursor->docid = docid;
+	return 0;
+}
+
+/*
+ * cache_key --
+ *  Builds the key under which the results of a search are cached: the
+ *  query and everything else in args which changes its results.
+ */
+static char *
+cache_key(const query_args *args)
+{
+	char secs[SECMAX + 1];
+	char cursor[64];
+	char *key;
+	int i;
+
+	for (i = 0; i < SECMAX; i++)
+		secs[i] = args->sec_nums && args->sec_nums[i] ? '1' : '0';
+	secs[SECMAX] = '\0';
+	if (args->after)
+		format_cursor(args->after, cursor, sizeof(cursor));
+	else
+		cursor[0] = '\0';
+	easprintf(&key, "%s\n%s\n%s\n%d\n%d\n%s", args->search_str, secs,
+	    args->machine ? args->machine : "", args->offset, args->nrec,
+	    cursor);
+	return key;
+}
+
+/*
+ * cache_lookup --
+ *  Looks up the page of results stored for key in the cache. On a hit its
+ *  rows and counts are restored in cbdata and sec_counts, and 0 is
+ *  returned.
+ */
+static int
+cache_lookup(cgi_cache *cache, const char *key, int64_t generation,
+    callback_data *cbdata, int *sec_counts)
+{
+	cached_page page;
+	char *data;
+	size_t len;
+
+	if ((data = cache_get(cache, key, generation, &len)) == NULL)
+		return -1;
+	if (len < sizeof(page)) {
+		free(data);
+		return -1;
+	}
+	memcpy(&page, data, sizeof(page));
+	cbdata->count = page.count;
+	cbdata->nhits = page.nhits;
+	cbdata->last = page.last;
+	memcpy(sec_counts, page.sec_counts, sizeof(page.sec_counts));
+	/* cache_get terminates the data with a NUL */
+	cbdata->rowslen = len - sizeof(page);
+	memmove(data, data + sizeof(page), cbdata->rowslen + 1);
+	cbdata->rows = data;
+	return 0;
+}
+
+/*
+ * cache_store --
+ *  Stores the page of results in cbdata and sec_counts in the cache.
+ */
+static void
+cache_store(cgi_cache *cache, const char *key, int64_t generation,
+    const callback_data *cbdata, const int *sec_counts)
+{
+	cached_page page;
+	char *data;
+
+	memset(&page, 0, sizeof(page));
+	page.count = cbdata->count;
+	page.nhits = cbdata->nhits;
+	page.last = cbdata->last;
+	memcpy(page.sec_counts, sec_counts, sizeof(page.sec_counts));
+	data = emalloc(sizeof(page) + cbdata->rowslen);
+	memcpy(data, &page, sizeof(page));
+	if (cbdata->rowslen)
+		memcpy(data + sizeof(page), cbdata->rows, cbdata->rowslen);
+	cache_put(cache, key, generation, data, sizeof(page) + cbdata->rowslen);
+	free(data);
+}
+
+/*
+ * search --
+ *  Prints the given page of results of the query. If after is not NULL,
+ *  the page starts after that result instead of at an offset, so that the
+ *  matches of the previous pages do not have to be skipped again.
+ *  With a cache, the page is looked up there first, and stored there
+ *  unless the search ran out of its budget.
+ */
+static void
+search(query_session *session, cgi_cache *cache, char *query,
+    struct callback_data *cbdata, int page, const query_cursor *after)
+{
+	char *errmsg = NULL;
+	char *key = NULL;
+	int64_t generation = -1;
+	int sec_counts[SECMAX];
 	query_args args;
 	args.search_str = query;
 	args.sec_nums = NULL;
 	args.nrec = 10;
-	args.offset = (page - 1) * 10;
+	args.offset = after ? 0 : (page - 1) * 10;
 	args.machine = NULL;
 	args.callback = &query_callback;
 	args.callback_data = cbdata;
 	args.errmsg = &errmsg;
+	args.sec_counts = sec_counts;
+	args.after = after;
+	args.timeout = QUERY_TIMEOUT;
+	args.maxscan = QUERY_MAXSCAN;
+	args.omit = 0;
+	cbdata->count = 0;
+	cbdata->nhits = 0;
+	cbdata->truncated = 0;
+	cbdata->rows = NULL;
+	cbdata->rowslen = 0;
+	if (cache != NULL &&
+	    (generation = get_db_generation(session_db(session))) >= 0)
+		key = cache_key(&args);
+	if (key == NULL ||
+	    cache_lookup(cache, key, generation, cbdata, sec_counts) < 0) {
+		if (session_query_html(session, &args) == 0) {
+			cbdata->nhits = args.nhits;
+			cbdata->truncated = args.truncated;
+			cbdata->last = args.last;
+			if (key != NULL && !args.truncated)
+				cache_store(cache, key, generation, cbdata,
+				    sec_counts);
+		}
+		free(errmsg);
+	}
+	free(key);
 	printf("<table cellspacing=\"5px\" cellpadding=\"2px\" style=\"%s\">",
 			"align:left; margin:15px; width:65%; padding:10px;");
-	cbdata->count = 0;
-	run_query_html(db, &args);
+	if (cbdata->rows != NULL)
+		printf("%s", cbdata->rows);
+	free(cbdata->rows);
+	cbdata->rows = NULL;
 	printf("</table>");
+	if (cbdata->truncated)
+		printf("<div>The search was stopped early, these are the best "
+		    "of the first %d results</div>\n", cbdata->nhits);
+	else if (cbdata->nhits)
+		printf("<div>%d results</div>\n", cbdata->nhits);
+	print_section_counts(sec_counts);
 	printf("<div><h3>\n");
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * peek_param --
+ *  Like get_param, but leaves the query string untouched, so that the
+ *  other parameters can still be looked up whatever their order.
+ */
+static char *
+peek_param(const char *qstr, const char *pname)
+{
+	char *copy;
+	char *value;
+
+	if (qstr == NULL)
+		return NULL;
+	copy = estrdup(qstr);
+	value = get_param(copy, pname);
+	free(copy);
+	return value;
+}
+
+/*
+ * related --
+ *  Lists the pages related to the page name of section sec: the pages it
+ *  refers to in its SEE ALSO and elsewhere, and the pages referring to it.
+ */
+static void
+related(query_session *session, const char *name, const char *sec,
+    struct callback_data *cbdata)
+{
+	char *errmsg = NULL;
+	char *qname;
+	char *qsec;
+	related_args args;
+
+	args.name = name;
+	args.section = sec;
+	args.nrec = -1;
+	args.callback = &query_callback;
+	args.callback_data = cbdata;
+	args.errmsg = &errmsg;
+	cbdata->count = 0;
+	cbdata->rows = NULL;
+	cbdata->rowslen = 0;
+	session_related(session, &args);
+	free(errmsg);
+	/* The name and section come from the URL, as they were typed */
+	qname = html_escape(name);
+	qsec = sec ? html_escape(sec) : NULL;
+	printf("<h3>Pages related to %s%s%s%s</h3>\n", qname, qsec ? "(" : "",
+	    qsec ? qsec : "", qsec ? ")" : "");
+	free(qname);
+	free(qsec);
+	printf("<table cellspacing=\"5px\" cellpadding=\"2px\" style=\"%s\">",
+			"align:left; margin:15px; width:65%; padding:10px;");
+	if (cbdata->rows != NULL)
+		printf("%s", cbdata->rows);
+	free(cbdata->rows);
+	cbdata->rows = NULL;
+	printf("</table>");
+	if (cbdata->count == 0)
+		printf("<div>No related pages</div>\n");
+}
+
+/*
+ * handle_request --
+ *  Answers a single search request, using the result cache if it is not
+ *  NULL. Everything allocated for the request is released before
+ *  returning, so that a FastCGI worker does not grow with the requests it
+ *  serves.
+ */
+static void
+handle_request(query_session *session, cgi_cache *cache)
 {
 	int page;
-	int spell_correct = 0;
 	struct callback_data cbdata;
+	char *qstr;
+	char *param;
+	char *text;
+	char *query;
+	char *p;
+	char *c;
+	char buf[64];
+	query_cursor cursor;
+	query_cursor *after = NULL;
+	char *correct_query;
+	char *words;
+	char *term;
+	char *correct;
+	char *value;
+	int spell_flag = 0;
+
 	printf("Content-type:text/html;\n\n");
-	char *qstr = getenv("QUERY_STRING");
-	char *errmsg;
-	
-	sqlite3 *db = init_db(MANDB_READONLY, MANCONF);
-	if (db == NULL) {
-		printf("Could not open database connection\n");
-		exit(EXIT_FAILURE);
+	qstr = getenv("QUERY_STRING");
+	if ((param = peek_param(qstr, "r")) != NULL) {
+		p = peek_param(qstr, "s");
+		print_form(NULL);
+		related(session, param, p, &cbdata);
+		free(param);
+		free(p);
+		printf("</center>\n");
+		printf("</body>\n");
+		printf("</html>");
+		return;
+	}
+	/*
+	 * The form and the links carry the query as the user typed it, only
+	 * the search gets it compiled.
+	 */
+	if ((text = get_param(qstr, "q")) != NULL)
+		query = build_query(text);
+	else
+		query = NULL;
+	if (query == NULL) {
+		print_form(text);
+		free(text);
+		printf("</center>\n");
+		printf("</body>\n");
+		printf("</html>");
+		return;
 	}
-	char *query = get_param(qstr, "q");
-	lower(query);
-	query = remove_stopwords(query);
-	build_boolean_query(query);
-	
-	char *p = get_param(qstr, "p");
+
+	p = get_param(qstr, "p");
 	if (p == NULL)
 		page = 1;
 	else
 		page = atoi(p);
-	print_form(query);
-	search(db, query, &cbdata, page);
+	free(p);
+	c = get_param(qstr, "c");
+	if (c != NULL && parse_cursor(c, &cursor) == 0)
+		after = &cursor;
+	free(c);
+	print_form(text);
+	search(session, cache, query, &cbdata, page, after);
 
-	char *correct_query;
-	char *term;
-	char *correct;
-	int spell_flag = 0;
-	if (spell_correct == 0 && cbdata.count == 0) {
+	if (cbdata.count == 0) {
 		correct_query = NULL;
-		spell_correct = 1;
-		for (term = strtok(query, " "); term; term = strtok(NULL, " ")) {
-			if ((correct = spell(db, term))) {
+		words = estrdup(text);
+		for (term = strtok(words, " "); term; term = strtok(NULL, " ")) {
+			if ((correct = spell(session_db(session), term))) {
 				spell_flag = 1;
 				concat(&correct_query, correct);
+				free(correct);
 			}
 			else
 				concat(&correct_query, term);
 		}
+		free(words);
 		if (spell_flag) {
-			printf("<h4>Did you mean %s ?</h2>\n", correct_query);
-			search(db, correct_query, &cbdata, page);
+			value = html_escape(correct_query);
+			printf("<h4>Did you mean %s ?</h2>\n", value);
+			free(value);
+			if ((p = build_query(correct_query)) != NULL) {
+				search(session, cache, p, &cbdata, page, NULL);
+				free(p);
+			}
 		}
 		
 /*		warnx("No relevant results obtained.\n"
@@ -158,27 +502,72 @@ main(int argc, char *argv[])
 			  "or try using better keywords.");*/
 		free(correct_query);
 	}
-	/* If 10 results were displayed then there might be more results,
-	 * so display a link for Next page. 
+	value = url_encode(text);
+	/* If there are more results than the ones shown on this and the
+	 * previous pages, display a link for Next page. It carries the
+	 * position of the last result shown.
 	 */
-	if (cbdata.count == 10)
-		printf("<a href=\"/cgi-bin/apropos.cgi?q=%s&p=%d\"> Next </a>\n",
-				query, page + 1);
+	if (cbdata.count && cbdata.nhits > (page - 1) * 10 + cbdata.count) {
+		format_cursor(&cbdata.last, buf, sizeof(buf));
+		printf("<a href=\"/cgi-bin/apropos.cgi?q=%s&amp;p=%d&amp;c=%s\"> Next </a>\n",
+				value, page + 1, buf);
+	}
 
 	/* If we are on Page 2 or onwards, display a link for Previous page as well. */
 	if (page > 1) {
 		printf("%s\n", HTMLTAB);
-		printf("<a href=\"/cgi-bin/apropos.cgi?q=%s&p=%d\"> Previous </a>\n"
+		printf("<a href=\"/cgi-bin/apropos.cgi?q=%s&amp;p=%d\"> Previous </a>\n"
 				"</h3>\n",
-				query, page - 1);
+				value, page - 1);
 	}
 
 	printf("</h3></div>\n");
 	printf("</center>\n");
-	close_db(db);
+	free(value);
+	free(text);
 	free(query);
 	printf("</body>\n");
 	printf("</html>");
-	return 0;
 }
 
+/*
+ * With FastCGI the program serves requests until the server stops it, and
+ * the database connection and the prepared statements of its session are
+ * kept warm across them. As a plain CGI program it serves just one.
+ * The result cache named by APROPOS_CACHE, if any, is shared by all the
+ * processes.
+ */
+int
+main(int argc, char *argv[])
+{
+	query_session *session = NULL;
+	cgi_cache *cache = NULL;
+	const char *path;
+
+	while (cgi_accept()) {
+		/* Pick up the updates of the index since the last request */
+		if (session != NULL && session_stale(session)) {
+			close_session(session);
+			session = NULL;
+		}
+		if (session == NULL) {
+			session = init_session(MANDB_READONLY, MANCONF);
+			if (session == NULL) {
+				printf("Content-type:text/html;\n\n");
+				printf("Could not open database connection\n");
+				continue;
+			}
+		}
+		if (cache == NULL) {
+			path = getenv("APROPOS_CACHE");
+			if (path != NULL && *path != '\0')
+				cache = cache_open(path);
+		}
+		handle_request(session, cache);
+	}
+	if (cache != NULL)
+		cache_close(cache);
+	if (session != NULL)
+		close_session(session);
+	return 0;
+}
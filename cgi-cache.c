@@ -0,0 +1,289 @@
+/*-
+ * Copyright (c) 2011 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * This code was developed as part of Google's Summer of Code 2011 program.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/atomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "cgi-cache.h"
+
+/*
+ * The cache is a file shared by all the CGI processes through mmap(2). It
+ * is made of a header followed by CACHE_NSETS sets of CACHE_WAYS slots of
+ * CACHE_SLOTSIZE bytes each. An entry is stored in one of the slots of the
+ * set picked by the hash of its key, replacing the least recently used one
+ * of them, so the file never grows.
+ *
+ * Readers take no lock. Every slot has a sequence number which is odd while
+ * the slot is being written; a reader treats the slot as a miss if the
+ * number was odd or changed while it copied the entry out. Writers are
+ * serialized with flock(2), and skip storing an entry rather than wait for
+ * another process.
+ */
+#define CACHE_MAGIC	0x6d6e6361
+#define CACHE_VERSION	1
+#define CACHE_HDRSIZE	64
+#define CACHE_NSETS	64
+#define CACHE_WAYS	4
+#define CACHE_SLOTSIZE	16384
+#define CACHE_SIZE	(CACHE_HDRSIZE + \
+    (size_t) CACHE_NSETS * CACHE_WAYS * CACHE_SLOTSIZE)
+
+typedef struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nsets;
+	uint32_t ways;
+	uint32_t slotsize;
+	volatile uint32_t clock;	// Incremented on every use of a slot
+} cache_header;
+
+typedef struct cache_slot {
+	volatile uint32_t seq;		// Odd while the slot is being written
+	volatile uint32_t stamp;	// Value of the clock when last used
+	uint64_t hash;
+	int64_t generation;		// Generation of the database
+	uint32_t keylen;
+	uint32_t datalen;
+	char payload[];			// The key followed by the data
+} cache_slot;
+
+#define CACHE_MAXENTRY	(CACHE_SLOTSIZE - sizeof(cache_slot))
+
+struct cgi_cache {
+	int fd;
+	char *base;
+};
+
+/*
+ * hash_key --
+ *  The 64 bit FNV-1a hash of the key.
+ */
+static uint64_t
+hash_key(const char *key, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static cache_slot *
+get_slot(const cgi_cache *cache, uint64_t hash, int way)
+{
+	size_t set = hash % CACHE_NSETS;
+
+	return (cache_slot *) (cache->base + CACHE_HDRSIZE +
+	    (set * CACHE_WAYS + way) * CACHE_SLOTSIZE);
+}
+
+/*
+ * cache_open --
+ *  Maps the cache file at path, creating it or clearing it if it does not
+ *  have the layout of this version. Returns NULL on failure, in which case
+ *  the caller should go on without a cache.
+ */
+cgi_cache *
+cache_open(const char *path)
+{
+	cgi_cache *cache;
+	cache_header *hdr;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1 ||
+	    (st.st_size < (off_t) CACHE_SIZE &&
+	    ftruncate(fd, CACHE_SIZE) == -1)) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	if (base == MAP_FAILED) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+
+	hdr = base;
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+	    hdr->nsets != CACHE_NSETS || hdr->ways != CACHE_WAYS ||
+	    hdr->slotsize != CACHE_SLOTSIZE) {
+		hdr->magic = 0;
+		membar_producer();
+		memset((char *) base + CACHE_HDRSIZE, 0,
+		    CACHE_SIZE - CACHE_HDRSIZE);
+		hdr->version = CACHE_VERSION;
+		hdr->nsets = CACHE_NSETS;
+		hdr->ways = CACHE_WAYS;
+		hdr->slotsize = CACHE_SLOTSIZE;
+		hdr->clock = 0;
+		membar_producer();
+		hdr->magic = CACHE_MAGIC;
+	}
+	flock(fd, LOCK_UN);
+
+	cache = emalloc(sizeof(*cache));
+	cache->fd = fd;
+	cache->base = base;
+	return cache;
+}
+
+void
+cache_close(cgi_cache *cache)
+{
+	munmap(cache->base, CACHE_SIZE);
+	close(cache->fd);
+	free(cache);
+}
+
+/*
+ * cache_get --
+ *  Looks up the entry stored for key with the given database generation.
+ *  Returns a copy of its data, which the caller should free, and stores its
+ *  length in *lenp; or NULL if there is no such entry.
+ */
+void *
+cache_get(cgi_cache *cache, const char *key, int64_t generation, size_t *lenp)
+{
+	cache_header *hdr = (cache_header *) cache->base;
+	cache_slot *slot;
+	size_t keylen = strlen(key);
+	uint64_t hash = hash_key(key, keylen);
+	uint32_t seq;
+	size_t datalen;
+	char *data;
+	int i;
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		slot = get_slot(cache, hash, i);
+		seq = slot->seq;
+		if (seq & 1)
+			continue;
+		membar_consumer();
+		if (slot->hash != hash || slot->generation != generation ||
+		    slot->keylen != keylen)
+			continue;
+		datalen = slot->datalen;
+		if (keylen > CACHE_MAXENTRY || datalen > CACHE_MAXENTRY - keylen)
+			continue;
+		if (memcmp(slot->payload, key, keylen) != 0)
+			continue;
+		data = emalloc(datalen + 1);
+		memcpy(data, slot->payload + keylen, datalen);
+		data[datalen] = '\0';
+		membar_consumer();
+		if (slot->seq != seq) {
+			free(data);
+			continue;
+		}
+		slot->stamp = atomic_inc_32_nv(&hdr->clock);
+		*lenp = datalen;
+		return data;
+	}
+	return NULL;
+}
+
+/*
+ * cache_put --
+ *  Stores len bytes of data for key and the given database generation.
+ *  The slot replaced is the one holding the same key if there is one, or
+ *  else one holding an entry of another generation, or else the least
+ *  recently used one of the set. Entries which do not fit in a slot are
+ *  not stored.
+ */
+void
+cache_put(cgi_cache *cache, const char *key, int64_t generation,
+    const void *data, size_t len)
+{
+	cache_header *hdr = (cache_header *) cache->base;
+	cache_slot *slot;
+	cache_slot *victim = NULL;
+	size_t keylen = strlen(key);
+	uint64_t hash = hash_key(key, keylen);
+	uint32_t seq;
+	int i;
+
+	if (keylen > CACHE_MAXENTRY || len > CACHE_MAXENTRY - keylen)
+		return;
+	if (flock(cache->fd, LOCK_EX | LOCK_NB) == -1)
+		return;
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		slot = get_slot(cache, hash, i);
+		if (slot->hash == hash && slot->keylen == keylen &&
+		    memcmp(slot->payload, key, keylen) == 0) {
+			victim = slot;
+			break;
+		}
+		if (victim == NULL)
+			victim = slot;
+		else if (victim->generation == generation &&
+		    (slot->generation != generation ||
+		    (int32_t) (slot->stamp - victim->stamp) < 0))
+			victim = slot;
+	}
+
+	/* An odd number is left by a writer which died, the slot is reused */
+	seq = victim->seq | 1;
+	victim->seq = seq;
+	membar_producer();
+	victim->hash = hash;
+	victim->generation = generation;
+	victim->keylen = keylen;
+	victim->datalen = len;
+	memcpy(victim->payload, key, keylen);
+	memcpy(victim->payload + keylen, data, len);
+	victim->stamp = atomic_inc_32_nv(&hdr->clock);
+	membar_producer();
+	victim->seq = seq + 1;
+
+	flock(cache->fd, LOCK_UN);
+}
@@ -30,11 +30,12 @@
  */
 
 #include <err.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cgi-utils.h"
+
 /*
  * Replaces all the occurrences of '+' in the given string with a space
  */
@@ -50,65 +51,123 @@ parse_space(char *str)
 	return str;
 }
 
+/* Returns the value of the hexadecimal digit c, or -1 if it is not one */
+static int
+hex_value(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * parse_hex --
+ *  Decodes the %XX escapes of the URL encoded string str, in either case.
+ *  A '%' which is not followed by two hexadecimal digits is kept as it
+ *  is. Returns the decoded string, which should be freed.
+ */
 char *
 parse_hex(char *str)
 {
-	char *percent_ptr;
-	char hexcode[2];
 	char *retval;
+	size_t offset = 0;
+	int hi, lo;
+
 	retval = malloc(strlen(str) + 1);
-	int i = 2;
-	int decval = 0;
+	if (retval == NULL)
+		errx(EXIT_FAILURE, "malloc failed");
+	while (*str) {
+		if (str[0] == '%' && (hi = hex_value(str[1])) >= 0 &&
+		    (lo = hex_value(str[2])) >= 0) {
+			retval[offset++] = hi * 16 + lo;
+			str += 3;
+		} else
+			retval[offset++] = *str++;
+	}
+	retval[offset] = 0;
+	return retval;
+}
+
+/*
+ * html_escape --
+ *  Returns a copy of str with the characters which have a meaning in HTML
+ *  replaced by their entities, to be printed in a page or an attribute.
+ *  It should be freed.
+ */
+char *
+html_escape(const char *str)
+{
+	char *retval;
+	const char *entity;
 	size_t offset = 0;
 	size_t sz;
-	while ((percent_ptr = strchr(str, '%')) != NULL) {
-		i = 2;
-		sz = 0;
-		sz = percent_ptr - str;
-		decval = 0;
-		memcpy(retval + offset, str, sz);
-		percent_ptr++;
+
+	/* "&quot;" is the longest replacement */
+	retval = malloc(6 * strlen(str) + 1);
+	if (retval == NULL)
+		errx(EXIT_FAILURE, "malloc failed");
+	for (; *str; str++) {
+		switch (*str) {
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '&':
+			entity = "&amp;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		case '\'':
+			entity = "&#39;";
+			break;
+		default:
+			retval[offset++] = *str;
+			continue;
+		}
+		sz = strlen(entity);
+		memcpy(retval + offset, entity, sz);
 		offset += sz;
-		while (i > 0) {
-			switch (*percent_ptr) {
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
-				decval += (*percent_ptr - 48) * pow(16, --i);
-				break;
-			case 'A':
-				decval += 10 * pow(16, --i);
-				break;
-			case 'B':
-				decval += 11 * pow(16, --i);
-				break;
-			case 'C':
-				decval += 12 * pow(16, --i);
-				break;
-			case 'D':
-				decval += 13 * pow(16, --i);
-				break;
-			case 'E':
-				decval += 14 * pow(16, --i);
-				break;
-			case 'F':
-				decval += 15 * pow(16, --i);
-				break;
-			}
-			percent_ptr++;
+	}
+	retval[offset] = 0;
+	return retval;
+}
+
+/*
+ * url_encode --
+ *  Returns a copy of str to be used as the value of a parameter of a URL,
+ *  with all the bytes but the letters, digits and "-._~" written as %XX
+ *  escapes. It should be freed.
+ */
+char *
+url_encode(const char *str)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *retval;
+	size_t offset = 0;
+	unsigned char c;
+
+	retval = malloc(3 * strlen(str) + 1);
+	if (retval == NULL)
+		errx(EXIT_FAILURE, "malloc failed");
+	for (; *str; str++) {
+		c = *str;
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || strchr("-._~", c) != NULL) {
+			retval[offset++] = c;
+			continue;
 		}
-		str = percent_ptr;
-		retval[offset++] = decval;
+		retval[offset++] = '%';
+		retval[offset++] = hex[c >> 4];
+		retval[offset++] = hex[c & 0xf];
 	}
-	sz =  strlen(str);
-	memcpy(retval + offset, str, sz + 1);
+	retval[offset] = 0;
 	return retval;
 }
 
@@ -159,4 +218,24 @@ get_param(char *qstr, const char *pname)
 	return retval;
 }
 
+/*
+ * cgi_accept --
+ *  Waits for the next request and returns 1, or 0 once there are no more
+ *  requests to serve. Built with USE_FASTCGI, the program is a persistent
+ *  FastCGI responder and serves requests until the server shuts it down.
+ *  Otherwise it serves the one request it was started for.
+ */
+int
+cgi_accept(void)
+{
+#ifdef USE_FASTCGI
+	return FCGI_Accept() >= 0;
+#else
+	static int accepted;
 
+	if (accepted)
+		return 0;
+	accepted = 1;
+	return 1;
+#endif
+}
@@ -32,7 +32,14 @@
 #ifndef CGI_UTILS_H
 #define CGI_UTILS_H
 
+#ifdef USE_FASTCGI
+#include <fcgi_stdio.h>
+#endif
+
 char *parse_space(char *);
 char *parse_hex(char *);
+char *html_escape(const char *);
+char *url_encode(const char *);
 char *get_param(char *, const char *);
+int cgi_accept(void);
 #endif
@@ -19,32 +19,68 @@
 #include <sys/cdefs.h>
 __RCSID("$NetBSD: makemandb.c,v 1.16 2012/11/08 19:17:54 christos Exp $");
 
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <archive.h>
 #include <libgen.h>
+#include <math.h>
 #include <md5.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <util.h>
 
 #include "apropos-utils.h"
+#include "mandb-codec.h"
 #include "man.h"
 #include "mandoc.h"
 #include "mdoc.h"
 #include "sqlite3.h"
+#include "suggest-index.h"
 
 #define BUFLEN 1024
+#define MAXJOBS 256
+#define MAXRATE (1024 * 1024)	// Upper limit for -r, in KB/s
+#define BACKGROUND_NICE 15	// Scheduling priority with -b
+#define BACKGROUND_CPU 25	// CPU share with -b, unless -t is given
+#define THROTTLE_BATCH 8	// Pages indexed between two throttle checks
+#define SYMBOL_MAXLEN 64	// Longest symbol kept in mandb_symbols
+#define PRIOR_DAMPING 0.85	// Damping factor of the PageRank of the pages
+#define PRIOR_ROUNDS 20		// Iterations of the PageRank
+#define PRIOR_WEIGHT 0.1	// Weight of the PageRank in the prior
+#define SIMHASH_DISTANCE 3	// Most bits by which near-duplicates differ
+#define SIMHASH_MINWORDS 32	// Fewest words of a page for it to be compared
 #define MDOC 0	//If the page is of mdoc(7) type
 #define MAN 1	//If the page  is of man(7) type
 
+/*
+ * Order in which a bulk load indexes the file cache, and so assigns the
+ * docids: by the path below the man directory, i.e. by section and then by
+ * name. Related pages get nearby docids, which keeps the delta encoded
+ * doclists of the FTS index small.
+ */
+#define FILE_CACHE_ORDER " ORDER BY substr(file, length(parent) + 2), file"
+
+/* Tables in metadb used to build mandb_dict */
+#define MANDB_DUP_SCHEMA \
+	"CREATE VIRTUAL TABLE metadb.mandb_dup USING fts4(section, name, " \
+	    "name_desc, desc, lib, return_vals, env, files, " \
+	    "exit_status, diagnostics, errors, machine, " \
+	    "tokenize=apropos words); " \
+	"CREATE VIRTUAL TABLE metadb.mandb_dupaux USING fts4aux(mandb_dup); "
+
 /*
  * A data structure for holding section specific data.
  */
@@ -58,9 +94,53 @@ typedef struct makemandb_flags {
 	int optimize;
 	int limit;	// limit the indexing to only NAME section
 	int recreate;	// Database was created from scratch
+	int bulk;	// Loading into an empty database, indexes deferred
+	int jobs;	// Number of worker processes for a bulk load
+	int background;	// Run at a lower priority
+	int cpu_share;	// Percentage of CPU time to use, 0 for no limit
+	long io_rate;	// KB of page data to read per second, 0 for no limit
 	int verbosity;	// 0: quiet, 1: default, 2: verbose
 } makemandb_flags;
 
+/* Counters reported by update_db at the end of indexing */
+typedef struct index_stats {
+	int new_count;	// Newly indexed/updated pages
+	int total_count;	// Total number of pages
+	int err_count;	// Pages that failed to index
+	int link_count;	// Hard/sym links
+	int variant_count;	// Near-duplicates of an indexed page
+} index_stats;
+
+/* A page of the file cache handed to a shard worker */
+typedef struct shard_page {
+	sqlite3_int64 docid;
+	dev_t device;
+	ino_t inode;
+	time_t mtime;
+	char *parent;
+	char *file;
+} shard_page;
+
+/* A docid bitmap of mandb_facets */
+typedef struct facet {
+	const char *kind;
+	char *value;
+	unsigned char *bits;
+	size_t len;
+} facet;
+
+/* A page referred to by another one, for mandb_xrefs */
+typedef struct xref {
+	char *name;
+	char *section;	// empty if the reference has none
+} xref;
+
+/* A symbol documented by a page, for mandb_symbols */
+typedef struct symbol {
+	const char *kind;	// one of the SYMBOL_* kinds
+	char *name;
+} symbol;
+
 typedef struct mandb_rec {
 	/* Fields for mandb table */
 	char *name;	// for storing the name of the man page
@@ -76,6 +156,7 @@ typedef struct mandb_rec {
 	char section[2];
 
 	int xr_found;
+	sqlite3_int64 docid;	// docid to use, or 0 to let FTS pick one
 
 	/* Fields for mandb_meta table */
 	char *md5_hash;
@@ -88,6 +169,16 @@ typedef struct mandb_rec {
 	char *links; //all the links to a page in a space separated form
 	char *file_path;
 
+	/* Fields for mandb_symbols table */
+	symbol *symbols;	// the functions, flags, etc. the page documents
+	size_t nsymbols;
+	size_t symbols_size;
+
+	/* Fields for mandb_xrefs table */
+	xref *xrefs;	// the pages referred to by .Xr or in SEE ALSO
+	size_t nxrefs;
+	size_t xrefs_size;
+
 	/* Non-db fields */
 	int page_type; //Indicates the type of page: mdoc or man
 } mandb_rec;
@@ -100,29 +191,76 @@ static void cleanup(mandb_rec *);
 static void set_section(const struct mdoc *, const struct man *, mandb_rec *);
 static void set_machine(const struct mdoc *, mandb_rec *);
 static int insert_into_db(sqlite3 *, mandb_rec *);
+static sqlite3_int64 lookup_docid(sqlite3 *, const char *, const char *);
+static int insert_links(sqlite3 *, mandb_rec *, sqlite3_int64);
+static uint64_t page_simhash(const mandb_rec *, size_t *);
+static int simhash_distance(uint64_t, uint64_t);
+static sqlite3_int64 find_variant(sqlite3 *, const mandb_rec *, uint64_t);
+static int collapse_variants(sqlite3 *);
 static	void begin_parse(const char *, struct mparse *, mandb_rec *,
 			 const void *, size_t len);
+static int scan_name_section(mandb_rec *, const void *, size_t);
 static void pmdoc_node(const struct mdoc_node *, mandb_rec *);
 static void pmdoc_Nm(const struct mdoc_node *, mandb_rec *);
 static void pmdoc_Nd(const struct mdoc_node *, mandb_rec *);
 static void pmdoc_Sh(const struct mdoc_node *, mandb_rec *);
 static void pmdoc_Xr(const struct mdoc_node *, mandb_rec *);
 static void pmdoc_Pp(const struct mdoc_node *, mandb_rec *);
+static void pmdoc_symbol(const struct mdoc_node *, mandb_rec *);
+static void add_symbol(mandb_rec *, const char *, char *);
+static char *symbol_word(const char *);
+static void add_xref(mandb_rec *, const char *, const char *);
 static void pmdoc_macro_handler(const struct mdoc_node *, mandb_rec *, 
 				enum mdoct);
 static void pman_node(const struct man_node *n, mandb_rec *);
 static void pman_parse_node(const struct man_node *, secbuff *);
 static void pman_parse_name(const struct man_node *, mandb_rec *);
+static void pman_split_name(mandb_rec *);
 static void pman_sh(const struct man_node *, mandb_rec *);
 static void pman_block(const struct man_node *, mandb_rec *);
+static void pman_symbols(enum man_sec, const struct man_node *, mandb_rec *);
+static void pman_tag_symbol(enum man_sec, const struct man_node *,
+			    mandb_rec *);
+static void pman_synopsis_symbols(const char *, mandb_rec *);
+static void pman_see_also(const struct man_node *, char **);
+static void parse_xrefs(const char *, mandb_rec *);
 static void traversedir(const char *, const char *, sqlite3 *, struct mparse *);
 static void mdoc_parse_section(enum mdoc_sec, const char *, mandb_rec *);
 static void man_parse_section(enum man_sec, const struct man_node *, mandb_rec *);
 static void build_file_cache(sqlite3 *, const char *, const char *,
 			     struct stat *);
+static void keep_name_stopwords(sqlite3 *);
 static void update_db(sqlite3 *, struct mparse *, mandb_rec *);
+static void build_facets(sqlite3 *);
+static void build_catalog(sqlite3 *);
+static void add_variant_titles(char **, const char *, const char *);
+static char *catalog_title(const char *, const char *, const char *);
+static void build_names(sqlite3 *);
+static void build_graph(sqlite3 *);
+static void build_priors(sqlite3 *);
+static int update_facets(sqlite3 *, sqlite3_int64);
+static int update_priors(sqlite3 *, const sqlite3_int64 *, size_t);
+static int add_targets(sqlite3 *, sqlite3_int64, sqlite3_int64 **, size_t *,
+		       size_t *);
+static void refresh_page(sqlite3 *, sqlite3_int64);
+static void bump_generation(sqlite3 *);
+static void index_page(sqlite3 *, struct mparse *, mandb_rec *, const char *,
+		       const char *, index_stats *);
+static void print_stats(const index_stats *);
+static void throttle_start(void);
+static void throttle(sqlite3 *, size_t);
+static long parse_count(const char *, long, const char *);
+static void build_shards(sqlite3 *, struct mparse *, const char *);
+__dead static void run_shard(const char *, struct mparse *, shard_page *,
+			     size_t, int);
+static int merge_shard(sqlite3 *, const char *, int *);
 __dead static void usage(void);
 static void optimize(sqlite3 *);
+static sqlite3_int64 index_size(sqlite3 *);
+static int is_empty_db(sqlite3 *);
+static void begin_bulk_load(sqlite3 *);
+static void end_bulk_load(sqlite3 *);
+static void train_codec(sqlite3 *);
 static char *parse_escape(const char *);
 static makemandb_flags mflags = { .verbosity = 1 };
 
@@ -148,17 +286,17 @@ static	const pmdoc_nf mdocs[MDOC_MAX] = {
 	NULL, /* Ar */
 	NULL, /* Cd */
 	NULL, /* Cm */
-	NULL, /* Dv */
-	NULL, /* Er */
-	NULL, /* Ev */
+	pmdoc_symbol, /* Dv */
+	pmdoc_symbol, /* Er */
+	pmdoc_symbol, /* Ev */
 	NULL, /* Ex */
 	NULL, /* Fa */
-	NULL, /* Fd */
-	NULL, /* Fl */
-	NULL, /* Fn */
+	pmdoc_symbol, /* Fd */
+	pmdoc_symbol, /* Fl */
+	pmdoc_symbol, /* Fn */
 	NULL, /* Ft */
 	NULL, /* Ic */
-	NULL, /* In */
+	pmdoc_symbol, /* In */
 	NULL, /* Li */
 	pmdoc_Nd, /* Nd */
 	pmdoc_Nm, /* Nm */
@@ -168,7 +306,7 @@ static	const pmdoc_nf mdocs[MDOC_MAX] = {
 	NULL, /* Rv */
 	NULL, /* St */
 	NULL, /* Va */
-	NULL, /* Vt */
+	pmdoc_symbol, /* Vt */
 	pmdoc_Xr, /* Xr */
 	NULL, /* %A */
 	NULL, /* %B */
@@ -225,7 +363,7 @@ static	const pmdoc_nf mdocs[MDOC_MAX] = {
 	NULL, /* Ux */
 	NULL, /* Xc */
 	NULL, /* Xo */
-	NULL, /* Fo */
+	pmdoc_symbol, /* Fo */
 	NULL, /* Fc */
 	NULL, /* Oo */
 	NULL, /* Oc */
@@ -296,6 +434,7 @@ main(int argc, char *argv[])
 	FILE *file;
 	const char *sqlstr, *manconf = NULL;
 	char *line, *command, *parent;
+	char *dbpath, *sugpath;
 	char *errmsg;
 	int ch;
 	struct mparse *mp;
@@ -304,14 +443,20 @@ main(int argc, char *argv[])
 	size_t linesize;
 	struct mandb_rec rec;
 
-	while ((ch = getopt(argc, argv, "C:floQqv")) != -1) {
+	while ((ch = getopt(argc, argv, "bC:fj:loQqr:t:v")) != -1) {
 		switch (ch) {
+		case 'b':
+			mflags.background = 1;
+			break;
 		case 'C':
 			manconf = optarg;
 			break;
 		case 'f':
 			mflags.recreate = 1;
 			break;
+		case 'j':
+			mflags.jobs = parse_count(optarg, MAXJOBS, "number of jobs");
+			break;
 		case 'l':
 			mflags.limit = 1;
 			break;
@@ -324,6 +469,12 @@ main(int argc, char *argv[])
 		case 'q':
 			mflags.verbosity = 1;
 			break;
+		case 'r':
+			mflags.io_rate = parse_count(optarg, MAXRATE, "I/O rate");
+			break;
+		case 't':
+			mflags.cpu_share = parse_count(optarg, 100, "CPU share");
+			break;
 		case 'v':
 			mflags.verbosity = 2;
 			break;
@@ -332,6 +483,15 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (mflags.background) {
+		if (setpriority(PRIO_PROCESS, 0, BACKGROUND_NICE) == -1 &&
+		    mflags.verbosity)
+			warn("setpriority");
+		if (mflags.cpu_share == 0)
+			mflags.cpu_share = BACKGROUND_CPU;
+	}
+	throttle_start();
+
 	memset(&rec, 0, sizeof(rec));
 
 	init_secbuffs(&rec);
@@ -349,8 +509,10 @@ main(int argc, char *argv[])
 		manconf = MANCONF;
 	}
 
-	if (mflags.recreate)
-		remove(get_dbpath(manconf));
+	/* Every call to get_dbpath() parses man.conf again */
+	dbpath = get_dbpath(manconf);
+	if (mflags.recreate && dbpath != NULL)
+		remove(dbpath);
 
 	if ((db = init_db(MANDB_CREATE, manconf)) == NULL)
 		exit(EXIT_FAILURE);
@@ -363,6 +525,11 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (mflags.recreate || is_empty_db(db)) {
+		mflags.bulk = 1;
+		begin_bulk_load(db);
+	}
+
 	sqlite3_exec(db, "ATTACH DATABASE \':memory:\' AS metadb", NULL, NULL,
 	    &errmsg);
 	if (errmsg != NULL) {
@@ -387,16 +554,27 @@ main(int argc, char *argv[])
 		free(errmsg);
 		exit(EXIT_FAILURE);
 	}
+
+	/*
+	 * The words of the pages indexed by this run are only added to
+	 * mandb_dict at the end of it, apropos cannot tell from it that a word
+	 * is in no page until then.
+	 */
+	sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS mandb_info"
+	    "(name PRIMARY KEY, value); "
+	    "DELETE FROM mandb_info WHERE name = 'dict_complete'",
+	    NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		exit(EXIT_FAILURE);
+	}
 		
 	sqlstr = "CREATE TABLE metadb.file_cache(device, inode,"
 		 " mtime, parent, file PRIMARY KEY);"
 		 "CREATE UNIQUE INDEX metadb.index_file_cache_dev"
 		 " ON file_cache (device, inode); "
-		 "CREATE VIRTUAL TABLE metadb.mandb_dup USING fts4(section, name, "
-		   "name_desc, desc, lib, return_vals, env, files, "
-		   "exit_status, diagnostics, errors, machine "
-		    "); "	//mandb_dup
-		"CREATE VIRTUAL TABLE metadb.mandb_dupaux USING fts4aux(mandb_dup); ";	// mandb_dict
+		 MANDB_DUP_SCHEMA;
 
 	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
 	if (errmsg != NULL) {
@@ -429,9 +607,23 @@ main(int argc, char *argv[])
 		err(EXIT_FAILURE, "pclose error");
 	}
 
+	if (mflags.bulk)
+		keep_name_stopwords(db);
 	if (mflags.verbosity)
 		printf("Performing index update\n");
-	update_db(db, mp, &rec);
+	if (mflags.jobs > 1 && mflags.bulk)
+		build_shards(db, mp, dbpath);
+	else
+		update_db(db, mp, &rec);
+	/* An incremental update keeps them up to date page by page */
+	if (mflags.bulk) {
+		build_facets(db);
+		build_catalog(db);
+		build_names(db);
+		build_graph(db);
+		build_priors(db);
+	}
+	bump_generation(db);
 	mparse_free(mp);
 	free_secbuffs(&rec);
 
@@ -445,6 +637,8 @@ main(int argc, char *argv[])
 
 	sqlstr = "INSERT OR IGNORE INTO mandb_dict SELECT term, occurrences "
 		     "FROM metadb.mandb_dupaux; "
+		     "INSERT OR REPLACE INTO mandb_info "
+		     "VALUES ('dict_complete', 1); "
 		     "DROP TABLE metadb.mandb_dup; "
 			 "DROP TABLE metadb.mandb_dupaux;";
 	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
@@ -452,9 +646,23 @@ main(int argc, char *argv[])
 		warnx("%s", errmsg);
 		free(errmsg);
 	}
+
+	if (mflags.bulk) {
+		end_bulk_load(db);
+		train_codec(db);
+	}
+
 	if (mflags.optimize)
 		optimize(db);
 
+	/* The completions offered by suggest.cgi come from this */
+	if (mflags.verbosity == 2)
+		printf("Building the suggestion index\n");
+	easprintf(&sugpath, "%s%s", dbpath, SUGGEST_SUFFIX);
+	if (suggest_build(db, sugpath) == -1 && mflags.verbosity)
+		warnx("Could not build the suggestion index");
+	free(sugpath);
+
 	close_db(db);
 	return 0;
 }
@@ -505,6 +713,51 @@ traversedir(const char *parent, const char *file, sqlite3 *db,
 	}
 }
 
+/*
+ * keep_name_stopwords --
+ *  Keeps the stopwords which are the names of pages, like at(1) and
+ *  last(1), in the index, so that they can be searched for. The names are
+ *  told from the names of the files in file_cache. This is only done when
+ *  the index is built from scratch, the pages indexed before would not
+ *  have the words which were added.
+ */
+static void
+keep_name_stopwords(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *file;
+	const char *base;
+	char *names = NULL;
+	char *name;
+	size_t len;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT file FROM metadb.file_cache", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		if (mflags.verbosity)
+			warnx("%s", sqlite3_errmsg(db));
+		return;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if ((file = (const char *) sqlite3_column_text(stmt, 0)) == NULL)
+			continue;
+		base = (base = strrchr(file, '/')) != NULL ? base + 1 : file;
+		len = strcspn(base, ".");
+		if (len == 0 || !is_stopword(base, len))
+			continue;
+		name = estrndup(base, len);
+		concat(&names, name);
+		free(name);
+	}
+	sqlite3_finalize(stmt);
+
+	if (set_name_stopwords(db, names != NULL ? names : "") < 0 &&
+	    mflags.verbosity)
+		warnx("%s", sqlite3_errmsg(db));
+	free(names);
+}
+
 /* build_file_cache --
  *   This function generates an md5 hash of the file passed as it's 2nd parameter
  *   and stores it in a temporary table file_cache along with the full file path.
@@ -692,280 +945,2223 @@ archive_error:
 	return -1;
 }
 
-/* update_db --
- *	Does an incremental updation of the database by checking the file_cache.
- *	It parses and adds the pages which are present in file_cache,
- *	but not in the database.
- *	It also removes the pages which are present in the databse,
- *	but not in the file_cache.
+/*
+ * index_page --
+ *  Checks a single page from the file cache against the database and parses
+ *  and indexes it if it is new or has changed. The device, inode and mtime
+ *  fields of rec have to be filled in by the caller.
  */
 static void
-update_db(sqlite3 *db, struct mparse *mp, mandb_rec *rec)
+index_page(sqlite3 *db, struct mparse *mp, mandb_rec *rec, const char *parent,
+    const char *file, index_stats *stats)
 {
-	const char *sqlstr;
-	sqlite3_stmt *stmt = NULL;
-	const char *file;
-	const char *parent;
-	char *errmsg = NULL;
 	char *md5sum;
 	void *buf;
 	size_t buflen;
-	int new_count = 0;	/* Counter for newly indexed/updated pages */
-	int total_count = 0;	/* Counter for total number of pages */
-	int err_count = 0;	/* Counter for number of failed pages */
-	int link_count = 0;	/* Counter for number of hard/sym links */
 	int md5_status;
 	int rc;
 
-	sqlstr = "SELECT device, inode, mtime, parent, file"
-	         " FROM metadb.file_cache fc"
-	         " WHERE NOT EXISTS(SELECT 1 FROM mandb_meta WHERE"
-	         "  device = fc.device AND inode = fc.inode AND "
-	         "  mtime = fc.mtime AND file = fc.file)";
-
-	rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
+	stats->total_count++;
+	if (read_and_decompress(file, &buf, &buflen)) {
+		stats->err_count++;
+		return;
+	}
+	md5_status = check_md5(file, db, "mandb_meta", &md5sum, buf, buflen);
+	assert(md5sum != NULL);
+	if (md5_status == -1) {
 		if (mflags.verbosity)
-		warnx("%s", sqlite3_errmsg(db));
-		close_db(db);
-		errx(EXIT_FAILURE, "Could not query file cache");
+			warnx("An error occurred in checking md5 value"
+		      " for file %s", file);
+		stats->err_count++;
+		goto out;
 	}
 
-	buf = NULL;
-	while (sqlite3_step(stmt) == SQLITE_ROW) {
-		free(buf);
-		total_count++;
-		rec->device = sqlite3_column_int64(stmt, 0);
-		rec->inode = sqlite3_column_int64(stmt, 1);
-		rec->mtime = sqlite3_column_int64(stmt, 2);
-		parent = (const char *) sqlite3_column_text(stmt, 3);
-		file = (const char *) sqlite3_column_text(stmt, 4);
-		if (read_and_decompress(file, &buf, &buflen)) {
-			err_count++;
-			buf = NULL;
-			continue;
-		}
-		md5_status = check_md5(file, db, "mandb_meta", &md5sum, buf, buflen);
-		assert(md5sum != NULL);
-		if (md5_status == -1) {
-			if (mflags.verbosity)
-				warnx("An error occurred in checking md5 value"
-			      " for file %s", file);
-			err_count++;
-			continue;
-		}
-
-		if (md5_status == 0) {
-			/*
-			 * The MD5 hash is already present in the database,
-			 * so simply update the metadata, ignoring symlinks.
-			 */
-			struct stat sb;
-			stat(file, &sb);
-			if (S_ISLNK(sb.st_mode)) {
-				free(md5sum);
-				link_count++;
-				continue;
-			}
-			update_existing_entry(db, file, md5sum, rec,
-			    &new_count, &link_count, &err_count);
+	if (md5_status == 0) {
+		/*
+		 * The MD5 hash is already present in the database,
+		 * so simply update the metadata, ignoring symlinks.
+		 */
+		struct stat sb;
+		stat(file, &sb);
+		if (S_ISLNK(sb.st_mode)) {
 			free(md5sum);
-			continue;
+			stats->link_count++;
+			goto out;
 		}
+		update_existing_entry(db, file, md5sum, rec,
+		    &stats->new_count, &stats->link_count, &stats->err_count);
+		free(md5sum);
+		goto out;
+	}
 
-		if (md5_status == 1) {
-			/*
-			 * The MD5 hash was not present in the database.
-			 * This means is either a new file or an updated file.
-			 * We should go ahead with parsing.
-			 */
-			if (mflags.verbosity == 2)
-				printf("Parsing: %s\n", file);
-			rec->md5_hash = md5sum;
-			rec->file_path = estrdup(file);
-			// file_path is freed by insert_into_db itself.
-			chdir(parent);
-			begin_parse(file, mp, rec, buf, buflen);
-			if (insert_into_db(db, rec) < 0) {
-				if (mflags.verbosity)
-					warnx("Error in indexing %s", file);
-				err_count++;
-			} else {
-				new_count++;
-			}
+	if (md5_status == 1) {
+		/*
+		 * The MD5 hash was not present in the database.
+		 * This means is either a new file or an updated file.
+		 * We should go ahead with parsing.
+		 */
+		if (mflags.verbosity == 2)
+			printf("Parsing: %s\n", file);
+		rec->md5_hash = md5sum;
+		rec->file_path = estrdup(file);
+		// file_path is freed by insert_into_db itself.
+		chdir(parent);
+		begin_parse(file, mp, rec, buf, buflen);
+		rc = insert_into_db(db, rec);
+		if (rc < 0) {
+			if (mflags.verbosity)
+				warnx("Error in indexing %s", file);
+			stats->err_count++;
+		} else if (rc > 0) {
+			stats->variant_count++;
+		} else {
+			stats->new_count++;
 		}
 	}
+out:
 	free(buf);
+	throttle(db, buflen);
+}
 
-	sqlite3_finalize(stmt);
-	
+static void
+print_stats(const index_stats *stats)
+{
 	if (mflags.verbosity == 2) {
 		printf("Total Number of new or updated pages encountered = %d\n"
 			"Total number of (hard or symbolic) links found = %d\n"
 			"Total number of pages that were successfully"
 			" indexed/updated = %d\n"
+			"Total number of near-duplicate pages folded into"
+			" another page = %d\n"
 			"Total number of pages that could not be indexed"
 			" due to errors = %d\n",
-			total_count - link_count, link_count, new_count, err_count);
-	}
-
-	if (mflags.recreate)
-		return;
-
-	if (mflags.verbosity == 2)
-		printf("Deleting stale index entries\n");
-
-	sqlstr = "DELETE FROM mandb_meta WHERE file NOT IN"
-		 " (SELECT file FROM metadb.file_cache);"
-		 "DELETE FROM mandb_links WHERE md5_hash NOT IN"
-		 " (SELECT md5_hash from mandb_meta);"
-		 "DROP TABLE metadb.file_cache;"
-		 "DELETE FROM mandb WHERE rowid NOT IN"
-		 " (SELECT id FROM mandb_meta);";
-
-	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
-	if (errmsg != NULL) {
-		warnx("Removing old entries failed: %s", errmsg);
-		warnx("Please rebuild database from scratch with -f.");
-		free(errmsg);
-		return;
+			stats->total_count - stats->link_count, stats->link_count,
+			stats->new_count, stats->variant_count, stats->err_count);
 	}
 }
 
-/*
- * begin_parse --
- *  parses the man page using libmandoc
- */
-static void
-begin_parse(const char *file, struct mparse *mp, mandb_rec *rec,
-    const void *buf, size_t len)
-{
-	struct mdoc *mdoc;
-	struct man *man;
-	mparse_reset(mp);
-
-	rec->xr_found = 0;
-
-	if (mparse_readmem(mp, buf, len, file) >= MANDOCLEVEL_FATAL) {
-		/* Printing this warning at verbosity level 2
-		 * because some packages from pkgsrc might trigger several
-		 * of such warnings.
-		 */
-		if (mflags.verbosity == 2)
-			warnx("%s: Parse failure", file);
-		return;
-	}
+/* Reference points of throttle() */
+static struct {
+	struct timespec start;	// When indexing started
+	double cpu;	// CPU time used by then
+	double bytes;	// Page data read since
+	int npages;	// Pages indexed since
+} throttle_state;
 
-	mparse_result(mp, &mdoc, &man);
-	if (mdoc == NULL && man == NULL) {
-		if (mflags.verbosity == 2)
-			warnx("Not a man(7) or mdoc(7) page");
-		return;
-	}
+static double
+cpu_time(void)
+{
+	struct rusage ru;
 
-	set_machine(mdoc, rec);
-	set_section(mdoc, man, rec);
-	if (mdoc) {
-		rec->page_type = MDOC;
-		pmdoc_node(mdoc_node(mdoc), rec);
-	} else {
-		rec->page_type = MAN;
-		pman_node(man_node(man), rec);
-	}
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
 }
 
 /*
- * set_section --
- *  Extracts the section number and normalizes it to only the numeric part
- *  (Which should be the first character of the string).
+ * throttle_start --
+ *  Starts accounting for throttle(). The worker processes of build_shards
+ *  call it again, as they start with their own CPU times.
  */
 static void
-set_section(const struct mdoc *md, const struct man *m, mandb_rec *rec)
+throttle_start(void)
 {
-	if (md) {
-		const struct mdoc_meta *md_meta = mdoc_meta(md);
-		rec->section[0] = md_meta->msec[0];
-	} else if (m) {
-		const struct man_meta *m_meta = man_meta(m);
-		rec->section[0] = m_meta->msec[0];
-	}
+	clock_gettime(CLOCK_MONOTONIC, &throttle_state.start);
+	throttle_state.cpu = cpu_time();
+	throttle_state.bytes = 0;
+	throttle_state.npages = 0;
 }
 
 /*
- * get_machine --
- *  Extracts the machine architecture information if available.
+ * throttle --
+ *  Called after every page with the number of bytes read for it. Every
+ *  THROTTLE_BATCH pages, sleeps for as long as needed to bring the CPU time
+ *  and the amount of data used since throttle_start() back within the share
+ *  of the elapsed time and the rate given by -t and -r. The transaction of
+ *  db is committed before and begun again after, so that the database can
+ *  be searched in the meantime.
  */
 static void
-set_machine(const struct mdoc *md, mandb_rec *rec)
-{
-	if (md == NULL)
-		return;
-	const struct mdoc_meta *md_meta = mdoc_meta(md);
-	if (md_meta->arch)
-		rec->machine = estrdup(md_meta->arch);
-}
-
-static void
-pmdoc_node(const struct mdoc_node *n, mandb_rec *rec)
+throttle(sqlite3 *db, size_t nbytes)
 {
+	struct timespec now, ts;
+	double elapsed, target = 0;
+	char *errmsg = NULL;
+	int committed;
 
-	if (n == NULL)
+	if (mflags.cpu_share == 0 && mflags.io_rate == 0)
+		return;
+	throttle_state.bytes += nbytes;
+	if (++throttle_state.npages % THROTTLE_BATCH)
 		return;
 
-	switch (n->type) {
-	case (MDOC_BODY):
-		/* FALLTHROUGH */
-	case (MDOC_TAIL):
-		/* FALLTHROUGH */
-	case (MDOC_ELEM):
-		if (mdocs[n->tok] == NULL)
-			break;
-		(*mdocs[n->tok])(n, rec);
-		break;
-	default:
-		break;
+	if (mflags.cpu_share)
+		target = (cpu_time() - throttle_state.cpu) * 100 /
+		    mflags.cpu_share;
+	if (mflags.io_rate && throttle_state.bytes / 1024 / mflags.io_rate >
+	    target)
+		target = throttle_state.bytes / 1024 / mflags.io_rate;
+
+	committed = !sqlite3_get_autocommit(db) &&
+	    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = now.tv_sec - throttle_state.start.tv_sec +
+	    (now.tv_nsec - throttle_state.start.tv_nsec) / 1e9;
+	if (target > elapsed) {
+		ts.tv_sec = target - elapsed;
+		ts.tv_nsec = (target - elapsed - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+	if (!committed)
+		return;
+	sqlite3_exec(db, "BEGIN", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		exit(EXIT_FAILURE);
 	}
-
-	pmdoc_node(n->child, rec);
-	pmdoc_node(n->next, rec);
 }
 
 /*
- * pmdoc_Nm --
- *  Extracts the Name of the manual page from the .Nm macro
+ * parse_count --
+ *  Parses the numeric argument of an option, which has to lie between 1 and
+ *  max. what describes the argument in the error message.
  */
-static void
-pmdoc_Nm(const struct mdoc_node *n, mandb_rec *rec)
+static long
+parse_count(const char *arg, long max, const char *what)
 {
-	if (n->sec != SEC_NAME)
-		return;
-
-	for (n = n->child; n; n = n->next) {
-		if (n->type == MDOC_TEXT) {
-			concat(&rec->name, n->string);
-		}
-	}
+	char *ep;
+	long val;
+
+	errno = 0;
+	val = strtol(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno != 0 || val < 1 || val > max)
+		errx(EXIT_FAILURE, "Invalid %s: %s", what, arg);
+	return val;
 }
 
 /*
- * pmdoc_Nd --
- *  Extracts the one line description of the man page from the .Nd macro
+ * build_shards --
+ *  Indexes the pages of the file cache with mflags.jobs worker processes.
+ *  The docids are numbered in FILE_CACHE_ORDER up front and each worker gets
+ *  a contiguous range of them, which it writes into its own database next to
+ *  dbpath. The shards never collide and are then merged into db.
+ *  Only used for bulk loads, when db is still empty.
  */
 static void
-pmdoc_Nd(const struct mdoc_node *n, mandb_rec *rec)
+build_shards(sqlite3 *db, struct mparse *mp, const char *dbpath)
 {
-	/*
-	 * A static variable for keeping track of whether a Xr macro was seen
-	 * previously.
-	 */
-	char *buf = NULL;
-	char *temp;
-
-	if (n == NULL)
-		return;
+	sqlite3_stmt *stmt;
+	shard_page *pages = NULL;
+	pid_t *pids;
+	int *fds;
+	int fd[2];
+	char **shardpaths;
+	char *dictpath;
+	char *errmsg = NULL;
+	size_t npages = 0, pagesize = 0;
+	size_t i, lo, hi;
+	index_stats stats, worker_stats;
+	int njobs, k, status, failed = 0, dups = 0;
+	int variants;
+	int rc;
 
-	if (n->type == MDOC_TEXT) {
-		if (rec->xr_found && n->next) {
+	rc = sqlite3_prepare_v2(db, "SELECT device, inode, mtime, parent, file"
+	    " FROM metadb.file_cache" FILE_CACHE_ORDER, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		if (mflags.verbosity)
+			warnx("%s", sqlite3_errmsg(db));
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not query file cache");
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (npages == pagesize) {
+			pagesize = pagesize ? pagesize * 2 : 1024;
+			pages = erealloc(pages, pagesize * sizeof(*pages));
+		}
+		pages[npages].docid = npages + 1;
+		pages[npages].device = sqlite3_column_int64(stmt, 0);
+		pages[npages].inode = sqlite3_column_int64(stmt, 1);
+		pages[npages].mtime = sqlite3_column_int64(stmt, 2);
+		pages[npages].parent =
+		    estrdup((const char *) sqlite3_column_text(stmt, 3));
+		pages[npages].file =
+		    estrdup((const char *) sqlite3_column_text(stmt, 4));
+		npages++;
+	}
+	sqlite3_finalize(stmt);
+
+	njobs = mflags.jobs;
+	if ((size_t) njobs > npages)
+		njobs = npages ? npages : 1;
+
+	/*
+	 * Shards can only be attached outside of a transaction. Nothing has
+	 * been written to the main database yet, so end the one begun by
+	 * main() here and open a new one for it to commit at the end.
+	 */
+	sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		exit(EXIT_FAILURE);
+	}
+
+	if (mflags.verbosity == 2)
+		printf("Indexing %zu pages with %d jobs\n", npages, njobs);
+
+	pids = emalloc(njobs * sizeof(*pids));
+	fds = emalloc(njobs * sizeof(*fds));
+	shardpaths = emalloc(njobs * sizeof(*shardpaths));
+	fflush(stdout);
+	fflush(stderr);
+	for (k = 0; k < njobs; k++) {
+		easprintf(&shardpaths[k], "%s.shard.%d", dbpath, k);
+		lo = npages * k / njobs;
+		hi = npages * (k + 1) / njobs;
+		if (pipe(fd) == -1)
+			err(EXIT_FAILURE, "pipe");
+		switch (pids[k] = fork()) {
+		case -1:
+			err(EXIT_FAILURE, "fork");
+		case 0:
+			close(fd[0]);
+			run_shard(shardpaths[k], mp, pages + lo, hi - lo, fd[1]);
+		default:
+			close(fd[1]);
+			fds[k] = fd[0];
+		}
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	for (k = 0; k < njobs; k++) {
+		if (read(fds[k], &worker_stats, sizeof(worker_stats)) !=
+		    sizeof(worker_stats))
+			failed = 1;
+		close(fds[k]);
+		if (waitpid(pids[k], &status, 0) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed = 1;
+		stats.new_count += worker_stats.new_count;
+		stats.total_count += worker_stats.total_count;
+		stats.err_count += worker_stats.err_count;
+		stats.link_count += worker_stats.link_count;
+		stats.variant_count += worker_stats.variant_count;
+	}
+
+	for (i = 0; i < npages; i++) {
+		free(pages[i].parent);
+		free(pages[i].file);
+	}
+	free(pages);
+	free(pids);
+	free(fds);
+
+	if (!failed) {
+		if (mflags.verbosity == 2)
+			printf("Merging shards\n");
+		sqlite3_exec(db, "CREATE TABLE metadb.dict_merge(word, frequency)",
+		    NULL, NULL, &errmsg);
+		if (errmsg != NULL) {
+			warnx("%s", errmsg);
+			free(errmsg);
+			failed = 1;
+		}
+	}
+	for (k = 0; k < njobs; k++) {
+		if (!failed && merge_shard(db, shardpaths[k], &dups) < 0)
+			failed = 1;
+		remove(shardpaths[k]);
+		easprintf(&dictpath, "%s-dict", shardpaths[k]);
+		remove(dictpath);
+		free(dictpath);
+		free(shardpaths[k]);
+	}
+	free(shardpaths);
+	if (failed) {
+		close_db(db);
+		errx(EXIT_FAILURE, "Building the index in shards failed");
+	}
+
+	/*
+	 * Copies of a page indexed by more than one worker were kept only
+	 * once in mandb_meta, drop the extra ones from the index itself.
+	 */
+	sqlite3_exec(db, "BEGIN;"
+	    "INSERT OR IGNORE INTO mandb_dict SELECT word, sum(frequency)"
+	    " FROM metadb.dict_merge GROUP BY word;"
+	    "DROP TABLE metadb.dict_merge", NULL, NULL, &errmsg);
+	if (errmsg == NULL && dups)
+		sqlite3_exec(db, "DELETE FROM mandb WHERE docid NOT IN"
+		    " (SELECT id FROM mandb_meta)", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		exit(EXIT_FAILURE);
+	}
+	stats.link_count += dups;
+	stats.new_count -= dups;
+
+	/* Near-duplicates indexed by different workers */
+	if ((variants = collapse_variants(db)) < 0) {
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not fold the near-duplicate pages");
+	}
+	stats.variant_count += variants;
+	stats.new_count -= variants;
+	print_stats(&stats);
+}
+
+/*
+ * collapse_variants --
+ *  Folds the pages which are near-duplicates of another page with a lower
+ *  docid into it, like insert_into_db does for the pages of a single
+ *  worker: their files are moved from mandb_meta to mandb_variants, with
+ *  the docid of that page, their links are moved to that page, and they
+ *  are removed from the index. Returns the number of pages folded, or -1
+ *  on error.
+ */
+static int
+collapse_variants(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 *kept = NULL;
+	uint64_t *hashes = NULL;
+	sqlite3_int64 *folded = NULL;
+	size_t nkept = 0;
+	size_t nfolded = 0;
+	size_t size = 0;
+	size_t foldedsize = 0;
+	sqlite3_int64 docid;
+	uint64_t simhash;
+	char *name = NULL;
+	char *section = NULL;
+	const char *n, *sec;
+	char *sql;
+	char *errmsg = NULL;
+	size_t i;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT name, section, docid, simhash"
+	    " FROM mandb_signatures ORDER BY name, section, docid", -1, &stmt,
+	    NULL);
+	if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(db));
+		return -1;
+	}
+	/*
+	 * kept holds the docids of the pages of the current name and section
+	 * which are not near-duplicates of each other, with their hashes, and
+	 * folded the pairs of a page to fold and the page to fold it into.
+	 */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		n = (const char *) sqlite3_column_text(stmt, 0);
+		sec = (const char *) sqlite3_column_text(stmt, 1);
+		docid = sqlite3_column_int64(stmt, 2);
+		simhash = (uint64_t) sqlite3_column_int64(stmt, 3);
+		if (n == NULL || sec == NULL)
+			continue;
+		if (name == NULL || strcmp(name, n) != 0 ||
+		    strcmp(section, sec) != 0) {
+			free(name);
+			free(section);
+			name = estrdup(n);
+			section = estrdup(sec);
+			nkept = 0;
+		}
+		for (i = 0; i < nkept; i++)
+			if (simhash_distance(simhash, hashes[i]) <=
+			    SIMHASH_DISTANCE)
+				break;
+		if (i < nkept) {
+			if (nfolded == foldedsize) {
+				foldedsize = foldedsize ? 2 * foldedsize : 64;
+				folded = erealloc(folded,
+				    2 * foldedsize * sizeof(*folded));
+			}
+			folded[2 * nfolded] = docid;
+			folded[2 * nfolded++ + 1] = kept[i];
+			continue;
+		}
+		if (nkept == size) {
+			size = size ? 2 * size : 16;
+			kept = erealloc(kept, size * sizeof(*kept));
+			hashes = erealloc(hashes, size * sizeof(*hashes));
+		}
+		kept[nkept] = docid;
+		hashes[nkept++] = simhash;
+	}
+	sqlite3_finalize(stmt);
+	free(name);
+	free(section);
+	free(kept);
+	free(hashes);
+
+	for (i = 0; i < nfolded && errmsg == NULL; i++) {
+		docid = folded[2 * i];
+		sql = sqlite3_mprintf("INSERT OR REPLACE INTO mandb_variants"
+		    " SELECT device, inode, mtime, file, md5_hash, %lld,"
+		    " (SELECT machine FROM mandb WHERE docid = %lld)"
+		    " FROM mandb_meta WHERE id = %lld;"
+		    "UPDATE mandb_variants SET docid = %lld WHERE docid = %lld;"
+		    "DELETE FROM mandb_links WHERE md5_hash ="
+		    " (SELECT md5_hash FROM mandb_meta WHERE id = %lld)"
+		    " AND EXISTS (SELECT 1 FROM mandb_links AS l WHERE"
+		    "  l.link = mandb_links.link AND"
+		    "  l.machine IS mandb_links.machine AND l.md5_hash ="
+		    "  (SELECT md5_hash FROM mandb_meta WHERE id = %lld));"
+		    "UPDATE mandb_links SET md5_hash ="
+		    " (SELECT md5_hash FROM mandb_meta WHERE id = %lld)"
+		    " WHERE md5_hash ="
+		    " (SELECT md5_hash FROM mandb_meta WHERE id = %lld);"
+		    "DELETE FROM mandb_meta WHERE id = %lld;"
+		    "DELETE FROM mandb WHERE docid = %lld;"
+		    "DELETE FROM mandb_symbols WHERE docid = %lld;"
+		    "DELETE FROM mandb_xrefs WHERE docid = %lld;"
+		    "DELETE FROM mandb_signatures WHERE docid = %lld",
+		    folded[2 * i + 1], docid, docid, folded[2 * i + 1], docid,
+		    docid, folded[2 * i + 1], folded[2 * i + 1], docid, docid,
+		    docid, docid, docid, docid);
+		sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+		sqlite3_free(sql);
+	}
+	free(folded);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		return -1;
+	}
+	return nfolded;
+}
+
+/*
+ * run_shard --
+ *  Body of a worker process of build_shards. Indexes the given pages into a
+ *  fresh database at shardpath and reports its counters to the parent
+ *  through fd. The mandb_dup table used for building mandb_dict is kept in
+ *  a second file, shardpath-dict, so that the parent can leave out the pages
+ *  which another worker indexed already.
+ */
+static void
+run_shard(const char *shardpath, struct mparse *mp, shard_page *pages,
+    size_t npages, int fd)
+{
+	sqlite3 *db;
+	mandb_rec rec;
+	index_stats stats;
+	char *sqlstr;
+	char *errmsg = NULL;
+	size_t i;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	throttle_start();
+	remove(shardpath);
+	if ((db = open_db(MANDB_CREATE, shardpath)) == NULL)
+		_exit(EXIT_FAILURE);
+	if (drop_db_indexes(db) < 0) {
+		sqlite3_close(db);
+		_exit(EXIT_FAILURE);
+	}
+	sqlstr = sqlite3_mprintf("ATTACH DATABASE \'%q-dict\' AS metadb",
+	    shardpath);
+	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+	sqlite3_free(sqlstr);
+	if (errmsg == NULL)
+		sqlite3_exec(db, "PRAGMA synchronous = 0;"
+		    "PRAGMA journal_mode = OFF;"
+		    "PRAGMA metadb.synchronous = 0;"
+		    "PRAGMA metadb.journal_mode = OFF;"
+		    MANDB_DUP_SCHEMA
+		    "BEGIN", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		sqlite3_close(db);
+		_exit(EXIT_FAILURE);
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	init_secbuffs(&rec);
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < npages; i++) {
+		rec.docid = pages[i].docid;
+		rec.device = pages[i].device;
+		rec.inode = pages[i].inode;
+		rec.mtime = pages[i].mtime;
+		index_page(db, mp, &rec, pages[i].parent, pages[i].file,
+		    &stats);
+	}
+	free_secbuffs(&rec);
+
+	sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		sqlite3_close(db);
+		_exit(EXIT_FAILURE);
+	}
+	sqlite3_close(db);
+	fflush(stdout);
+	if (write(fd, &stats, sizeof(stats)) != sizeof(stats))
+		_exit(EXIT_FAILURE);
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * fts_get_varint --
+ *  Decodes a varint in the format used by the FTS module from p, which is
+ *  at most n bytes long. Returns the number of bytes read or 0 if the input
+ *  is truncated.
+ */
+static int
+fts_get_varint(const unsigned char *p, int n, sqlite3_int64 *v)
+{
+	sqlite3_uint64 x = 0;
+	int i;
+
+	for (i = 0; i < n && i < 10; i++) {
+		x |= (sqlite3_uint64) (p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0) {
+			*v = (sqlite3_int64) x;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static int
+fts_put_varint(unsigned char *p, sqlite3_int64 v)
+{
+	sqlite3_uint64 x = v;
+	int i = 0;
+
+	do {
+		p[i++] = (x & 0x7f) | 0x80;
+		x >>= 7;
+	} while (x);
+	p[i - 1] &= 0x7f;
+	return i;
+}
+
+/*
+ * bind_rebased_node --
+ *  Binds the FTS b-tree node blk to parameter idx of stmt, with the blockid
+ *  of its leftmost child moved up by off. Leaf nodes (height 0) do not refer
+ *  to other blocks and are bound as they are.
+ */
+static int
+bind_rebased_node(sqlite3_stmt *stmt, int idx, const unsigned char *blk,
+    int n, sqlite3_int64 off)
+{
+	sqlite3_int64 height, child;
+	unsigned char *out;
+	int h, c, len;
+
+	if ((h = fts_get_varint(blk, n, &height)) == 0 || height == 0 ||
+	    (c = fts_get_varint(blk + h, n - h, &child)) == 0)
+		return sqlite3_bind_blob(stmt, idx, blk, n, SQLITE_TRANSIENT);
+
+	out = emalloc(n + 10);
+	memcpy(out, blk, h);
+	len = h + fts_put_varint(out + h, child + off);
+	memcpy(out + len, blk + h + c, n - h - c);
+	len += n - h - c;
+	return sqlite3_bind_blob(stmt, idx, out, len, free);
+}
+
+/*
+ * merge_doctotals --
+ *  Adds the document and token totals kept by the FTS module for the shard
+ *  to those of the main database.
+ */
+static int
+merge_doctotals(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 totals[SECMAX + 16];
+	sqlite3_int64 v;
+	const unsigned char *p;
+	unsigned char out[(SECMAX + 16) * 10];
+	int ntotals = 0;
+	int i, n, len, rc;
+
+	memset(totals, 0, sizeof(totals));
+	rc = sqlite3_prepare_v2(db, "SELECT value FROM main.mandb_stat"
+	    " WHERE id = 0 UNION ALL SELECT value FROM shard.mandb_stat"
+	    " WHERE id = 0", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		p = sqlite3_column_blob(stmt, 0);
+		n = sqlite3_column_bytes(stmt, 0);
+		for (i = 0; n > 0 && i < (int) __arraycount(totals); i++) {
+			if ((len = fts_get_varint(p, n, &v)) == 0)
+				break;
+			totals[i] += v;
+			p += len;
+			n -= len;
+		}
+		if (i > ntotals)
+			ntotals = i;
+	}
+	sqlite3_finalize(stmt);
+	if (ntotals == 0)
+		return 0;
+
+	for (i = 0, len = 0; i < ntotals; i++)
+		len += fts_put_varint(out + len, totals[i]);
+	rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO main.mandb_stat"
+	    " VALUES (0, ?)", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	sqlite3_bind_blob(stmt, 1, out, len, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * merge_segments --
+ *  Copies the FTS segments of the shard into the main database. The blocks
+ *  are renumbered past the ones already there and every segment is appended
+ *  to its level, so the inverted index of the shard is reused as it is
+ *  instead of tokenizing the pages again.
+ */
+static int
+merge_segments(sqlite3 *db)
+{
+	sqlite3_stmt *stmt, *ins;
+	sqlite3_int64 off = 0, blocks[3];
+	const char *end;
+	char *endstr;
+	int i, rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT max(blockid) FROM main.mandb_segments",
+	    -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		off = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	rc = sqlite3_prepare_v2(db, "SELECT blockid, block"
+	    " FROM shard.mandb_segments", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	rc = sqlite3_prepare_v2(db, "INSERT INTO main.mandb_segments"
+	    " VALUES (?, ?)", -1, &ins, NULL);
+	if (rc != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_bind_int64(ins, 1, sqlite3_column_int64(stmt, 0) + off);
+		bind_rebased_node(ins, 2, sqlite3_column_blob(stmt, 1),
+		    sqlite3_column_bytes(stmt, 1), off);
+		if ((rc = sqlite3_step(ins)) != SQLITE_DONE)
+			break;
+		sqlite3_reset(ins);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(ins);
+	if (rc != SQLITE_DONE)
+		return -1;
+
+	rc = sqlite3_prepare_v2(db, "SELECT level, start_block,"
+	    " leaves_end_block, end_block, root FROM shard.mandb_segdir"
+	    " ORDER BY level, idx", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	rc = sqlite3_prepare_v2(db, "INSERT INTO main.mandb_segdir VALUES"
+	    " (?1, (SELECT ifnull(max(idx) + 1, 0) FROM main.mandb_segdir"
+	    "  WHERE level = ?1), ?2, ?3, ?4, ?5)", -1, &ins, NULL);
+	if (rc != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		/* A segment whose root is its only node has no blocks */
+		for (i = 0; i < 3; i++) {
+			blocks[i] = sqlite3_column_int64(stmt, i + 1);
+			if (blocks[i])
+				blocks[i] += off;
+		}
+		sqlite3_bind_int64(ins, 1, sqlite3_column_int64(stmt, 0));
+		sqlite3_bind_int64(ins, 2, blocks[0]);
+		sqlite3_bind_int64(ins, 3, blocks[1]);
+		/*
+		 * Newer versions of the FTS module store the end block
+		 * followed by the size of the segment as text.
+		 */
+		end = NULL;
+		if (sqlite3_column_type(stmt, 3) == SQLITE_TEXT)
+			end = strchr((const char *) sqlite3_column_text(stmt, 3),
+			    ' ');
+		if (end != NULL) {
+			endstr = sqlite3_mprintf("%lld%s", blocks[2], end);
+			sqlite3_bind_text(ins, 4, endstr, -1, sqlite3_free);
+		} else
+			sqlite3_bind_int64(ins, 4, blocks[2]);
+		bind_rebased_node(ins, 5, sqlite3_column_blob(stmt, 4),
+		    sqlite3_column_bytes(stmt, 4), off);
+		if ((rc = sqlite3_step(ins)) != SQLITE_DONE)
+			break;
+		sqlite3_reset(ins);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(ins);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * merge_shard --
+ *  Merges the database built by a worker into db. The docids of the shards
+ *  are disjoint, so the FTS tables are merged by copying their shadow tables.
+ *  Pages with the same contents as one merged from an earlier shard are
+ *  counted in dups and left out of mandb_dict, like the serial path counts
+ *  them as links, and the near-duplicates folded into them are folded into
+ *  that page instead.
+ */
+static int
+merge_shard(sqlite3 *db, const char *shardpath, int *dups)
+{
+	sqlite3_stmt *stmt;
+	char *sqlstr;
+	char *errmsg = NULL;
+	int nshard, nmeta;
+	int rc;
+
+	sqlstr = sqlite3_mprintf("ATTACH DATABASE %Q AS shard;"
+	    "ATTACH DATABASE \'%q-dict\' AS sharddict", shardpath, shardpath);
+	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+	sqlite3_free(sqlstr);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		return -1;
+	}
+
+	/*
+	 * Leave the pages indexed by an earlier shard out of mandb_dict. This
+	 * has to be committed on its own, fts4aux does not see changes to the
+	 * FTS table still pending in the transaction.
+	 */
+	sqlite3_exec(db, "DELETE FROM sharddict.mandb_dup WHERE docid IN"
+	    " (SELECT id FROM shard.mandb_meta WHERE md5_hash IN"
+	    "  (SELECT md5_hash FROM main.mandb_meta))", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		sqlite3_exec(db, "DETACH DATABASE shard;"
+		    "DETACH DATABASE sharddict", NULL, NULL, NULL);
+		return -1;
+	}
+
+	sqlite3_exec(db, "BEGIN;"
+	    "INSERT INTO main.mandb_content SELECT * FROM shard.mandb_content;"
+	    "INSERT INTO main.mandb_docsize SELECT * FROM shard.mandb_docsize",
+	    NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+	if (merge_segments(db) < 0 || merge_doctotals(db) < 0)
+		goto sqlerror;
+
+	rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM shard.mandb_meta", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK)
+		goto sqlerror;
+	nshard = sqlite3_step(stmt) == SQLITE_ROW ?
+	    sqlite3_column_int(stmt, 0) : 0;
+	sqlite3_finalize(stmt);
+
+	nmeta = sqlite3_total_changes(db);
+	sqlite3_exec(db, "INSERT OR IGNORE INTO main.mandb_meta"
+	    " SELECT * FROM shard.mandb_meta", NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+	nmeta = sqlite3_total_changes(db) - nmeta;
+
+	sqlite3_exec(db, "INSERT INTO main.mandb_links"
+	    " SELECT * FROM shard.mandb_links WHERE md5_hash IN"
+	    "  (SELECT md5_hash FROM shard.mandb_meta WHERE id IN"
+	    "   (SELECT id FROM main.mandb_meta));"
+	    "INSERT INTO main.mandb_symbols"
+	    " SELECT * FROM shard.mandb_symbols WHERE docid IN"
+	    "  (SELECT id FROM main.mandb_meta);"
+	    "INSERT INTO main.mandb_xrefs"
+	    " SELECT * FROM shard.mandb_xrefs WHERE docid IN"
+	    "  (SELECT id FROM main.mandb_meta);"
+	    "INSERT INTO main.mandb_signatures"
+	    " SELECT * FROM shard.mandb_signatures WHERE docid IN"
+	    "  (SELECT id FROM main.mandb_meta);"
+	    "INSERT OR IGNORE INTO main.mandb_variants"
+	    " SELECT * FROM shard.mandb_variants WHERE docid IN"
+	    "  (SELECT id FROM main.mandb_meta);"
+	    "INSERT OR IGNORE INTO main.mandb_variants"
+	    " SELECT v.device, v.inode, v.mtime, v.file, v.md5_hash, m.id,"
+	    "  v.machine"
+	    " FROM shard.mandb_variants AS v"
+	    " JOIN shard.mandb_meta AS s ON s.id = v.docid"
+	    " JOIN main.mandb_meta AS m ON m.md5_hash = s.md5_hash"
+	    " WHERE v.docid NOT IN (SELECT id FROM main.mandb_meta);"
+	    "INSERT INTO metadb.dict_merge SELECT term, occurrences"
+	    " FROM sharddict.mandb_dupaux WHERE col = \'*\';"
+	    "COMMIT;"
+	    "DETACH DATABASE shard;"
+	    "DETACH DATABASE sharddict", NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+
+	*dups += nshard - nmeta;
+	return 0;
+
+sqlerror:
+	warnx("%s", sqlite3_errmsg(db));
+	goto out;
+error:
+	warnx("%s", errmsg);
+	free(errmsg);
+out:
+	sqlite3_exec(db, "ROLLBACK; DETACH DATABASE shard;"
+	    "DETACH DATABASE sharddict", NULL, NULL, NULL);
+	return -1;
+}
+
+/* update_db --
+ *	Does an incremental updation of the database by checking the file_cache.
+ *	It parses and adds the pages which are present in file_cache,
+ *	but not in the database.
+ *	It also removes the pages which are present in the databse,
+ *	but not in the file_cache.
+ */
+static void
+update_db(sqlite3 *db, struct mparse *mp, mandb_rec *rec)
+{
+	const char *sqlstr;
+	sqlite3_stmt *stmt = NULL;
+	const char *file;
+	const char *parent;
+	char *errmsg = NULL;
+	index_stats stats;
+	sqlite3_int64 *stale = NULL;
+	size_t nstale = 0;
+	size_t stalesize = 0;
+	size_t i;
+	int rc;
+
+	/*
+	 * When bulk loading there is nothing in mandb_meta to compare
+	 * against, and without its indexes the NOT EXISTS probe would turn
+	 * into a full scan for every file.
+	 */
+	if (mflags.bulk)
+		sqlstr = "SELECT device, inode, mtime, parent, file"
+			 " FROM metadb.file_cache" FILE_CACHE_ORDER;
+	else
+		sqlstr = "SELECT device, inode, mtime, parent, file"
+			 " FROM metadb.file_cache fc"
+			 " WHERE NOT EXISTS(SELECT 1 FROM mandb_meta WHERE"
+			 "  device = fc.device AND inode = fc.inode AND "
+			 "  mtime = fc.mtime AND file = fc.file)"
+			 " AND NOT EXISTS(SELECT 1 FROM mandb_variants WHERE"
+			 "  device = fc.device AND inode = fc.inode AND "
+			 "  mtime = fc.mtime AND file = fc.file)";
+
+	/*
+	 * The near-duplicates of the pages whose file is gone or was modified
+	 * are indexed again below, as pages of their own or near-duplicates
+	 * of another page, since they need not be close to the new text.
+	 */
+	if (!mflags.bulk) {
+		sqlite3_exec(db, "CREATE TEMP TABLE stale_pages AS"
+		    " SELECT id FROM mandb_meta m WHERE NOT EXISTS"
+		    " (SELECT 1 FROM metadb.file_cache fc WHERE"
+		    "  fc.file = m.file AND fc.device = m.device AND"
+		    "  fc.inode = m.inode AND fc.mtime = m.mtime);"
+		    "DELETE FROM mandb_variants WHERE docid IN"
+		    " (SELECT id FROM stale_pages);"
+		    "DELETE FROM mandb_signatures WHERE docid IN"
+		    " (SELECT id FROM stale_pages);"
+		    "DROP TABLE stale_pages", NULL, NULL, &errmsg);
+		if (errmsg != NULL) {
+			warnx("%s", errmsg);
+			free(errmsg);
+			errmsg = NULL;
+		}
+	}
+
+	rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		if (mflags.verbosity)
+		warnx("%s", sqlite3_errmsg(db));
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not query file cache");
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		rec->device = sqlite3_column_int64(stmt, 0);
+		rec->inode = sqlite3_column_int64(stmt, 1);
+		rec->mtime = sqlite3_column_int64(stmt, 2);
+		parent = (const char *) sqlite3_column_text(stmt, 3);
+		file = (const char *) sqlite3_column_text(stmt, 4);
+		index_page(db, mp, rec, parent, file, &stats);
+	}
+
+	sqlite3_finalize(stmt);
+	print_stats(&stats);
+
+	if (mflags.recreate)
+		return;
+
+	if (mflags.verbosity == 2)
+		printf("Deleting stale index entries\n");
+
+	/* The pages which are gone, and those whose variants are */
+	rc = sqlite3_prepare_v2(db, "SELECT id FROM mandb_meta"
+	    " WHERE file NOT IN (SELECT file FROM metadb.file_cache)"
+	    " UNION SELECT docid FROM mandb_variants WHERE file NOT IN"
+	    " (SELECT file FROM metadb.file_cache)", -1, &stmt, NULL);
+	while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		if (nstale == stalesize) {
+			stalesize = stalesize ? 2 * stalesize : 16;
+			stale = erealloc(stale, stalesize * sizeof(*stale));
+		}
+		stale[nstale++] = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	sqlstr = "DELETE FROM mandb_meta WHERE file NOT IN"
+		 " (SELECT file FROM metadb.file_cache);"
+		 "DELETE FROM mandb_links WHERE md5_hash NOT IN"
+		 " (SELECT md5_hash from mandb_meta);"
+		 "DELETE FROM mandb_symbols WHERE docid NOT IN"
+		 " (SELECT id FROM mandb_meta);"
+		 "DELETE FROM mandb_xrefs WHERE docid NOT IN"
+		 " (SELECT id FROM mandb_meta);"
+		 "DELETE FROM mandb_signatures WHERE docid NOT IN"
+		 " (SELECT id FROM mandb_meta);"
+		 "DELETE FROM mandb_variants WHERE file NOT IN"
+		 " (SELECT file FROM metadb.file_cache) OR docid NOT IN"
+		 " (SELECT id FROM mandb_meta);"
+		 "DROP TABLE metadb.file_cache;"
+		 "DELETE FROM mandb WHERE rowid NOT IN"
+		 " (SELECT id FROM mandb_meta);";
+
+	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("Removing old entries failed: %s", errmsg);
+		warnx("Please rebuild database from scratch with -f.");
+		free(errmsg);
+		free(stale);
+		return;
+	}
+
+	for (i = 0; i < nstale; i++)
+		refresh_page(db, stale[i]);
+	free(stale);
+}
+
+/*
+ * set_facet --
+ *  Sets the bit of docid in the bitmap of the given kind and value, adding
+ *  the bitmap to facets if it is not there yet.
+ */
+static void
+set_facet(facet **facets, size_t *nfacets, const char *kind,
+    const char *value, sqlite3_int64 docid)
+{
+	facet *f;
+	size_t i, len;
+
+	for (i = 0; i < *nfacets; i++) {
+		f = &(*facets)[i];
+		if (strcmp(f->kind, kind) == 0 && strcmp(f->value, value) == 0)
+			break;
+	}
+	if (i == *nfacets) {
+		*facets = erealloc(*facets, (*nfacets + 1) * sizeof(**facets));
+		f = &(*facets)[(*nfacets)++];
+		f->kind = kind;
+		f->value = estrdup(value);
+		f->bits = NULL;
+		f->len = 0;
+	}
+
+	len = (docid >> 3) + 1;
+	if (len > f->len) {
+		f->bits = erealloc(f->bits, len);
+		memset(f->bits + f->len, 0, len - f->len);
+		f->len = len;
+	}
+	f->bits[docid >> 3] |= 1 << (docid & 7);
+}
+
+/*
+ * build_facets --
+ *  Rebuilds the section and machine bitmaps of mandb_facets from the
+ *  indexed pages. Bit n of a bitmap is set if the page with docid n is in
+ *  that section, or for that machine. apropos uses them to restrict a
+ *  search to some sections or to a machine without reading the pages.
+ */
+static void
+build_facets(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	facet *facets = NULL;
+	size_t nfacets = 0;
+	size_t i;
+	sqlite3_int64 docid;
+	const char *section;
+	const char *machine;
+	char *errmsg = NULL;
+	int rc;
+
+	if (mflags.verbosity == 2)
+		printf("Building section and machine bitmaps\n");
+
+	rc = sqlite3_prepare_v2(db, "SELECT docid, section, machine FROM mandb",
+	    -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(db));
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not build the section bitmaps");
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		docid = sqlite3_column_int64(stmt, 0);
+		section = (const char *) sqlite3_column_text(stmt, 1);
+		machine = (const char *) sqlite3_column_text(stmt, 2);
+		if (docid < 0)
+			continue;
+		if (section && *section)
+			set_facet(&facets, &nfacets, "section", section, docid);
+		if (machine && *machine)
+			set_facet(&facets, &nfacets, "machine", machine, docid);
+	}
+	sqlite3_finalize(stmt);
+
+	/* A page folded with its near-duplicates is for their machines too */
+	rc = sqlite3_prepare_v2(db, "SELECT docid, machine FROM mandb_variants",
+	    -1, &stmt, NULL);
+	while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		docid = sqlite3_column_int64(stmt, 0);
+		machine = (const char *) sqlite3_column_text(stmt, 1);
+		if (docid >= 0 && machine && *machine)
+			set_facet(&facets, &nfacets, "machine", machine, docid);
+	}
+	sqlite3_finalize(stmt);
+
+	sqlite3_exec(db, "DELETE FROM mandb_facets", NULL, NULL, &errmsg);
+	if (errmsg == NULL) {
+		rc = sqlite3_prepare_v2(db,
+		    "INSERT INTO mandb_facets VALUES (?, ?, ?)", -1, &stmt,
+		    NULL);
+		if (rc != SQLITE_OK)
+			errmsg = estrdup(sqlite3_errmsg(db));
+	}
+	for (i = 0; i < nfacets; i++) {
+		if (errmsg == NULL) {
+			sqlite3_bind_text(stmt, 1, facets[i].kind, -1, NULL);
+			sqlite3_bind_text(stmt, 2, facets[i].value, -1, NULL);
+			sqlite3_bind_blob(stmt, 3, facets[i].bits, facets[i].len,
+			    NULL);
+			if (sqlite3_step(stmt) != SQLITE_DONE)
+				errmsg = estrdup(sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
+		}
+		free(facets[i].value);
+		free(facets[i].bits);
+	}
+	free(facets);
+	sqlite3_finalize(stmt);
+
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not build the section bitmaps");
+	}
+}
+
+/*
+ * add_variant_titles --
+ *  Appends to *title the names of the near-duplicates of a page for the
+ *  given comma separated machines, an empty one standing for no machine,
+ *  e.g. amd64/io, i386/io. The names already in *title are left out.
+ */
+static void
+add_variant_titles(char **title, const char *name, const char *machines)
+{
+	char *list, *p, *m;
+	char *t;
+	char *newtitle;
+	const char *s;
+	size_t len;
+
+	list = p = estrdup(machines);
+	while ((m = strsep(&p, ",")) != NULL) {
+		if (*m != '\0')
+			easprintf(&t, "%s/%s", lower(m), name);
+		else
+			t = estrdup(name);
+		for (s = *title; s != NULL; s = s[len] ? s + len + 2 : NULL) {
+			len = strcspn(s, ",");
+			if (len == strlen(t) && strncmp(s, t, len) == 0)
+				break;
+		}
+		if (s == NULL) {
+			easprintf(&newtitle, "%s, %s", *title, t);
+			free(*title);
+			*title = newtitle;
+		}
+		free(t);
+	}
+	free(list);
+}
+
+/*
+ * catalog_title --
+ *  Returns the title of a page in mandb_catalog, like the names shown by
+ *  apropos: its name prefixed with the machine, if any, e.g. amd64/io,
+ *  followed by the names of its near-duplicates for the given comma
+ *  separated machines, if machines is not NULL.
+ */
+static char *
+catalog_title(const char *name, const char *machine, const char *machines)
+{
+	const char *slash;
+	char *title;
+	char *m;
+
+	if (machine && *machine) {
+		if ((slash = strrchr(name, '/')) != NULL)
+			name = slash + 1;
+		m = estrdup(machine);
+		easprintf(&title, "%s/%s", lower(m), name);
+		free(m);
+	} else
+		title = estrdup(name);
+	if (machines != NULL)
+		add_variant_titles(&title, name, machines);
+	return title;
+}
+
+/*
+ * build_catalog --
+ *  Rebuilds mandb_catalog, an uncompressed copy of the columns of the pages
+ *  shown in the results, keyed by docid. The title is the name shown for
+ *  the page: its name prefixed with the machine, if any, followed by the
+ *  names of its near-duplicates for other machines. apropos renders
+ *  the results from it without decompressing these columns, and lists the
+ *  pages of a section from its index on the section and title.
+ */
+static void
+build_catalog(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *insert = NULL;
+	const char *name;
+	char *title;
+	char *errmsg = NULL;
+	int rc;
+
+	if (mflags.verbosity == 2)
+		printf("Building the catalog of the pages\n");
+
+	sqlite3_exec(db,
+	    "CREATE TABLE IF NOT EXISTS mandb_catalog(docid INTEGER PRIMARY KEY, "
+	    "section, name, name_desc, machine, title, prior DEFAULT 1); "
+	    "CREATE INDEX IF NOT EXISTS index_mandb_catalog_section ON "
+	    "mandb_catalog (section, title); "
+	    "DELETE FROM mandb_catalog", NULL, NULL, &errmsg);
+	if (errmsg == NULL) {
+		rc = sqlite3_prepare_v2(db, "SELECT docid, section, name, "
+		    "name_desc, mandb.machine, machines FROM mandb LEFT JOIN "
+		    "(SELECT docid AS id, group_concat(DISTINCT "
+		    "ifnull(machine, '')) AS machines FROM mandb_variants "
+		    "GROUP BY docid) ON id = docid", -1, &stmt, NULL);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_prepare_v2(db, "INSERT INTO mandb_catalog "
+			    "(docid, section, name, name_desc, machine, title) "
+			    "VALUES (?, ?, ?, ?, ?, ?)", -1, &insert, NULL);
+		if (rc != SQLITE_OK)
+			errmsg = estrdup(sqlite3_errmsg(db));
+	}
+	while (errmsg == NULL && sqlite3_step(stmt) == SQLITE_ROW) {
+		name = (const char *) sqlite3_column_text(stmt, 2);
+		if (name == NULL)
+			continue;
+		title = catalog_title(name,
+		    (const char *) sqlite3_column_text(stmt, 4),
+		    (const char *) sqlite3_column_text(stmt, 5));
+		sqlite3_bind_value(insert, 1, sqlite3_column_value(stmt, 0));
+		sqlite3_bind_value(insert, 2, sqlite3_column_value(stmt, 1));
+		sqlite3_bind_value(insert, 3, sqlite3_column_value(stmt, 2));
+		sqlite3_bind_value(insert, 4, sqlite3_column_value(stmt, 3));
+		sqlite3_bind_value(insert, 5, sqlite3_column_value(stmt, 4));
+		sqlite3_bind_text(insert, 6, title, -1, NULL);
+		if (sqlite3_step(insert) != SQLITE_DONE)
+			errmsg = estrdup(sqlite3_errmsg(db));
+		sqlite3_reset(insert);
+		free(title);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(insert);
+
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not build the catalog of the pages");
+	}
+}
+
+/*
+ * build_names --
+ *  Rebuilds mandb_names, the index of the names of the pages and of their
+ *  links, which whatis answers from and apropos uses to put the pages
+ *  named like the query first. It is keyed by name, so a lookup is a
+ *  single B-tree search, without going through the FTS table. It is
+ *  filled from mandb_catalog, so the pages are not decompressed again.
+ */
+static void
+build_names(sqlite3 *db)
+{
+	char *errmsg = NULL;
+
+	if (mflags.verbosity == 2)
+		printf("Building the name index\n");
+
+	sqlite3_exec(db,
+	    "CREATE TABLE IF NOT EXISTS mandb_names(name COLLATE NOCASE, "
+	    "section, machine, name_desc, docid, PRIMARY KEY(name, docid)) "
+	    "WITHOUT ROWID; "
+	    "DELETE FROM mandb_names; "
+	    "INSERT OR IGNORE INTO mandb_names SELECT name, section, machine, "
+	    "name_desc, docid FROM mandb_catalog; "
+	    "INSERT OR IGNORE INTO mandb_names SELECT link, mandb_links.section, "
+	    "mandb_links.machine, name_desc, docid FROM mandb_links, mandb_meta, "
+	    "mandb_catalog WHERE mandb_meta.md5_hash = mandb_links.md5_hash AND "
+	    "mandb_catalog.docid = mandb_meta.id", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not build the name index");
+	}
+}
+
+/*
+ * build_graph --
+ *  Rebuilds mandb_graph, the edges of the graph of the references between
+ *  the pages: the references of mandb_xrefs resolved through mandb_names to
+ *  the pages they name, in the section they give if any. The references are
+ *  kept as written, so the graph picks up the pages added since the page
+ *  referring to them was indexed.
+ */
+static void
+build_graph(sqlite3 *db)
+{
+	char *errmsg = NULL;
+
+	if (mflags.verbosity == 2)
+		printf("Building the graph of the references\n");
+
+	sqlite3_exec(db,
+	    "DELETE FROM mandb_graph; "
+	    "INSERT OR IGNORE INTO mandb_graph SELECT x.docid, n.docid "
+	    "FROM mandb_xrefs AS x JOIN mandb_names AS n ON n.name = x.name "
+	    "WHERE (x.section = '' OR n.section = substr(x.section, 1, 1)) "
+	    "AND n.docid != x.docid", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not build the graph of the references");
+	}
+}
+
+/*
+ * build_priors --
+ *  Computes the prior of every page, its rank independent of any query,
+ *  from the graph of the references: a page many pages refer to, or a few
+ *  pages which are themselves referred to a lot, is likely to be the one
+ *  sought. This is the PageRank of the page, the share of the time a reader
+ *  following the references at random would spend on it. The prior is
+ *  1 + PRIOR_WEIGHT * log(1 + N * rank), N being the number of pages, so
+ *  that a page nothing refers to keeps about its plain rank. It is stored
+ *  in mandb_catalog, and apropos multiplies the rank of the matches by it.
+ */
+static void
+build_priors(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 *src = NULL;
+	sqlite3_int64 *dst = NULL;
+	sqlite3_int64 maxid = 0;
+	sqlite3_int64 id;
+	double *rank = NULL;
+	double *next = NULL;
+	unsigned int *outdeg = NULL;
+	unsigned char *present = NULL;
+	size_t nedges = 0;
+	size_t edgessize = 0;
+	size_t npages = 0;
+	size_t e;
+	double dangling;
+	double base;
+	char *errmsg = NULL;
+	int round;
+	int rc;
+
+	if (mflags.verbosity == 2)
+		printf("Computing the priors of the pages\n");
+
+	rc = sqlite3_prepare_v2(db, "SELECT ifnull(max(docid), 0), count(*) "
+	    "FROM mandb_catalog", -1, &stmt, NULL);
+	if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		maxid = sqlite3_column_int64(stmt, 0);
+		npages = sqlite3_column_int64(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (rc != SQLITE_OK)
+		errmsg = estrdup(sqlite3_errmsg(db));
+	if (errmsg != NULL || npages == 0)
+		goto out;
+
+	rank = emalloc((maxid + 1) * sizeof(*rank));
+	next = emalloc((maxid + 1) * sizeof(*next));
+	outdeg = ecalloc(maxid + 1, sizeof(*outdeg));
+	present = ecalloc(maxid + 1, 1);
+
+	rc = sqlite3_prepare_v2(db, "SELECT docid FROM mandb_catalog", -1,
+	    &stmt, NULL);
+	while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		id = sqlite3_column_int64(stmt, 0);
+		if (id >= 0 && id <= maxid)
+			present[id] = 1;
+	}
+	sqlite3_finalize(stmt);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(db, "SELECT src, dst FROM mandb_graph",
+		    -1, &stmt, NULL);
+	while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		if (nedges == edgessize) {
+			edgessize = edgessize ? 2 * edgessize : 1024;
+			src = erealloc(src, edgessize * sizeof(*src));
+			dst = erealloc(dst, edgessize * sizeof(*dst));
+		}
+		src[nedges] = sqlite3_column_int64(stmt, 0);
+		dst[nedges] = sqlite3_column_int64(stmt, 1);
+		if (src[nedges] < 0 || src[nedges] > maxid ||
+		    !present[src[nedges]] || dst[nedges] < 0 ||
+		    dst[nedges] > maxid || !present[dst[nedges]])
+			continue;
+		outdeg[src[nedges]]++;
+		nedges++;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (rc != SQLITE_OK) {
+		errmsg = estrdup(sqlite3_errmsg(db));
+		goto out;
+	}
+
+	for (id = 0; id <= maxid; id++)
+		rank[id] = present[id] ? 1.0 / npages : 0;
+	for (round = 0; round < PRIOR_ROUNDS; round++) {
+		/* The rank of the pages without references is spread evenly */
+		dangling = 0;
+		for (id = 0; id <= maxid; id++)
+			if (present[id] && outdeg[id] == 0)
+				dangling += rank[id];
+		base = (1 - PRIOR_DAMPING + PRIOR_DAMPING * dangling) / npages;
+		for (id = 0; id <= maxid; id++)
+			next[id] = present[id] ? base : 0;
+		for (e = 0; e < nedges; e++)
+			next[dst[e]] += PRIOR_DAMPING * rank[src[e]] /
+			    outdeg[src[e]];
+		memcpy(rank, next, (maxid + 1) * sizeof(*rank));
+	}
+
+	rc = sqlite3_prepare_v2(db, "UPDATE mandb_catalog SET prior = ? "
+	    "WHERE docid = ?", -1, &stmt, NULL);
+	for (id = 0; rc == SQLITE_OK && id <= maxid; id++) {
+		if (!present[id])
+			continue;
+		sqlite3_bind_double(stmt, 1,
+		    1 + PRIOR_WEIGHT * log(1 + npages * rank[id]));
+		sqlite3_bind_int64(stmt, 2, id);
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+			rc = SQLITE_ERROR;
+		sqlite3_reset(stmt);
+	}
+	if (rc != SQLITE_OK)
+		errmsg = estrdup(sqlite3_errmsg(db));
+
+out:
+	sqlite3_finalize(stmt);
+	free(src);
+	free(dst);
+	free(rank);
+	free(next);
+	free(outdeg);
+	free(present);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not compute the priors of the pages");
+	}
+}
+
+/*
+ * update_facets --
+ *  Sets the bit of the page with the given docid in the bitmaps of
+ *  mandb_facets of its section and machines, those of its near-duplicates
+ *  included, and clears it in all the others, e.g. when the page is gone.
+ *  The bitmaps are few, so all of them are read and written back, and
+ *  those left without any page are removed. Returns 0, or -1 on error.
+ */
+static int
+update_facets(sqlite3 *db, sqlite3_int64 docid)
+{
+	sqlite3_stmt *stmt = NULL;
+	facet *facets = NULL;
+	facet *f;
+	size_t nfacets = 0;
+	size_t i, j;
+	const char *kind;
+	const char *value;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT kind, value, docids "
+	    "FROM mandb_facets", -1, &stmt, NULL);
+	while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		kind = (const char *) sqlite3_column_text(stmt, 0);
+		value = (const char *) sqlite3_column_text(stmt, 1);
+		if (kind == NULL || value == NULL)
+			continue;
+		facets = erealloc(facets, (nfacets + 1) * sizeof(*facets));
+		f = &facets[nfacets++];
+		f->kind = strcmp(kind, "section") == 0 ? "section" : "machine";
+		f->value = estrdup(value);
+		f->len = sqlite3_column_bytes(stmt, 2);
+		f->bits = emalloc(f->len + 1);
+		memcpy(f->bits, sqlite3_column_blob(stmt, 2), f->len);
+		if ((size_t) (docid >> 3) < f->len)
+			f->bits[docid >> 3] &= ~(1 << (docid & 7));
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(db, "SELECT section, machine "
+		    "FROM mandb_catalog WHERE docid = ?1 "
+		    "UNION ALL SELECT NULL, machine FROM mandb_variants "
+		    "WHERE docid = ?1 AND EXISTS (SELECT 1 FROM mandb_catalog "
+		    "WHERE docid = ?1)", -1, &stmt, NULL);
+	if (rc == SQLITE_OK) {
+		sqlite3_bind_int64(stmt, 1, docid);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			value = (const char *) sqlite3_column_text(stmt, 0);
+			if (value && *value)
+				set_facet(&facets, &nfacets, "section", value,
+				    docid);
+			value = (const char *) sqlite3_column_text(stmt, 1);
+			if (value && *value)
+				set_facet(&facets, &nfacets, "machine", value,
+				    docid);
+		}
+		sqlite3_finalize(stmt);
+		stmt = NULL;
+	}
+
+	for (i = 0; i < nfacets; i++) {
+		f = &facets[i];
+		for (j = 0; j < f->len && f->bits[j] == 0; j++)
+			continue;
+		if (rc == SQLITE_OK)
+			rc = sqlite3_prepare_v2(db, j < f->len ?
+			    "INSERT OR REPLACE INTO mandb_facets "
+			    "VALUES (?1, ?2, ?3)" :
+			    "DELETE FROM mandb_facets "
+			    "WHERE kind = ?1 AND value = ?2", -1, &stmt, NULL);
+		if (rc == SQLITE_OK) {
+			sqlite3_bind_text(stmt, 1, f->kind, -1, NULL);
+			sqlite3_bind_text(stmt, 2, f->value, -1, NULL);
+			if (j < f->len)
+				sqlite3_bind_blob(stmt, 3, f->bits, f->len,
+				    NULL);
+			if (sqlite3_step(stmt) != SQLITE_DONE)
+				rc = SQLITE_ERROR;
+			sqlite3_finalize(stmt);
+			stmt = NULL;
+		}
+		free(f->value);
+		free(f->bits);
+	}
+	free(facets);
+	return rc == SQLITE_OK ? 0 : -1;
+}
+
+/*
+ * update_priors --
+ *  Updates the priors of the pages with the given docids, after their
+ *  references changed, without computing the PageRank of all the pages
+ *  again like build_priors: the rank of each page is worked out once from
+ *  the ranks of the pages referring to it and the rank of the pages
+ *  nothing refers to, which are recovered from their priors when first
+ *  called. This is close enough for an incremental update, and -f
+ *  computes them all again. Returns 0, or -1 on error.
+ */
+static int
+update_priors(sqlite3 *db, const sqlite3_int64 *docids, size_t ndocids)
+{
+	static double npages;
+	static double base;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *update = NULL;
+	double prior;
+	double rank;
+	size_t i;
+	int rc;
+
+	if (npages == 0) {
+		rc = sqlite3_prepare_v2(db, "SELECT count(*), min(CASE "
+		    "WHEN prior > 1 THEN prior END) FROM mandb_catalog", -1,
+		    &stmt, NULL);
+		if (rc != SQLITE_OK)
+			return -1;
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			npages = sqlite3_column_int64(stmt, 0);
+			if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+				base = exp((sqlite3_column_double(stmt, 1) -
+				    1) / PRIOR_WEIGHT) - 1;
+		}
+		sqlite3_finalize(stmt);
+		if (npages == 0)
+			return 0;
+		/* The rank of a page nothing refers to, as of the last -f */
+		base = base > 0 ? base / npages :
+		    (1 - PRIOR_DAMPING) / npages;
+	}
+
+	rc = sqlite3_prepare_v2(db, "SELECT c.prior, (SELECT count(*) "
+	    "FROM mandb_graph AS o WHERE o.src = g.src) FROM mandb_graph AS g "
+	    "JOIN mandb_catalog AS c ON c.docid = g.src WHERE g.dst = ?", -1,
+	    &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(db, "UPDATE mandb_catalog "
+		    "SET prior = ? WHERE docid = ?", -1, &update, NULL);
+	for (i = 0; rc == SQLITE_OK && i < ndocids; i++) {
+		rank = base;
+		sqlite3_bind_int64(stmt, 1, docids[i]);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			prior = sqlite3_column_double(stmt, 0);
+			rank += PRIOR_DAMPING * (exp((prior - 1) /
+			    PRIOR_WEIGHT) - 1) / npages /
+			    sqlite3_column_int64(stmt, 1);
+		}
+		sqlite3_reset(stmt);
+		sqlite3_bind_double(update, 1,
+		    1 + PRIOR_WEIGHT * log(1 + npages * rank));
+		sqlite3_bind_int64(update, 2, docids[i]);
+		if (sqlite3_step(update) != SQLITE_DONE)
+			rc = SQLITE_ERROR;
+		sqlite3_reset(update);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(update);
+	return rc == SQLITE_OK ? 0 : -1;
+}
+
+/*
+ * add_targets --
+ *  Appends to *ids the docids of the pages the page with the given docid
+ *  refers to in mandb_graph. Returns 0, or -1 on error.
+ */
+static int
+add_targets(sqlite3 *db, sqlite3_int64 docid, sqlite3_int64 **ids,
+    size_t *nids, size_t *idsize)
+{
+	sqlite3_stmt *stmt = NULL;
+
+	if (sqlite3_prepare_v2(db, "SELECT dst FROM mandb_graph WHERE src = ?",
+	    -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	sqlite3_bind_int64(stmt, 1, docid);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (*nids == *idsize) {
+			*idsize = *idsize ? 2 * *idsize : 16;
+			*ids = erealloc(*ids, *idsize * sizeof(**ids));
+		}
+		(*ids)[(*nids)++] = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+/*
+ * refresh_page --
+ *  Brings the rows of the page with the given docid in mandb_catalog,
+ *  mandb_names, mandb_graph and mandb_facets in line with mandb and the
+ *  tables insert_into_db fills, removing them if the page is no longer
+ *  indexed, and updates the priors of the page and of the pages it
+ *  refers to. An incremental update calls it for every page it adds,
+ *  removes or changes the near-duplicates of, so that these tables are
+ *  only rebuilt from scratch with -f.
+ */
+static void
+refresh_page(sqlite3 *db, sqlite3_int64 docid)
+{
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *insert = NULL;
+	sqlite3_int64 *ids = NULL;
+	size_t nids = 0;
+	size_t idsize = 0;
+	const char *name;
+	char *title;
+	char *sql;
+	char *errmsg = NULL;
+	int rc;
+
+	/* The prior of the pages it no longer refers to changes too */
+	if (add_targets(db, docid, &ids, &nids, &idsize) < 0)
+		goto out;
+
+	sql = sqlite3_mprintf("DELETE FROM mandb_catalog WHERE docid = %lld; "
+	    "DELETE FROM mandb_names WHERE docid = %lld; "
+	    "DELETE FROM mandb_graph WHERE src = %lld; "
+	    "DELETE FROM mandb_graph WHERE dst = %lld",
+	    docid, docid, docid, docid);
+	sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+	sqlite3_free(sql);
+	if (errmsg != NULL)
+		goto out;
+
+	rc = sqlite3_prepare_v2(db, "SELECT section, name, name_desc, "
+	    "machine, (SELECT group_concat(DISTINCT ifnull(machine, '')) "
+	    "FROM mandb_variants WHERE docid = ?1) FROM mandb "
+	    "WHERE docid = ?1", -1, &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(db, "INSERT INTO mandb_catalog "
+		    "(docid, section, name, name_desc, machine, title) "
+		    "VALUES (?, ?, ?, ?, ?, ?)", -1, &insert, NULL);
+	if (rc != SQLITE_OK)
+		goto out;
+	sqlite3_bind_int64(stmt, 1, docid);
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    (name = (const char *) sqlite3_column_text(stmt, 1)) != NULL) {
+		title = catalog_title(name,
+		    (const char *) sqlite3_column_text(stmt, 3),
+		    (const char *) sqlite3_column_text(stmt, 4));
+		sqlite3_bind_int64(insert, 1, docid);
+		sqlite3_bind_value(insert, 2, sqlite3_column_value(stmt, 0));
+		sqlite3_bind_value(insert, 3, sqlite3_column_value(stmt, 1));
+		sqlite3_bind_value(insert, 4, sqlite3_column_value(stmt, 2));
+		sqlite3_bind_value(insert, 5, sqlite3_column_value(stmt, 3));
+		sqlite3_bind_text(insert, 6, title, -1, NULL);
+		rc = sqlite3_step(insert);
+		free(title);
+		if (rc != SQLITE_DONE)
+			goto out;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(insert);
+	stmt = insert = NULL;
+
+	/* As build_names and build_graph do, for this page only */
+	sql = sqlite3_mprintf("INSERT OR IGNORE INTO mandb_names "
+	    "SELECT name, section, machine, name_desc, docid "
+	    "FROM mandb_catalog WHERE docid = %lld; "
+	    "INSERT OR IGNORE INTO mandb_names SELECT link, l.section, "
+	    "l.machine, name_desc, docid FROM mandb_links AS l, "
+	    "mandb_meta AS m, mandb_catalog AS c WHERE c.docid = %lld "
+	    "AND m.id = c.docid AND l.md5_hash = m.md5_hash; "
+	    "INSERT OR IGNORE INTO mandb_graph SELECT x.docid, n.docid "
+	    "FROM mandb_xrefs AS x JOIN mandb_names AS n ON n.name = x.name "
+	    "WHERE x.docid = %lld "
+	    "AND (x.section = '' OR n.section = substr(x.section, 1, 1)) "
+	    "AND n.docid != x.docid; "
+	    "INSERT OR IGNORE INTO mandb_graph SELECT x.docid, n.docid "
+	    "FROM mandb_names AS n CROSS JOIN mandb_xrefs AS x "
+	    "ON n.name = x.name WHERE n.docid = %lld "
+	    "AND (x.section = '' OR n.section = substr(x.section, 1, 1)) "
+	    "AND n.docid != x.docid",
+	    docid, docid, docid, docid);
+	sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+	sqlite3_free(sql);
+	if (errmsg != NULL)
+		goto out;
+
+	if (idsize == nids)
+		ids = erealloc(ids, (idsize = nids + 1) * sizeof(*ids));
+	ids[nids++] = docid;
+	if (add_targets(db, docid, &ids, &nids, &idsize) < 0 ||
+	    update_facets(db, docid) < 0 || update_priors(db, ids, nids) < 0)
+		goto out;
+	free(ids);
+	return;
+
+out:
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(insert);
+	free(ids);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+	} else
+		warnx("%s", sqlite3_errmsg(db));
+	close_db(db);
+	errx(EXIT_FAILURE, "Consider running makemandb with -f option");
+}
+
+/*
+ * bump_generation --
+ *  Increments the generation number of the index in mandb_info, which
+ *  tells apropos.cgi that the results it cached for the previous content
+ *  of the index are stale. It never goes below the current time, so that
+ *  an index built from scratch does not reuse the generations of the one
+ *  it replaces.
+ */
+static void
+bump_generation(sqlite3 *db)
+{
+	char *errmsg = NULL;
+
+	sqlite3_exec(db,
+	    "CREATE TABLE IF NOT EXISTS mandb_info(name PRIMARY KEY, value); "
+	    "INSERT OR REPLACE INTO mandb_info SELECT 'generation', "
+	    "max(ifnull((SELECT value FROM mandb_info "
+	    "WHERE name = 'generation'), 0) + 1, "
+	    "CAST(strftime('%s', 'now') AS INTEGER))", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		errx(EXIT_FAILURE, "Could not update the generation of the index");
+	}
+}
+
+/*
+ * begin_parse --
+ *  parses the man page using libmandoc
+ */
+static void
+begin_parse(const char *file, struct mparse *mp, mandb_rec *rec,
+    const void *buf, size_t len)
+{
+	struct mdoc *mdoc;
+	struct man *man;
+
+	rec->xr_found = 0;
+
+	/*
+	 * With -l only the NAME section is stored, which the line scanner
+	 * can usually extract without building the complete parse tree.
+	 * Hand the page over to libmandoc only if the scanner gives up.
+	 */
+	if (mflags.limit && scan_name_section(rec, buf, len) == 0)
+		return;
+
+	mparse_reset(mp);
+	if (mparse_readmem(mp, buf, len, file) >= MANDOCLEVEL_FATAL) {
+		/* Printing this warning at verbosity level 2
+		 * because some packages from pkgsrc might trigger several
+		 * of such warnings.
+		 */
+		if (mflags.verbosity == 2)
+			warnx("%s: Parse failure", file);
+		return;
+	}
+
+	mparse_result(mp, &mdoc, &man);
+	if (mdoc == NULL && man == NULL) {
+		if (mflags.verbosity == 2)
+			warnx("Not a man(7) or mdoc(7) page");
+		return;
+	}
+
+	set_machine(mdoc, rec);
+	set_section(mdoc, man, rec);
+	if (mdoc) {
+		rec->page_type = MDOC;
+		pmdoc_node(mdoc_node(mdoc), rec);
+	} else {
+		rec->page_type = MAN;
+		pman_node(man_node(man), rec);
+	}
+}
+
+/*
+ * scan_line --
+ *  Copies the line starting at offset *off of buf into *line, without the
+ *  trailing newline, growing *line as needed and advancing *off past the
+ *  newline. Returns -1 once the end of the buffer has been reached.
+ */
+static int
+scan_line(const char *buf, size_t len, size_t *off, char **line,
+    size_t *linesize)
+{
+	const char *start, *end;
+	size_t sz;
+
+	if (*off >= len)
+		return -1;
+	start = buf + *off;
+	if ((end = memchr(start, '\n', len - *off)) == NULL)
+		end = buf + len;
+	sz = end - start;
+	if (sz + 1 > *linesize) {
+		*linesize = sz + 1;
+		*line = erealloc(*line, *linesize);
+	}
+	memcpy(*line, start, sz);
+	(*line)[sz] = '\0';
+	*off += sz + 1;
+	return 0;
+}
+
+/*
+ * scan_strip_comment --
+ *  Truncates the line at the beginning of a \" comment.
+ */
+static void
+scan_strip_comment(char *line)
+{
+	char *p;
+
+	for (p = line; (p = strchr(p, '\\')) != NULL; p += 2) {
+		if (p[1] == '"') {
+			*p = '\0';
+			return;
+		}
+		if (p[1] == '\0')
+			return;
+	}
+}
+
+/*
+ * scan_arg --
+ *  Returns the next macro argument from *pp and advances *pp past it.
+ *  Quoted arguments are unquoted in place, with "" standing for a literal
+ *  quote; escaped blanks do not end an argument. Returns NULL when there
+ *  are no more arguments.
+ */
+static char *
+scan_arg(char **pp)
+{
+	char *p, *q, *start;
+	int closed;
+
+	p = *pp;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p == '\0')
+		return NULL;
+
+	if (*p == '"') {
+		start = q = ++p;
+		for (; *p != '\0'; p++) {
+			if (*p == '"') {
+				if (p[1] != '"')
+					break;
+				p++;
+			}
+			*q++ = *p;
+		}
+		closed = *p == '"';
+		*q = '\0';
+		if (closed)
+			p++;
+	} else {
+		start = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t') {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			p++;
+		}
+		if (*p != '\0')
+			*p++ = '\0';
+	}
+	*pp = p;
+	return start;
+}
+
+/*
+ * scan_is_macro --
+ *  Checks whether an argument looks like a callable mdoc(7) macro (Xr, Ar,
+ *  Bsx, ...), which only libmandoc knows how to expand.
+ */
+static int
+scan_is_macro(const char *arg)
+{
+	size_t i, len;
+
+	len = strlen(arg);
+	if (len < 2 || len > 3 || !isupper((unsigned char) arg[0]))
+		return 0;
+	for (i = 1; i < len; i++)
+		if (!islower((unsigned char) arg[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * scan_concat_args --
+ *  Appends all the remaining arguments of a macro line to *dst, separated
+ *  by a space, like pmdoc_Nm and pmdoc_Nd do for the text nodes.
+ *  Returns -1 if one of the arguments is a callable macro.
+ */
+static int
+scan_concat_args(char **dst, char *args)
+{
+	char *arg;
+
+	while ((arg = scan_arg(&args)) != NULL) {
+		if (scan_is_macro(arg))
+			return -1;
+		if (*arg != '\0')
+			concat(dst, arg);
+	}
+	return 0;
+}
+
+/*
+ * scan_name_section --
+ *  A light weight alternative to begin_parse for the -l mode.
+ *  It scans the page line by line and picks up the section and the NAME
+ *  section (.Nm/.Nd for mdoc(7) pages, the "name, ... \- description" lines
+ *  for man(7) pages), stopping at the section following NAME.
+ *  Anything out of the ordinary (.so links, macros in the NAME section,
+ *  machine dependent pages, continuation lines, ...) makes it give up and
+ *  return -1, leaving rec as it was, so that the caller can fall back to
+ *  libmandoc. Returns 0 on success.
+ */
+static int
+scan_name_section(mandb_rec *rec, const void *buf, size_t len)
+{
+	enum { SCAN_PROLOGUE, SCAN_HEADER, SCAN_BODY, SCAN_NAME, SCAN_ND }
+	    state = SCAN_PROLOGUE;
+	char *line = NULL;
+	char *p, *macro, *arg;
+	size_t linesize = 0;
+	size_t off = 0;
+	int page_type = MDOC;
+	int rv = -1;
+
+	while (scan_line(buf, len, &off, &line, &linesize) == 0) {
+		scan_strip_comment(line);
+		p = line;
+		if (*p == '\0')
+			continue;
+		/* Leave continuation lines to libmandoc */
+		if (p[strlen(p) - 1] == '\\' &&
+		    (state == SCAN_NAME || state == SCAN_ND))
+			goto out;
+
+		if (*p != '.' && *p != '\'') {
+			/* A text line */
+			if (state == SCAN_ND) {
+				concat(&rec->name_desc, p);
+			} else if (state == SCAN_NAME && page_type == MAN) {
+				char *tmp = parse_escape(p);
+				concat(&rec->name_desc, tmp);
+				free(tmp);
+			} else if (state != SCAN_BODY) {
+				goto out;
+			}
+			continue;
+		}
+
+		p++;
+		if ((macro = scan_arg(&p)) == NULL)
+			continue;
+
+		switch (state) {
+		case SCAN_PROLOGUE:
+			if (strcmp(macro, "Dd") == 0) {
+				page_type = MDOC;
+			} else if (strcmp(macro, "TH") == 0) {
+				page_type = MAN;
+				if (scan_arg(&p) == NULL ||
+				    (arg = scan_arg(&p)) == NULL)
+					goto out;
+				rec->section[0] = arg[0];
+				state = SCAN_BODY;
+				break;
+			} else {
+				goto out;
+			}
+			state = SCAN_HEADER;
+			break;
+		case SCAN_HEADER:
+			if (strcmp(macro, "Dt") != 0)
+				break;
+			/*
+			 * A third argument names the machine architecture
+			 * (or the volume), leave that to libmandoc.
+			 */
+			if (scan_arg(&p) == NULL ||
+			    (arg = scan_arg(&p)) == NULL || scan_arg(&p) != NULL)
+				goto out;
+			rec->section[0] = arg[0];
+			state = SCAN_BODY;
+			break;
+		case SCAN_BODY:
+			if (strcmp(macro, page_type == MDOC ? "Sh" : "SH"))
+				break;
+			if ((arg = scan_arg(&p)) != NULL &&
+			    strcmp(arg, "NAME") == 0)
+				state = SCAN_NAME;
+			break;
+		case SCAN_NAME:
+		case SCAN_ND:
+			if (page_type == MAN) {
+				/* Any macro ends the names-only lines */
+				if (strcmp(macro, "SH") && strcmp(macro, "SS"))
+					goto out;
+				rv = 0;
+				goto out;
+			}
+			if (strcmp(macro, "Sh") == 0) {
+				rv = 0;
+				goto out;
+			}
+			if (state == SCAN_NAME && strcmp(macro, "Nm") == 0) {
+				if (scan_concat_args(&rec->name, p) < 0)
+					goto out;
+			} else if (strcmp(macro, "Nd") == 0) {
+				if (scan_concat_args(&rec->name_desc, p) < 0)
+					goto out;
+				state = SCAN_ND;
+			} else {
+				goto out;
+			}
+			break;
+		}
+	}
+
+	/* The NAME section may as well be the last one */
+	if (state == SCAN_NAME || state == SCAN_ND)
+		rv = 0;
+
+out:
+	free(line);
+	if (rv == 0 && page_type == MAN)
+		pman_split_name(rec);
+	if (rv == 0 && (rec->name == NULL || rec->name_desc == NULL))
+		rv = -1;
+	if (rv < 0) {
+		free(rec->name);
+		rec->name = NULL;
+		free(rec->name_desc);
+		rec->name_desc = NULL;
+		free(rec->links);
+		rec->links = NULL;
+		rec->section[0] = '\0';
+		return -1;
+	}
+	rec->page_type = page_type;
+	return 0;
+}
+
+/*
+ * set_section --
+ *  Extracts the section number and normalizes it to only the numeric part
+ *  (Which should be the first character of the string).
+ */
+static void
+set_section(const struct mdoc *md, const struct man *m, mandb_rec *rec)
+{
+	if (md) {
+		const struct mdoc_meta *md_meta = mdoc_meta(md);
+		rec->section[0] = md_meta->msec[0];
+	} else if (m) {
+		const struct man_meta *m_meta = man_meta(m);
+		rec->section[0] = m_meta->msec[0];
+	}
+}
+
+/*
+ * get_machine --
+ *  Extracts the machine architecture information if available.
+ */
+static void
+set_machine(const struct mdoc *md, mandb_rec *rec)
+{
+	if (md == NULL)
+		return;
+	const struct mdoc_meta *md_meta = mdoc_meta(md);
+	if (md_meta->arch)
+		rec->machine = estrdup(md_meta->arch);
+}
+
+static void
+pmdoc_node(const struct mdoc_node *n, mandb_rec *rec)
+{
+
+	if (n == NULL)
+		return;
+
+	switch (n->type) {
+	case (MDOC_BODY):
+		/* FALLTHROUGH */
+	case (MDOC_TAIL):
+		/* FALLTHROUGH */
+	case (MDOC_ELEM):
+		if (mdocs[n->tok] == NULL)
+			break;
+		(*mdocs[n->tok])(n, rec);
+		break;
+	default:
+		break;
+	}
+
+	pmdoc_node(n->child, rec);
+	pmdoc_node(n->next, rec);
+}
+
+/*
+ * pmdoc_Nm --
+ *  Extracts the Name of the manual page from the .Nm macro
+ */
+static void
+pmdoc_Nm(const struct mdoc_node *n, mandb_rec *rec)
+{
+	if (n->sec != SEC_NAME)
+		return;
+
+	for (n = n->child; n; n = n->next) {
+		if (n->type == MDOC_TEXT) {
+			concat(&rec->name, n->string);
+		}
+	}
+}
+
+/*
+ * pmdoc_Nd --
+ *  Extracts the one line description of the man page from the .Nd macro
+ */
+static void
+pmdoc_Nd(const struct mdoc_node *n, mandb_rec *rec)
+{
+	/*
+	 * A static variable for keeping track of whether a Xr macro was seen
+	 * previously.
+	 */
+	char *buf = NULL;
+	char *temp;
+
+	if (n == NULL)
+		return;
+
+	if (n->type == MDOC_TEXT) {
+		if (rec->xr_found && n->next) {
 			/*
 			 * An Xr macro was seen previously, so parse this
 			 * and the next node.
@@ -1054,23 +3250,211 @@ pmdoc_macro_handler(const struct mdoc_node *n, mandb_rec *rec, enum mdoct doct)
 }
 
 /*
- * pmdoc_Xr, pmdoc_Pp--
- *  Empty stubs.
- *  The parser calls these functions each time it encounters
- *  a .Xr or .Pp macro. We are parsing all the data from
- *  the pmdoc_Sh function, so don't do anything here.
- *  (See if else blocks in pmdoc_Sh.)
+ * pmdoc_Xr --
+ *  The parser calls this function each time it encounters a .Xr macro. The
+ *  text of the reference is parsed from the pmdoc_Sh function (see the if
+ *  else blocks there), here the page referred to is only remembered for
+ *  mandb_xrefs.
  */
 static void
 pmdoc_Xr(const struct mdoc_node *n, mandb_rec *rec)
 {
+	const char *section = "";
+
+	if (mflags.limit || (n = n->child) == NULL || n->type != MDOC_TEXT)
+		return;
+	if (n->next != NULL && n->next->type == MDOC_TEXT)
+		section = n->next->string;
+	add_xref(rec, n->string, section);
 }
 
+/*
+ * pmdoc_Pp --
+ *  Empty stub.
+ *  The parser calls this function each time it encounters a .Pp macro.
+ *  We are parsing all the data from the pmdoc_Sh function, so don't do
+ *  anything here.
+ */
 static void
 pmdoc_Pp(const struct mdoc_node *n, mandb_rec *rec)
 {
 }
 
+/*
+ * pmdoc_symbol --
+ *  Collects the symbols the page documents from the macros marking them
+ *  up, in every section, SYNOPSIS included: the functions of .Fn and .Fo,
+ *  the flags of .Fl outside the SYNOPSIS, the environment variables of
+ *  .Ev, the error codes of .Er, the constants of .Dv, the headers of .In
+ *  and the types of .Vt. The #include and #define lines of .Fd give
+ *  headers and constants too.
+ */
+static void
+pmdoc_symbol(const struct mdoc_node *n, mandb_rec *rec)
+{
+	enum mdoct tok;
+	char *text = NULL;
+	char *name;
+	char *p;
+
+	if (mflags.limit)
+		return;
+
+	switch (n->tok) {
+	case MDOC_Fo:
+		/* The name of the function is in the head of the block */
+		if (n->type != MDOC_BODY || (n = n->parent->head) == NULL)
+			return;
+		/* FALLTHROUGH */
+	case MDOC_Fn:
+		if ((n = n->child) != NULL && n->type == MDOC_TEXT)
+			add_symbol(rec, SYMBOL_FUNCTION, symbol_word(n->string));
+		return;
+	case MDOC_Dv:
+	case MDOC_Er:
+	case MDOC_Ev:
+		for (n = n->child; n; n = n->next) {
+			if (n->type != MDOC_TEXT)
+				continue;
+			add_symbol(rec, n->parent->tok == MDOC_Dv ?
+			    SYMBOL_CONSTANT : n->parent->tok == MDOC_Er ?
+			    SYMBOL_ERROR : SYMBOL_ENV, symbol_word(n->string));
+		}
+		return;
+	case MDOC_Fl:
+		/*
+		 * Every argument is a flag, .Fl a b is -a -b. The SYNOPSIS
+		 * of commands bundles the flags like -alR, they are taken
+		 * from where they are described instead.
+		 */
+		if (n->sec == SEC_SYNOPSIS)
+			return;
+		for (n = n->child; n; n = n->next) {
+			if (n->type != MDOC_TEXT)
+				continue;
+			text = parse_escape(n->string);
+			if (isalnum((unsigned char) text[0]) || text[0] == '-') {
+				text[strcspn(text, "=")] = '\0';
+				easprintf(&name, "-%s", text);
+				add_symbol(rec, SYMBOL_FLAG, name);
+			}
+			free(text);
+		}
+		return;
+	default:
+		break;
+	}
+
+	/* The others take the text of all their arguments */
+	tok = n->tok;
+	for (n = n->child; n; n = n->next)
+		if (n->type == MDOC_TEXT)
+			concat(&text, n->string);
+	if (text == NULL)
+		return;
+	name = parse_escape(text);
+	free(text);
+
+	switch (tok) {
+	case MDOC_Fd:
+		if (strncmp(name, "#include", 8) == 0) {
+			p = name + 8 + strspn(name + 8, " <\"");
+			add_symbol(rec, SYMBOL_HEADER,
+			    estrndup(p, strcspn(p, " >\"")));
+		} else if (strncmp(name, "#define", 7) == 0)
+			add_symbol(rec, SYMBOL_CONSTANT, symbol_word(name + 7));
+		free(name);
+		break;
+	case MDOC_In:
+		p = name + strspn(name, " <");
+		add_symbol(rec, SYMBOL_HEADER, estrndup(p, strcspn(p, " >")));
+		free(name);
+		break;
+	case MDOC_Vt:
+		/* e.g. .Vt struct stat * */
+		for (p = name + strlen(name); p > name &&
+		    strchr(" *;,.", p[-1]) != NULL; p--)
+			continue;
+		*p = '\0';
+		add_symbol(rec, SYMBOL_TYPE, name);
+		break;
+	default:
+		free(name);
+		break;
+	}
+}
+
+/*
+ * add_symbol --
+ *  Adds name, of the given kind, to the symbols documented by the page, and
+ *  takes it over. Names which are empty, too long or NULL are left out.
+ */
+static void
+add_symbol(mandb_rec *rec, const char *kind, char *name)
+{
+	size_t len;
+
+	if (name == NULL)
+		return;
+	len = strlen(name);
+	if (len == 0 || len > SYMBOL_MAXLEN) {
+		free(name);
+		return;
+	}
+	if (rec->nsymbols == rec->symbols_size) {
+		rec->symbols_size = rec->symbols_size ? 2 * rec->symbols_size : 16;
+		rec->symbols = erealloc(rec->symbols,
+		    rec->symbols_size * sizeof(*rec->symbols));
+	}
+	rec->symbols[rec->nsymbols].kind = kind;
+	rec->symbols[rec->nsymbols++].name = name;
+}
+
+/*
+ * symbol_word --
+ *  Returns a copy of the first C identifier in str, after expanding its
+ *  escapes, e.g. signal for (*signal, or NULL if there is none.
+ */
+static char *
+symbol_word(const char *str)
+{
+	char *text;
+	char *word;
+	const char *p;
+
+	text = parse_escape(str);
+	for (p = text; *p && *p != '_' && !isalpha((unsigned char) *p); p++)
+		continue;
+	word = *p ? estrndup(p, strspn(p, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789_")) : NULL;
+	free(text);
+	return word;
+}
+
+/*
+ * add_xref --
+ *  Adds the page named name in section to the pages the page refers to,
+ *  after expanding their escapes.
+ */
+static void
+add_xref(mandb_rec *rec, const char *name, const char *section)
+{
+	char *n;
+
+	n = parse_escape(name);
+	if (*n == '\0' || strlen(n) > SYMBOL_MAXLEN) {
+		free(n);
+		return;
+	}
+	if (rec->nxrefs == rec->xrefs_size) {
+		rec->xrefs_size = rec->xrefs_size ? 2 * rec->xrefs_size : 16;
+		rec->xrefs = erealloc(rec->xrefs,
+		    rec->xrefs_size * sizeof(*rec->xrefs));
+	}
+	rec->xrefs[rec->nxrefs].name = n;
+	rec->xrefs[rec->nxrefs++].section = parse_escape(section);
+}
+
 /*
  * pmdoc_Sh --
  *  Called when a .Sh macro is encountered and loops through its body, calling
@@ -1262,10 +3646,9 @@ pman_sh(const struct man_node *n, mandb_rec *rec)
 	    { MANSEC_BUGS, "BUGS" },
 	    { MANSEC_AUTHORS, "AUTHORS" },
 	    { MANSEC_COPYRIGHT, "COPYRIGHT" },
+	    { MANSEC_SEE_ALSO, "SEE ALSO" },
 	};
 	const struct man_node *head;
-	char *name_desc;
-	int sz;
 	size_t i;
 
 	if ((head = n->parent->head) == NULL || (head = head->child) == NULL ||
@@ -1289,77 +3672,7 @@ pman_sh(const struct man_node *n, mandb_rec *rec)
 		 * pman_parse_name will put the complete content in name_desc.
 		 */
 		pman_parse_name(n, rec);
-
-		name_desc = rec->name_desc;
-		if (name_desc == NULL)
-			return;
-
-		/* Remove any leading spaces. */
-		while (name_desc[0] == ' ')
-			name_desc++;
-			
-		/* If the line begins with a "\&", avoid those */
-		if (name_desc[0] == '\\' && name_desc[1] == '&')
-			name_desc += 2;
-
-		/* Now name_desc should be left with a comma-space
-		 * separated list of names and the one line description
-		 * of the page:
-		 *     "a, b, c \- sample description"
-		 * Take out the first name, before the first comma
-		 * (or space) and store it in rec->name.
-		 * If the page has aliases then they should be
-		 * in the form of a comma separated list.
-		 * Keep looping while there is a comma in name_desc,
-		 * extract the alias name and store in rec->links.
-		 * When there are no more commas left, break out.
-		 */
-		int has_alias = 0;	// Any more aliases left?
-		while (*name_desc) {
-			/* Remove any leading spaces or hyphens. */
-			if (name_desc[0] == ' ' || name_desc[0] =='-') {
-				name_desc++;
-				continue;
-			}
-			sz = strcspn(name_desc, ", ");
-
-			/* Extract the first term and store it in rec->name. */
-			if (rec->name == NULL) {
-				if (name_desc[sz] == ',')
-					has_alias = 1;
-				name_desc[sz] = 0;
-				rec->name = emalloc(sz + 1);
-				memcpy(rec->name, name_desc, sz + 1);
-				name_desc += sz + 1;
-				continue;
-			}
-
-			/*
-			 * Once rec->name is set, rest of the names
-			 * are to be treated as links or aliases.
-			 */
-			if (rec->name && has_alias) {
-				if (name_desc[sz] != ',') {
-					/* No more commas left -->
-					 * no more aliases to take out
-					 */
-					has_alias = 0;
-				}
-				name_desc[sz] = 0;
-				concat2(&rec->links, name_desc, sz);
-				name_desc += sz + 1;
-				continue;
-			}
-			break;
-		}
-
-		/* Parse any escape sequences that might be there */
-		char *temp = parse_escape(name_desc);
-		free(rec->name_desc);
-		rec->name_desc = temp;
-		temp = parse_escape(rec->name);
-		free(rec->name);
-		rec->name = temp;
+		pman_split_name(rec);
 		return;
 	}
 
@@ -1372,6 +3685,13 @@ pman_sh(const struct man_node *n, mandb_rec *rec)
 		return;
 	}
 
+	if (strcmp(head->string, "SEE") == 0 &&
+	    head->next != NULL && head->next->type == MAN_TEXT &&
+	    strcmp(head->next->string, "ALSO") == 0) {
+		man_parse_section(MANSEC_SEE_ALSO, n, rec);
+		return;
+	}
+
 	/*
 	 * EXIT STATUS section can also be specified all on one line or on two
 	 * separate lines.
@@ -1387,6 +3707,90 @@ pman_sh(const struct man_node *n, mandb_rec *rec)
 	man_parse_section(MANSEC_NONE, n, rec);
 }
 
+/*
+ * pman_split_name --
+ *  Splits the content of the NAME section of a man(7) page, collected in
+ *  rec->name_desc, into the name of the page, its aliases and the one line
+ *  description.
+ */
+static void
+pman_split_name(mandb_rec *rec)
+{
+	char *name_desc;
+	int sz;
+
+	name_desc = rec->name_desc;
+	if (name_desc == NULL)
+		return;
+
+	/* Remove any leading spaces. */
+	while (name_desc[0] == ' ')
+		name_desc++;
+		
+	/* If the line begins with a "\&", avoid those */
+	if (name_desc[0] == '\\' && name_desc[1] == '&')
+		name_desc += 2;
+
+	/* Now name_desc should be left with a comma-space
+	 * separated list of names and the one line description
+	 * of the page:
+	 *     "a, b, c \- sample description"
+	 * Take out the first name, before the first comma
+	 * (or space) and store it in rec->name.
+	 * If the page has aliases then they should be
+	 * in the form of a comma separated list.
+	 * Keep looping while there is a comma in name_desc,
+	 * extract the alias name and store in rec->links.
+	 * When there are no more commas left, break out.
+	 */
+	int has_alias = 0;	// Any more aliases left?
+	while (*name_desc) {
+		/* Remove any leading spaces or hyphens. */
+		if (name_desc[0] == ' ' || name_desc[0] =='-') {
+			name_desc++;
+			continue;
+		}
+		sz = strcspn(name_desc, ", ");
+
+		/* Extract the first term and store it in rec->name. */
+		if (rec->name == NULL) {
+			if (name_desc[sz] == ',')
+				has_alias = 1;
+			name_desc[sz] = 0;
+			rec->name = emalloc(sz + 1);
+			memcpy(rec->name, name_desc, sz + 1);
+			name_desc += sz + 1;
+			continue;
+		}
+
+		/*
+		 * Once rec->name is set, rest of the names
+		 * are to be treated as links or aliases.
+		 */
+		if (rec->name && has_alias) {
+			if (name_desc[sz] != ',') {
+				/* No more commas left -->
+				 * no more aliases to take out
+				 */
+				has_alias = 0;
+			}
+			name_desc[sz] = 0;
+			concat2(&rec->links, name_desc, sz);
+			name_desc += sz + 1;
+			continue;
+		}
+		break;
+	}
+
+	/* Parse any escape sequences that might be there */
+	char *temp = parse_escape(name_desc);
+	free(rec->name_desc);
+	rec->name_desc = temp;
+	temp = parse_escape(rec->name);
+	free(rec->name);
+	rec->name = temp;
+}
+
 /*
  * pman_parse_node --
  *  Generic function to iterate through a node. Usually called from 
@@ -1405,6 +3809,162 @@ pman_parse_node(const struct man_node *n, secbuff *s)
 	pman_parse_node(n->next, s);
 }
 
+/*
+ * pman_symbols --
+ *  man(7) has no macros for the symbols of the page, so they are picked from
+ *  its text: the headers included and the functions declared in the
+ *  SYNOPSIS, and the flags and error codes in the tags of the .TP
+ *  paragraphs of the other sections.
+ */
+static void
+pman_symbols(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
+{
+	if (n == NULL)
+		return;
+
+	if (sec == MANSEC_SYNOPSIS && n->type == MAN_TEXT)
+		pman_synopsis_symbols(n->string, rec);
+	else if (sec != MANSEC_SYNOPSIS && n->type == MAN_HEAD &&
+	    n->tok == MAN_TP)
+		pman_tag_symbol(sec, n->child, rec);
+
+	pman_symbols(sec, n->child, rec);
+	pman_symbols(sec, n->next, rec);
+}
+
+/*
+ * pman_tag_symbol --
+ *  Picks the symbols from the words of the tag of a .TP paragraph, e.g.
+ *  "-a, --all": the words starting with a dash are flags, and in the ERRORS
+ *  section those like EAGAIN are error codes.
+ */
+static void
+pman_tag_symbol(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
+{
+	char *text;
+	char *word;
+	size_t len;
+
+	for (; n != NULL; n = n->next) {
+		if (n->type != MAN_TEXT) {
+			pman_tag_symbol(sec, n->child, rec);
+			continue;
+		}
+		text = parse_escape(n->string);
+		for (word = text; *word != '\0'; word += len) {
+			word += strspn(word, " ,|[]");
+			len = strcspn(word, " ,|[]");
+			if (word[0] == '-' && (isalnum((unsigned char) word[1]) ||
+			    word[1] == '-'))
+				add_symbol(rec, SYMBOL_FLAG,
+				    estrndup(word, strcspn(word, " ,|[]=")));
+			else if (sec == MANSEC_ERRORS && len > 1 &&
+			    word[0] == 'E' && strspn(word,
+			    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") == len)
+				add_symbol(rec, SYMBOL_ERROR,
+				    estrndup(word, len));
+		}
+		free(text);
+	}
+}
+
+/*
+ * pman_synopsis_symbols --
+ *  Picks the symbols from a line of the SYNOPSIS of a man(7) page: the
+ *  header of an #include line or, in the sections of the functions, the
+ *  names followed by a parenthesis, e.g. open in int open(const char *.
+ *  References to other pages like feature_test_macros(7) are skipped.
+ */
+static void
+pman_synopsis_symbols(const char *str, mandb_rec *rec)
+{
+	static const char idchars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789_";
+	char *text;
+	char *p;
+	const char *q;
+	size_t len;
+
+	text = parse_escape(str);
+	if ((p = strstr(text, "#include")) != NULL) {
+		p += 8 + strspn(p + 8, " <\"");
+		add_symbol(rec, SYMBOL_HEADER, estrndup(p, strcspn(p, " >\"")));
+	} else if (text[0] != '#' && rec->section[0] != '\0' &&
+	    strchr("239", rec->section[0]) != NULL) {
+		if ((p = strstr(text, "/*")) != NULL)
+			*p = '\0';
+		for (p = text; *p != '\0'; p += len) {
+			if ((len = strspn(p, idchars)) == 0) {
+				len = 1;
+				continue;
+			}
+			q = p + len;
+			if (*q == '(' && !isdigit((unsigned char) p[0]) &&
+			    !isdigit((unsigned char) q[1]))
+				add_symbol(rec, SYMBOL_FUNCTION,
+				    estrndup(p, len));
+		}
+	}
+	free(text);
+}
+
+/*
+ * pman_see_also --
+ *  Collects the text of the SEE ALSO section of a man(7) page in text, for
+ *  parse_xrefs.
+ */
+static void
+pman_see_also(const struct man_node *n, char **text)
+{
+	for (; n != NULL; n = n->next) {
+		if (n->type == MAN_TEXT)
+			concat(text, n->string);
+		pman_see_also(n->child, text);
+	}
+}
+
+/*
+ * parse_xrefs --
+ *  Adds the references to other pages found in str, written like ls(1),
+ *  or like ls (1) as the text of .BR ls (1) comes out, to those of the page.
+ */
+static void
+parse_xrefs(const char *str, mandb_rec *rec)
+{
+	static const char namechars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789_.:+-";
+	char *text;
+	char *name;
+	char *section;
+	char *p, *end;
+	size_t len;
+
+	text = parse_escape(str);
+	for (p = text; (p = strchr(p, '(')) != NULL; p++) {
+		/* The section: a digit, maybe followed by letters */
+		section = p + 1;
+		if (!isdigit((unsigned char) *section))
+			continue;
+		len = 1 + strspn(section + 1, "abcdefghijklmnopqrstuvwxyz"
+		    "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+		if (section[len] != ')')
+			continue;
+
+		/* The name, right before it or one space before */
+		end = p > text && p[-1] == ' ' ? p - 1 : p;
+		for (name = end; name > text && name[-1] != '\0' &&
+		    strchr(namechars, name[-1]) != NULL; name--)
+			continue;
+		if (name == end)
+			continue;
+		*end = '\0';
+		section[len] = '\0';
+		add_xref(rec, name, section);
+		p = section + len;
+	}
+	free(text);
+}
+
 /*
  * man_parse_section --
  *  Takes two parameters: 
@@ -1416,6 +3976,8 @@ pman_parse_node(const struct man_node *n, secbuff *s)
 static void
 man_parse_section(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
 {
+	char *text;
+
 	/*
 	 * If the user sepecified the 'l' flag then just parse
 	 * the NAME section, ignore the rest.
@@ -1423,6 +3985,8 @@ man_parse_section(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
 	if (mflags.limit)
 		return;
 
+	pman_symbols(sec, n, rec);
+
 	switch (sec) {
 	case MANSEC_LIBRARY:
 		pman_parse_node(n, &rec->lib);
@@ -1445,6 +4009,15 @@ man_parse_section(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
 	case MANSEC_ERRORS:
 		pman_parse_node(n, &rec->errors);
 		break;
+	case MANSEC_SEE_ALSO:
+		text = NULL;
+		pman_see_also(n, &text);
+		if (text != NULL) {
+			parse_xrefs(text, rec);
+			free(text);
+		}
+		pman_parse_node(n, &rec->desc);
+		break;
 	case MANSEC_NAME:
 	case MANSEC_SYNOPSIS:
 	case MANSEC_EXAMPLES:
@@ -1461,11 +4034,185 @@ man_parse_section(enum man_sec sec, const struct man_node *n, mandb_rec *rec)
 
 }
 
+/*
+ * page_simhash --
+ *  Computes the SimHash of the text of the page: every run of three
+ *  consecutive words is hashed, and bit i of the result is set if more of
+ *  the runs have bit i set than not. Pages differing in a few words get
+ *  hashes differing in a few bits, so the near-duplicates of a page are
+ *  found by comparing the hashes. Hashing runs of words rather than words
+ *  keeps the common words from outvoting the others. The number of words
+ *  hashed is returned in *nwords.
+ */
+static uint64_t
+page_simhash(const mandb_rec *rec, size_t *nwords)
+{
+	const char *texts[] = {
+		rec->name_desc, rec->desc.data, rec->lib.data,
+		rec->return_vals.data, rec->env.data, rec->files.data,
+		rec->exit_status.data, rec->diagnostics.data, rec->errors.data
+	};
+	const unsigned char *p;
+	uint64_t simhash = 0;
+	uint64_t word, h, prev[2];
+	int votes[64];
+	size_t i;
+	int bit;
+
+	memset(votes, 0, sizeof(votes));
+	*nwords = 0;
+	for (i = 0; i < __arraycount(texts); i++) {
+		if ((p = (const unsigned char *) texts[i]) == NULL)
+			continue;
+		prev[0] = prev[1] = 0;
+		while (*p != '\0') {
+			if (!isalnum(*p) && *p < 0x80) {
+				p++;
+				continue;
+			}
+			/* FNV-1a of the word, folded to lower case */
+			word = 0xcbf29ce484222325ULL;
+			for (; *p != '\0' && (isalnum(*p) || *p >= 0x80); p++) {
+				word ^= tolower(*p);
+				word *= 0x100000001b3ULL;
+			}
+			/* Mixed with the two words before it */
+			h = word ^ prev[0] * 0x9e3779b97f4a7c15ULL ^ (prev[1] << 1);
+			prev[1] = prev[0];
+			prev[0] = word;
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			for (bit = 0; bit < 64; bit++)
+				votes[bit] += (h >> bit) & 1 ? 1 : -1;
+			(*nwords)++;
+		}
+	}
+	for (bit = 0; bit < 64; bit++)
+		if (votes[bit] > 0)
+			simhash |= 1ULL << bit;
+	return simhash;
+}
+
+/*
+ * simhash_distance --
+ *  Returns the number of bits by which two SimHashes differ.
+ */
+static int
+simhash_distance(uint64_t a, uint64_t b)
+{
+	uint64_t x = a ^ b;
+	int d;
+
+	for (d = 0; x != 0; d++)
+		x &= x - 1;
+	return d;
+}
+
+/*
+ * find_variant --
+ *  Looks for an indexed page the page in rec is a near-duplicate of: a page
+ *  with the same name and section, e.g. the same page for another machine
+ *  or from another man directory, whose SimHash differs from simhash by at
+ *  most SIMHASH_DISTANCE bits. A file already indexed as a page of its own
+ *  stays one when it is modified, so none is looked for then.
+ *  Returns the docid of the page found, or 0.
+ */
+static sqlite3_int64
+find_variant(sqlite3 *db, const mandb_rec *rec, uint64_t simhash)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 docid = 0;
+
+	if (sqlite3_prepare_v2(db, "SELECT docid, simhash"
+	    " FROM mandb_signatures WHERE name = ? AND section = ?"
+	    " AND NOT EXISTS (SELECT 1 FROM mandb_meta WHERE file = ?)"
+	    " ORDER BY docid", -1, &stmt, NULL) != SQLITE_OK)
+		return 0;
+	sqlite3_bind_text(stmt, 1, rec->name, -1, NULL);
+	sqlite3_bind_text(stmt, 2, rec->section, -1, NULL);
+	sqlite3_bind_text(stmt, 3, rec->file_path, -1, NULL);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (simhash_distance(simhash,
+		    (uint64_t) sqlite3_column_int64(stmt, 1)) <=
+		    SIMHASH_DISTANCE) {
+			docid = sqlite3_column_int64(stmt, 0);
+			break;
+		}
+	}
+	sqlite3_finalize(stmt);
+	return docid;
+}
+
+/*
+ * lookup_docid --
+ *  Returns the docid the given query, with file as its parameter, selects,
+ *  or 0 if there is none.
+ */
+static sqlite3_int64
+lookup_docid(sqlite3 *db, const char *sql, const char *file)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 docid = 0;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return 0;
+	sqlite3_bind_text(stmt, 1, file, -1, NULL);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		docid = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return docid;
+}
+
+/*
+ * insert_links --
+ *  Inserts the names in rec->links into mandb_links as links to the page
+ *  with the given docid, for the machine of rec, unless the page already
+ *  has such a link. Returns 0, or -1 on error.
+ */
+static int
+insert_links(sqlite3 *db, mandb_rec *rec, sqlite3_int64 docid)
+{
+	char *ln;
+	char *str;
+	char *errmsg = NULL;
+
+	if (rec->links == NULL)
+		return 0;
+	for (ln = strtok(rec->links, " "); ln; ln = strtok(NULL, " ")) {
+		if (ln[0] == ',')
+			ln++;
+		if (ln[0] == 0)
+			continue;
+		if (ln[strlen(ln) - 1] == ',')
+			ln[strlen(ln) - 1] = 0;
+
+		str = sqlite3_mprintf("INSERT INTO mandb_links"
+		    " SELECT %Q, %Q, %Q, %Q, md5_hash FROM mandb_meta m"
+		    " WHERE id = %lld AND NOT EXISTS (SELECT 1 FROM mandb_links"
+		    "  WHERE link = %Q AND machine IS %Q AND"
+		    "  md5_hash = m.md5_hash)",
+		    ln, rec->name, rec->section, rec->machine, docid, ln,
+		    rec->machine);
+		sqlite3_exec(db, str, NULL, NULL, &errmsg);
+		sqlite3_free(str);
+		if (errmsg != NULL) {
+			warnx("%s", errmsg);
+			free(errmsg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
  * insert_into_db --
  *  Inserts the parsed data of the man page in the Sqlite databse.
  *  If any of the values is NULL, then we cleanup and return -1 indicating
  *  an error.
+ *  A page which is a near-duplicate of an indexed one (see find_variant) is
+ *  not indexed again: its file is only recorded in mandb_variants, with the
+ *  docid of that page and its machine, and 1 is returned.
  *  Otherwise, store the data in the database and return 0.
  */
 static int
@@ -1475,9 +4222,14 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 	int idx = -1;
 	const char *sqlstr = NULL;
 	sqlite3_stmt *stmt = NULL;
-	char *ln = NULL;
 	char *errmsg = NULL;
 	long int mandb_rowid;
+	sqlite3_int64 variant = 0;
+	sqlite3_int64 folded_into;
+	sqlite3_int64 old_docid = 0;
+	uint64_t simhash;
+	size_t nwords;
+	size_t i;
 	
 	/*
 	 * At the very minimum we want to make sure that we store
@@ -1524,8 +4276,51 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 		rec->links = tmp;
 	}
 
+	/* The page the file may have been a near-duplicate of before */
+	folded_into = lookup_docid(db, "SELECT docid FROM mandb_variants"
+	    " WHERE file = ?", rec->file_path);
+	/*
+	 * Pages too short for their SimHash to tell them apart, as with -l,
+	 * are never taken for near-duplicates.
+	 */
+	simhash = page_simhash(rec, &nwords);
+	if (nwords >= SIMHASH_MINWORDS &&
+	    (variant = find_variant(db, rec, simhash)) != 0) {
+		sqlstr = "INSERT OR REPLACE INTO mandb_variants"
+			 " VALUES (?, ?, ?, ?, ?, ?, ?)";
+		rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+		if (rc != SQLITE_OK)
+			goto Out;
+		sqlite3_bind_int64(stmt, 1, rec->device);
+		sqlite3_bind_int64(stmt, 2, rec->inode);
+		sqlite3_bind_int64(stmt, 3, rec->mtime);
+		sqlite3_bind_text(stmt, 4, rec->file_path, -1, NULL);
+		sqlite3_bind_text(stmt, 5, rec->md5_hash, -1, NULL);
+		sqlite3_bind_int64(stmt, 6, variant);
+		sqlite3_bind_text(stmt, 7, rec->machine, -1, NULL);
+		rc = sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_DONE)
+			goto Out;
+		/* The names of the variant are looked up for its machine too */
+		rc = insert_links(db, rec, variant);
+		cleanup(rec);
+		if (rc < 0)
+			return -1;
+		/* The title and machines of the page change */
+		if (!mflags.bulk) {
+			if (folded_into != 0 && folded_into != variant)
+				refresh_page(db, folded_into);
+			refresh_page(db, variant);
+		}
+		return 1;
+	}
+
 /*------------------------ Populate the mandb_dup table---------------------------*/
-	sqlstr = "INSERT INTO metadb.mandb_dup VALUES (:section, :name, :name_desc, :desc,"
+	sqlstr = "INSERT INTO metadb.mandb_dup(docid, section, name, name_desc,"
+		 " desc, lib, return_vals, env, files, exit_status, diagnostics,"
+		 " errors, machine)"
+		 " VALUES (:docid, :section, :name, :name_desc, :desc,"
 		 " :lib, :return_vals, :env, :files, :exit_status,"
 		 " :diagnostics, :errors, :machine)";
 
@@ -1533,6 +4328,16 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 	if (rc != SQLITE_OK)
 		goto Out;
 
+	idx = sqlite3_bind_parameter_index(stmt, ":docid");
+	if (rec->docid)
+		rc = sqlite3_bind_int64(stmt, idx, rec->docid);
+	else
+		rc = sqlite3_bind_null(stmt, idx);
+	if (rc != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		goto Out;
+	}
+
 	idx = sqlite3_bind_parameter_index(stmt, ":name");
 	rc = sqlite3_bind_text(stmt, idx, rec->name, -1, NULL);
 	if (rc != SQLITE_OK) {
@@ -1635,7 +4440,10 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 	sqlite3_finalize(stmt);
 
 /*------------------------ Populate the mandb table---------------------------*/
-	sqlstr = "INSERT INTO mandb VALUES (:section, :name, :name_desc, :desc,"
+	sqlstr = "INSERT INTO mandb(docid, section, name, name_desc, desc, lib,"
+		 " return_vals, env, files, exit_status, diagnostics, errors,"
+		 " md5_hash, machine)"
+		 " VALUES (:docid, :section, :name, :name_desc, :desc,"
 		 " :lib, :return_vals, :env, :files, :exit_status,"
 		 " :diagnostics, :errors, :md5_hash, :machine)";
 
@@ -1643,6 +4451,16 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 	if (rc != SQLITE_OK)
 		goto Out;
 
+	idx = sqlite3_bind_parameter_index(stmt, ":docid");
+	if (rec->docid)
+		rc = sqlite3_bind_int64(stmt, idx, rec->docid);
+	else
+		rc = sqlite3_bind_null(stmt, idx);
+	if (rc != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		goto Out;
+	}
+
 	idx = sqlite3_bind_parameter_index(stmt, ":name");
 	rc = sqlite3_bind_text(stmt, idx, rec->name, -1, NULL);
 	if (rc != SQLITE_OK) {
@@ -1805,22 +4623,46 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 
 	rc = sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
-	if (rc == SQLITE_CONSTRAINT) {
+	/* open_db turns the extended result codes on */
+	if ((rc & 0xff) == SQLITE_CONSTRAINT) {
 		/* The *most* probable reason for reaching here is that
 		 * the UNIQUE contraint on the file column of the mandb_meta
 		 * table was violated.
 		 * This can happen when a file was updated/modified.
-		 * To fix this we need to do two things:
+		 * To fix this we need to do three things:
 		 * 1. Delete the row for the older version of this file
-		 *    from mandb table.
-		 * 2. Run an UPDATE query to update the row for this file
+		 *    from mandb table, and its symbols, references and
+		 *    signature.
+		 * 2. Delete the near-duplicates of the older version, which
+		 *    update_db has already queued for indexing again.
+		 * 3. Run an UPDATE query to update the row for this file
 		 *    in the mandb_meta table.
 		 */
 		warnx("Trying to update index for %s", rec->file_path);
+		old_docid = lookup_docid(db, "SELECT id FROM mandb_meta"
+		    " WHERE file = ?", rec->file_path);
 		char *sql = sqlite3_mprintf("DELETE FROM mandb "
 					    "WHERE rowid = (SELECT id"
 					    "  FROM mandb_meta"
+					    "  WHERE file = %Q);"
+					    "DELETE FROM mandb_symbols "
+					    "WHERE docid = (SELECT id"
+					    "  FROM mandb_meta"
+					    "  WHERE file = %Q);"
+					    "DELETE FROM mandb_xrefs "
+					    "WHERE docid = (SELECT id"
+					    "  FROM mandb_meta"
+					    "  WHERE file = %Q);"
+					    "DELETE FROM mandb_signatures "
+					    "WHERE docid = (SELECT id"
+					    "  FROM mandb_meta"
+					    "  WHERE file = %Q);"
+					    "DELETE FROM mandb_variants "
+					    "WHERE docid = (SELECT id"
+					    "  FROM mandb_meta"
 					    "  WHERE file = %Q)",
+					    rec->file_path, rec->file_path,
+					    rec->file_path, rec->file_path,
 					    rec->file_path);
 		sqlite3_exec(db, sql, NULL, NULL, &errmsg);
 		sqlite3_free(sql);
@@ -1876,28 +4718,81 @@ insert_into_db(sqlite3 *db, mandb_rec *rec)
 
 /*------------------------ Populate the mandb_links table---------------------*/
 	char *str = NULL;
-	char *links;	
-	if (rec->links && strlen(rec->links)) {
-		links = rec->links;
-		for(ln = strtok(links, " "); ln; ln = strtok(NULL, " ")) {
-			if (ln[0] == ',')
-				ln++;
-			if(ln[strlen(ln) - 1] == ',')
-				ln[strlen(ln) - 1] = 0;
-			
-			str = sqlite3_mprintf("INSERT INTO mandb_links"
-					      " VALUES (%Q, %Q, %Q, %Q, %Q)",
-					      ln, rec->name, rec->section,
-					      rec->machine, rec->md5_hash);
-			sqlite3_exec(db, str, NULL, NULL, &errmsg);
-			sqlite3_free(str);
-			if (errmsg != NULL) {
-				warnx("%s", errmsg);
-				cleanup(rec);
-				free(errmsg);
-				return -1;
+	if (insert_links(db, rec, mandb_rowid) < 0) {
+		cleanup(rec);
+		return -1;
+	}
+
+/*------------------------ Populate the mandb_variants table------------------*/
+	/* The file may have been a near-duplicate of another page before */
+	str = sqlite3_mprintf("DELETE FROM mandb_variants WHERE file = %Q",
+	    rec->file_path);
+	sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+
+/*------------------------ Populate the mandb_signatures table----------------*/
+	if (nwords >= SIMHASH_MINWORDS) {
+		sqlstr = "INSERT OR REPLACE INTO mandb_signatures"
+			 " VALUES (?, ?, ?, ?)";
+		rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+		if (rc != SQLITE_OK)
+			goto Out;
+		sqlite3_bind_text(stmt, 1, rec->name, -1, NULL);
+		sqlite3_bind_text(stmt, 2, rec->section, -1, NULL);
+		sqlite3_bind_int64(stmt, 3, mandb_rowid);
+		sqlite3_bind_int64(stmt, 4, (sqlite3_int64) simhash);
+		rc = sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_DONE)
+			goto Out;
+	}
+
+/*------------------------ Populate the mandb_symbols table-------------------*/
+	if (rec->nsymbols > 0) {
+		sqlstr = "INSERT OR IGNORE INTO mandb_symbols VALUES (?, ?, ?)";
+		rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+		if (rc != SQLITE_OK)
+			goto Out;
+		for (i = 0; i < rec->nsymbols; i++) {
+			sqlite3_bind_text(stmt, 1, rec->symbols[i].name, -1, NULL);
+			sqlite3_bind_text(stmt, 2, rec->symbols[i].kind, -1, NULL);
+			sqlite3_bind_int64(stmt, 3, mandb_rowid);
+			if (sqlite3_step(stmt) != SQLITE_DONE) {
+				sqlite3_finalize(stmt);
+				goto Out;
+			}
+			sqlite3_reset(stmt);
+		}
+		sqlite3_finalize(stmt);
+	}
+
+/*------------------------ Populate the mandb_xrefs table---------------------*/
+	if (rec->nxrefs > 0) {
+		sqlstr = "INSERT OR IGNORE INTO mandb_xrefs VALUES (?, ?, ?)";
+		rc = sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
+		if (rc != SQLITE_OK)
+			goto Out;
+		for (i = 0; i < rec->nxrefs; i++) {
+			sqlite3_bind_int64(stmt, 1, mandb_rowid);
+			sqlite3_bind_text(stmt, 2, rec->xrefs[i].name, -1, NULL);
+			sqlite3_bind_text(stmt, 3, rec->xrefs[i].section, -1,
+			    NULL);
+			if (sqlite3_step(stmt) != SQLITE_DONE) {
+				sqlite3_finalize(stmt);
+				goto Out;
 			}
+			sqlite3_reset(stmt);
 		}
+		sqlite3_finalize(stmt);
+	}
+
+	/* A bulk load builds these tables for all the pages once done */
+	if (!mflags.bulk) {
+		if (old_docid != 0)
+			refresh_page(db, old_docid);
+		if (folded_into != 0)
+			refresh_page(db, folded_into);
+		refresh_page(db, mandb_rowid);
 	}
 
 	cleanup(rec);
@@ -1973,15 +4868,175 @@ check_md5(const char *file, sqlite3 *db, const char *table, char **md5sum,
 	return 1;
 }
 
+/*
+ * is_empty_db --
+ *  Returns 1 if no page has been indexed in the database yet, 0 otherwise.
+ */
+static int
+is_empty_db(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT 1 FROM mandb_meta LIMIT 1", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return 0;
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_DONE;
+}
+
+/*
+ * begin_bulk_load --
+ *  Prepares an empty database for loading all the pages in a single
+ *  transaction. The secondary indexes are dropped so that they do not
+ *  have to be maintained on every insert, and the rollback journal is
+ *  turned off: if the load fails the database is useless anyway and has
+ *  to be rebuilt with -f.
+ */
+static void
+begin_bulk_load(sqlite3 *db)
+{
+	char *errmsg = NULL;
+
+	if (mflags.verbosity == 2)
+		printf("Deferring index creation until the load is complete\n");
+
+	if (drop_db_indexes(db) < 0) {
+		close_db(db);
+		exit(EXIT_FAILURE);
+	}
+
+	sqlite3_exec(db, "PRAGMA journal_mode = OFF;"
+	    "PRAGMA cache_size = 65536", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+	}
+}
+
+/*
+ * end_bulk_load --
+ *  Restores the journal and synchronous settings changed for the bulk load
+ *  and builds the secondary indexes in one pass over the loaded tables.
+ *  Building the UNIQUE index on mandb_meta also verifies that no file was
+ *  indexed twice.
+ */
+static void
+end_bulk_load(sqlite3 *db)
+{
+	char *errmsg = NULL;
+
+	if (mflags.verbosity == 2)
+		printf("Building indexes\n");
+
+	sqlite3_exec(db, "PRAGMA journal_mode = DELETE;"
+	    "PRAGMA synchronous = FULL;"
+	    "BEGIN", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		exit(EXIT_FAILURE);
+	}
+
+	if (create_db_indexes(db) < 0) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		close_db(db);
+		errx(EXIT_FAILURE, "Consider running makemandb with -f option");
+	}
+
+	sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		close_db(db);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * train_codec --
+ *  Trains the compression dictionary on the pages just loaded and
+ *  compresses them again with it. There is nothing to train it on before
+ *  the load, so the pages are first stored without it. Failing to train
+ *  it only costs disk space: the pages are left as they were, and the
+ *  database is only vacuumed when they were compressed again.
+ */
+static void
+train_codec(sqlite3 *db)
+{
+	char *errmsg = NULL;
+	int rc;
+
+	sqlite3_exec(db, "BEGIN", NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+	/* Without zstd, or without a dictionary, nothing was rewritten */
+	if ((rc = codec_train(db)) <= 0) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		codec_register(db);
+		if (rc < 0 && mflags.verbosity)
+			warnx("Could not train the compression dictionary");
+		return;
+	}
+	sqlite3_exec(db, "COMMIT", NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+	if (mflags.verbosity == 2)
+		printf("Compressed the pages with a trained dictionary\n");
+
+	/* optimize vacuums the database anyway */
+	if (!mflags.optimize)
+		sqlite3_exec(db, "VACUUM", NULL, NULL, &errmsg);
+	if (errmsg != NULL)
+		goto error;
+	return;
+
+error:
+	warnx("%s", errmsg);
+	free(errmsg);
+	sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+	codec_register(db);
+}
+
+/*
+ * index_size --
+ *  Returns the number of bytes taken by the segments of the FTS index, or -1
+ *  on error.
+ */
+static sqlite3_int64
+index_size(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 size = -1;
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT"
+	    " (SELECT ifnull(sum(length(block)), 0) FROM mandb_segments) +"
+	    " (SELECT ifnull(sum(length(root)), 0) FROM mandb_segdir)", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		size = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return size;
+}
+
 /* Optimize the index for faster search */
 static void
 optimize(sqlite3 *db)
 {
 	const char *sqlstr;
 	char *errmsg = NULL;
+	sqlite3_int64 size = 0;
 
-	if (mflags.verbosity == 2)
+	if (mflags.verbosity == 2) {
 		printf("Optimizing the database index\n");
+		size = index_size(db);
+	}
 	sqlstr = "INSERT INTO mandb(mandb) VALUES (\'optimize\');"
 		 "VACUUM";
 	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
@@ -1991,6 +5046,10 @@ optimize(sqlite3 *db)
 		free(errmsg);
 		return;
 	}
+	if (mflags.verbosity == 2)
+		printf("Size of the index: %lld bytes before optimizing,"
+		    " %lld bytes after\n", (long long) size,
+		    (long long) index_size(db));
 }
 
 /* 
@@ -2026,6 +5085,15 @@ cleanup(mandb_rec *rec)
 
 	free(rec->md5_hash);
 	rec->md5_hash = NULL;
+
+	while (rec->nsymbols > 0)
+		free(rec->symbols[--rec->nsymbols].name);
+
+	while (rec->nxrefs > 0) {
+		rec->nxrefs--;
+		free(rec->xrefs[rec->nxrefs].name);
+		free(rec->xrefs[rec->nxrefs].section);
+	}
 }
 
 /*
@@ -2093,6 +5161,8 @@ free_secbuffs(mandb_rec *rec)
 	free(rec->files.data);
 	free(rec->diagnostics.data);
 	free(rec->errors.data);
+	free(rec->symbols);
+	free(rec->xrefs);
 }
 
 static void
@@ -2198,6 +5268,6 @@ append(secbuff *sbuff, const char *src)
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-floQqv] [-C path]\n", getprogname());
+	fprintf(stderr, "Usage: %s [-bfloQqv] [-C path] [-j jobs] [-r rate] [-t percent]\n", getprogname());
 	exit(1);
 }
@@ -0,0 +1,549 @@
+/*-
+ * Copyright (c) 2011 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * This code was developed as part of Google's Summer of Code 2011 program.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include "mandb-codec.h"
+
+/*
+ * Every value zip stores in the FTS table starts with a tag byte telling
+ * how it is compressed. Compressed values then have the length of the
+ * original value, as 4 bytes in big-endian order, so that unzip allocates
+ * the output once. Values which do not get smaller are stored as they are,
+ * after the tag. The values written before the tags were added are bare
+ * zlib streams, which always start with 0x78.
+ */
+#define TAG_STORED	0x00
+#define TAG_ZLIB	0x01
+#define TAG_ZSTD	0x02	// zstd without a dictionary
+#define TAG_ZSTD_DICT	0x03	// zstd with the dictionary in mandb_info
+#define TAG_LEGACY	0x78
+#define HEADER_SIZE	5
+
+#define CODEC_LEVEL	9		// zstd compression level
+#define CODEC_DICTSIZE	(64 * 1024)	// size of the trained dictionary
+#define CODEC_SAMPLES	(8 * 1024 * 1024)	// most bytes to train it on
+#define CODEC_PAGES	4096		// about how many pages to sample
+
+/* The compression state of a database connection */
+typedef struct codec {
+	int tag;		// TAG_* of the values zip writes
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+#endif
+} codec;
+
+/*
+ * codec_free --
+ *  Frees the state of a codec, when the zip function using it is
+ *  dropped or replaced.
+ */
+static void
+codec_free(void *data)
+{
+	codec *c = data;
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(c->cctx);
+	ZSTD_freeDCtx(c->dctx);
+	ZSTD_freeCDict(c->cdict);
+	ZSTD_freeDDict(c->ddict);
+#endif
+	free(c);
+}
+
+/*
+ * legacy_inflate --
+ *  Decompresses a value written before the values had a header, whose
+ *  length is not known: the output is grown until it fits.
+ */
+static int
+legacy_inflate(const unsigned char *in, size_t n, char **outp, size_t *lenp)
+{
+	unsigned int rc;
+	unsigned char *outbuf;
+	z_stream stream;
+
+	stream.next_in = __UNCONST(in);
+	stream.avail_in = n;
+	stream.avail_out = stream.avail_in * 2 + 100;
+	stream.next_out = outbuf = emalloc(stream.avail_out);
+	stream.zalloc = NULL;
+	stream.zfree = NULL;
+
+	if (inflateInit(&stream) != Z_OK) {
+		free(outbuf);
+		return -1;
+	}
+
+	while ((rc = inflate(&stream, Z_SYNC_FLUSH)) != Z_STREAM_END) {
+		if (rc != Z_OK ||
+		    (stream.avail_out != 0 && stream.avail_in == 0)) {
+			inflateEnd(&stream);
+			free(outbuf);
+			return -1;
+		}
+		outbuf = erealloc(outbuf, stream.total_out * 2);
+		stream.next_out = outbuf + stream.total_out;
+		stream.avail_out = stream.total_out;
+	}
+	if (inflateEnd(&stream) != Z_OK) {
+		free(outbuf);
+		return -1;
+	}
+	*outp = (char *) outbuf;
+	*lenp = stream.total_out;
+	return 0;
+}
+
+/*
+ * decode --
+ *  Decompresses the n bytes of a value stored by zip into a buffer of
+ *  *lenp bytes at *outp. Returns -1 if the value cannot be decompressed.
+ */
+static int
+decode(const codec *c, const unsigned char *in, size_t n, char **outp,
+    size_t *lenp)
+{
+	char *out;
+	size_t len;
+	uLongf zlen;
+	int ok = 0;
+#ifdef HAVE_ZSTD
+	size_t rc;
+#endif
+
+	if (n == 0) {
+		*outp = estrdup("");
+		*lenp = 0;
+		return 0;
+	}
+	if (in[0] == TAG_LEGACY)
+		return legacy_inflate(in, n, outp, lenp);
+	if (in[0] == TAG_STORED) {
+		*lenp = n - 1;
+		*outp = emalloc(n);
+		memcpy(*outp, in + 1, n - 1);
+		return 0;
+	}
+	if (n < HEADER_SIZE)
+		return -1;
+
+	len = (size_t) in[1] << 24 | (size_t) in[2] << 16 |
+	    (size_t) in[3] << 8 | in[4];
+	out = emalloc(len + 1);
+	switch (in[0]) {
+	case TAG_ZLIB:
+		zlen = len;
+		ok = uncompress((Bytef *) out, &zlen, in + HEADER_SIZE,
+		    n - HEADER_SIZE) == Z_OK && zlen == len;
+		break;
+#ifdef HAVE_ZSTD
+	case TAG_ZSTD:
+		rc = ZSTD_decompressDCtx(c->dctx, out, len, in + HEADER_SIZE,
+		    n - HEADER_SIZE);
+		ok = !ZSTD_isError(rc) && rc == len;
+		break;
+	case TAG_ZSTD_DICT:
+		if (c->ddict == NULL)
+			break;
+		rc = ZSTD_decompress_usingDDict(c->dctx, out, len,
+		    in + HEADER_SIZE, n - HEADER_SIZE, c->ddict);
+		ok = !ZSTD_isError(rc) && rc == len;
+		break;
+#endif
+	}
+	if (!ok) {
+		free(out);
+		return -1;
+	}
+	*outp = out;
+	*lenp = len;
+	return 0;
+}
+
+/*
+ * zip --
+ *  User defined Sqlite function to compress the FTS table, with the codec
+ *  of the database.
+ */
+static void
+zip(sqlite3_context *pctx, int nval, sqlite3_value **apval)
+{
+	codec *c = sqlite3_user_data(pctx);
+	const unsigned char *inbuf;
+	unsigned char *outbuf;
+	size_t nin, nout, bound;
+	uLongf zlen;
+
+	assert(nval == 1);
+	if (sqlite3_value_type(apval[0]) == SQLITE_NULL) {
+		sqlite3_result_null(pctx);
+		return;
+	}
+	nin = sqlite3_value_bytes(apval[0]);
+	inbuf = sqlite3_value_blob(apval[0]);
+	bound = compressBound(nin);
+#ifdef HAVE_ZSTD
+	if (ZSTD_compressBound(nin) > bound)
+		bound = ZSTD_compressBound(nin);
+#endif
+	outbuf = emalloc(HEADER_SIZE + bound);
+
+	nout = 0;
+	switch (c->tag) {
+	case TAG_ZLIB:
+		zlen = bound;
+		if (compress(outbuf + HEADER_SIZE, &zlen, inbuf, nin) == Z_OK)
+			nout = zlen;
+		break;
+#ifdef HAVE_ZSTD
+	case TAG_ZSTD:
+	case TAG_ZSTD_DICT:
+		nout = ZSTD_compress2(c->cctx, outbuf + HEADER_SIZE, bound,
+		    inbuf, nin);
+		if (ZSTD_isError(nout))
+			nout = 0;
+		break;
+#endif
+	}
+
+	if (nout == 0 || HEADER_SIZE + nout >= 1 + nin) {
+		outbuf[0] = TAG_STORED;
+		if (nin > 0)
+			memcpy(outbuf + 1, inbuf, nin);
+		nout = 1 + nin;
+	} else {
+		outbuf[0] = c->tag;
+		outbuf[1] = (nin >> 24) & 0xff;
+		outbuf[2] = (nin >> 16) & 0xff;
+		outbuf[3] = (nin >> 8) & 0xff;
+		outbuf[4] = nin & 0xff;
+		nout += HEADER_SIZE;
+	}
+	sqlite3_result_blob(pctx, outbuf, nout, free);
+}
+
+/*
+ * unzip --
+ *  User defined Sqlite function to uncompress the FTS table. It reads the
+ *  values written with any of the codecs.
+ */
+static void
+unzip(sqlite3_context *pctx, int nval, sqlite3_value **apval)
+{
+	const codec *c = sqlite3_user_data(pctx);
+	char *out;
+	size_t len;
+
+	assert(nval == 1);
+	if (sqlite3_value_type(apval[0]) == SQLITE_NULL) {
+		sqlite3_result_null(pctx);
+		return;
+	}
+	if (decode(c, sqlite3_value_blob(apval[0]),
+	    sqlite3_value_bytes(apval[0]), &out, &len) < 0) {
+		sqlite3_result_error(pctx, "Unable to uncompress a value of the"
+		    " index, it may have to be rebuilt with makemandb -f", -1);
+		return;
+	}
+	sqlite3_result_text(pctx, out, len, free);
+}
+
+/*
+ * load_codec --
+ *  Reads the codec of the database, and its dictionary if it has one,
+ *  from mandb_info. The databases which do not record one use zlib.
+ */
+static codec *
+load_codec(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	codec *c;
+	const char *name = NULL;
+
+	c = emalloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->tag = TAG_ZLIB;
+#ifdef HAVE_ZSTD
+	c->cctx = ZSTD_createCCtx();
+	c->dctx = ZSTD_createDCtx();
+	if (c->cctx == NULL || c->dctx == NULL) {
+		codec_free(c);
+		return NULL;
+	}
+	ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_compressionLevel, CODEC_LEVEL);
+	/* The length is in the header already */
+	ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_contentSizeFlag, 0);
+	ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_checksumFlag, 0);
+	ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_dictIDFlag, 0);
+#endif
+
+	if (sqlite3_prepare_v2(db, "SELECT name, value FROM mandb_info"
+	    " WHERE name IN ('codec', 'codec_dict') ORDER BY name", -1,
+	    &stmt, NULL) != SQLITE_OK)
+		return c;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (strcmp((const char *) sqlite3_column_text(stmt, 0),
+		    "codec") == 0) {
+			name = (const char *) sqlite3_column_text(stmt, 1);
+			if (name != NULL && strcmp(name, CODEC_ZSTD) == 0) {
+#ifdef HAVE_ZSTD
+				c->tag = TAG_ZSTD;
+#else
+				warnx("The index is compressed with zstd,"
+				    " which this program was built without");
+#endif
+			}
+			continue;
+		}
+#ifdef HAVE_ZSTD
+		/* codec_dict comes after codec */
+		if (c->tag != TAG_ZSTD || sqlite3_column_bytes(stmt, 1) == 0)
+			continue;
+		c->cdict = ZSTD_createCDict(sqlite3_column_blob(stmt, 1),
+		    sqlite3_column_bytes(stmt, 1), CODEC_LEVEL);
+		c->ddict = ZSTD_createDDict(sqlite3_column_blob(stmt, 1),
+		    sqlite3_column_bytes(stmt, 1));
+		if (c->cdict == NULL || c->ddict == NULL)
+			continue;
+		ZSTD_CCtx_refCDict(c->cctx, c->cdict);
+		c->tag = TAG_ZSTD_DICT;
+#endif
+	}
+	sqlite3_finalize(stmt);
+	return c;
+}
+
+/*
+ * codec_register --
+ *  Registers the zip and unzip functions the FTS table is compressed with,
+ *  set up for the codec recorded in the database. Called again after the
+ *  codec changes. Returns -1 on failure.
+ */
+int
+codec_register(sqlite3 *db)
+{
+	codec *c;
+
+	if ((c = load_codec(db)) == NULL) {
+		warnx("Unable to set up the compression of the index");
+		return -1;
+	}
+	if (sqlite3_create_function_v2(db, "unzip", 1, SQLITE_ANY, c, unzip,
+	    NULL, NULL, NULL) != SQLITE_OK) {
+		warnx("Unable to register function: uncompress: %s",
+		    sqlite3_errmsg(db));
+		codec_free(c);
+		return -1;
+	}
+	/* zip owns the state, the one it replaces is freed */
+	if (sqlite3_create_function_v2(db, "zip", 1, SQLITE_ANY, c, zip,
+	    NULL, NULL, codec_free) != SQLITE_OK) {
+		warnx("Unable to register function: compress: %s",
+		    sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * sample_values --
+ *  Collects the values of the columns of about CODEC_PAGES pages of the
+ *  FTS table, spread over all of them, to train the dictionary on. Returns
+ *  the number of values, or -1 on error.
+ */
+static ssize_t
+sample_values(sqlite3 *db, codec *c, char **samplesp, size_t **sizesp)
+{
+	sqlite3_stmt *stmt;
+	char *samples = NULL;
+	size_t *sizes = NULL;
+	size_t nsamples = 0;
+	size_t total = 0;
+	sqlite3_int64 npages = 0;
+	char *out;
+	size_t len;
+	int i, rc;
+
+	rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM mandb_content", -1,
+	    &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		npages = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	rc = sqlite3_prepare_v2(db, "SELECT * FROM mandb_content"
+	    " WHERE docid % ? = 0", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		return -1;
+	sqlite3_bind_int64(stmt, 1, npages > CODEC_PAGES ?
+	    npages / CODEC_PAGES : 1);
+	while (total < CODEC_SAMPLES && sqlite3_step(stmt) == SQLITE_ROW) {
+		/* The first column is the docid */
+		for (i = 1; i < sqlite3_column_count(stmt); i++) {
+			if (decode(c, sqlite3_column_blob(stmt, i),
+			    sqlite3_column_bytes(stmt, i), &out, &len) < 0)
+				continue;
+			if (len > 0 && total + len <= CODEC_SAMPLES) {
+				samples = erealloc(samples, total + len);
+				memcpy(samples + total, out, len);
+				sizes = erealloc(sizes,
+				    (nsamples + 1) * sizeof(*sizes));
+				sizes[nsamples++] = len;
+				total += len;
+			}
+			free(out);
+		}
+	}
+	sqlite3_finalize(stmt);
+	*samplesp = samples;
+	*sizesp = sizes;
+	return nsamples;
+}
+
+/*
+ * recompress --
+ *  Compresses all the values of the FTS table again, with the codec just
+ *  registered. The text does not change, so the content table is updated
+ *  directly, without reindexing the pages. Returns 1 once they are
+ *  compressed again, 0 if there are no values, or -1 on error.
+ */
+static int
+recompress(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	char *sqlstr;
+	char *set = NULL;
+	char *errmsg = NULL;
+	int i;
+
+	if (sqlite3_prepare_v2(db, "SELECT * FROM mandb_content LIMIT 0", -1,
+	    &stmt, NULL) != SQLITE_OK)
+		return -1;
+	/* The first column is the docid */
+	for (i = 1; i < sqlite3_column_count(stmt); i++)
+		set = sqlite3_mprintf("%z%s\"%w\" = zip(unzip(\"%w\"))", set,
+		    set != NULL ? ", " : "", sqlite3_column_name(stmt, i),
+		    sqlite3_column_name(stmt, i));
+	sqlite3_finalize(stmt);
+	if (set == NULL)
+		return 0;
+
+	sqlstr = sqlite3_mprintf("UPDATE mandb_content SET %z", set);
+	sqlite3_exec(db, sqlstr, NULL, NULL, &errmsg);
+	sqlite3_free(sqlstr);
+	if (errmsg != NULL) {
+		warnx("%s", errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	return 1;
+}
+#endif
+
+/*
+ * codec_train --
+ *  Trains a zstd dictionary on the pages of the database and compresses
+ *  them again with it. makemandb calls it once it has loaded an empty
+ *  database, within a transaction. Without zstd, or with too few pages to
+ *  train on, the database is left as it is. Returns 1 if the pages were
+ *  compressed again, 0 if they were left as they were, or -1 on error,
+ *  after which the transaction has to be rolled back and codec_register
+ *  called again.
+ */
+int
+codec_train(sqlite3 *db)
+{
+#ifdef HAVE_ZSTD
+	sqlite3_stmt *stmt;
+	codec *c;
+	char *samples = NULL;
+	size_t *sizes = NULL;
+	ssize_t nsamples;
+	void *dict;
+	size_t dictlen;
+	int rc;
+
+	if ((c = load_codec(db)) == NULL)
+		return -1;
+	nsamples = sample_values(db, c, &samples, &sizes);
+	codec_free(c);
+	if (nsamples < 0)
+		return -1;
+
+	dict = emalloc(CODEC_DICTSIZE);
+	dictlen = ZDICT_trainFromBuffer(dict, CODEC_DICTSIZE, samples, sizes,
+	    nsamples);
+	free(samples);
+	free(sizes);
+	if (ZDICT_isError(dictlen)) {
+		free(dict);
+		return 0;
+	}
+
+	rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO mandb_info"
+	    " VALUES ('codec', '" CODEC_ZSTD "'), ('codec_dict', ?)", -1,
+	    &stmt, NULL);
+	if (rc == SQLITE_OK) {
+		sqlite3_bind_blob(stmt, 1, dict, dictlen, NULL);
+		rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+		sqlite3_finalize(stmt);
+	}
+	free(dict);
+	if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(db));
+		return -1;
+	}
+	if (codec_register(db) < 0)
+		return -1;
+	return recompress(db);
+#else
+	return 0;
+#endif
+}
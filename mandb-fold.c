@@ -0,0 +1,338 @@
+/*-
+ * Copyright (c) 2011 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * This code was developed as part of Google's Summer of Code 2011 program.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The normalization of the text of the pages and of the queries: case
+ * folding, diacritic folding and splitting into words. The Latin, Greek
+ * and Cyrillic letters are folded, the other characters are left as they
+ * are. A folded character never takes more bytes than it did in UTF-8, so
+ * text may be folded in place.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "mandb-fold.h"
+
+#define FOLD_SPACE	-1	// the character separates words
+#define FOLD_DROP	-2	// the character is left out
+
+/*
+ * The folded forms of U+00C0 to U+017F. '*' marks the letters folded into
+ * two, which are in fold_pairs, and ' ' the signs which separate words.
+ */
+static const char fold_latin[] =
+	"aaaaaa*ceeeeiiii" "dnooooo ouuuuy**"	/* U+00C0 */
+	"aaaaaa*ceeeeiiii" "dnooooo ouuuuy*y"	/* U+00E0 */
+	"aaaaaaccccccccdd" "ddeeeeeeeeeegggg"	/* U+0100 */
+	"gggghhhhiiiiiiii" "ii**jjkkklllllll"	/* U+0120 */
+	"lllnnnnnnnnnoooo" "oo**rrrrrrssssss"	/* U+0140 */
+	"ssttttttuuuuuuuu" "uuuuwwyyyzzzzzzs";	/* U+0160 */
+
+static const struct {
+	uint16_t c;
+	char s[3];
+} fold_pairs[] = {
+	{ 0x00c6, "ae" }, { 0x00de, "th" }, { 0x00df, "ss" },
+	{ 0x00e6, "ae" }, { 0x00fe, "th" }, { 0x0132, "ij" },
+	{ 0x0133, "ij" }, { 0x0152, "oe" }, { 0x0153, "oe" }
+};
+
+/* The Greek letters with an accent or a diaeresis, by their base letter */
+static const struct {
+	uint16_t c;
+	uint16_t base;
+} fold_greek[] = {
+	{ 0x0386, 0x03b1 }, { 0x0388, 0x03b5 }, { 0x0389, 0x03b7 },
+	{ 0x038a, 0x03b9 }, { 0x038c, 0x03bf }, { 0x038e, 0x03c5 },
+	{ 0x038f, 0x03c9 }, { 0x0390, 0x03b9 }, { 0x03aa, 0x03b9 },
+	{ 0x03ab, 0x03c5 }, { 0x03ac, 0x03b1 }, { 0x03ad, 0x03b5 },
+	{ 0x03ae, 0x03b7 }, { 0x03af, 0x03b9 }, { 0x03b0, 0x03c5 },
+	{ 0x03c2, 0x03c3 }, { 0x03ca, 0x03b9 }, { 0x03cb, 0x03c5 },
+	{ 0x03cc, 0x03bf }, { 0x03cd, 0x03c5 }, { 0x03ce, 0x03c9 }
+};
+
+/*
+ * ascii_span --
+ *  Returns the number of ASCII bytes at the start of the len bytes of s.
+ *  The bytes are tested eight at a time.
+ */
+size_t
+ascii_span(const char *s, size_t len)
+{
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if (w & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < len && (s[i] & 0x80) == 0)
+		i++;
+	return i;
+}
+
+/*
+ * fold_code --
+ *  Returns the folded form of the non-ASCII code point c, c itself if it
+ *  is not folded, or one of FOLD_SPACE and FOLD_DROP. The letters folded
+ *  into two ASCII ones are returned as 0 and looked up in fold_pairs.
+ */
+static long
+fold_code(uint32_t c)
+{
+	size_t i;
+
+	if (c < 0xa0)
+		return FOLD_SPACE;		/* C1 controls */
+	if (c < 0xc0) {
+		switch (c) {
+		case 0xaa:
+			return 'a';
+		case 0xad:
+			return FOLD_DROP;	/* soft hyphen */
+		case 0xb2:
+			return '2';
+		case 0xb3:
+			return '3';
+		case 0xb5:
+			return 0x03bc;		/* micro sign, mu */
+		case 0xb9:
+			return '1';
+		case 0xba:
+			return 'o';
+		default:
+			return FOLD_SPACE;
+		}
+	}
+	if (c < 0x180) {
+		switch (fold_latin[c - 0xc0]) {
+		case '*':
+			return 0;
+		case ' ':
+			return FOLD_SPACE;
+		default:
+			return fold_latin[c - 0xc0];
+		}
+	}
+	if (c >= 0x300 && c < 0x370)
+		return FOLD_DROP;		/* combining diacritical marks */
+	if (c >= 0x386 && c < 0x3cf) {
+		for (i = 0; i < __arraycount(fold_greek); i++)
+			if (fold_greek[i].c == c)
+				return fold_greek[i].base;
+		if (c >= 0x391 && c < 0x3aa)
+			return c + 0x20;
+		return c;
+	}
+	if (c >= 0x400 && c < 0x460) {
+		if (c == 0x400 || c == 0x401 || c == 0x450 || c == 0x451)
+			return 0x435;		/* ie with grave or diaeresis */
+		if (c < 0x410)
+			return c + 0x50;
+		if (c < 0x430)
+			return c + 0x20;
+		return c;
+	}
+	if (c >= 0x2000 && c < 0x2070) {
+		if ((c >= 0x200b && c <= 0x200d) || c == 0x2060)
+			return FOLD_DROP;	/* zero width spaces and joiners */
+		return FOLD_SPACE;		/* spaces, dashes, quotes... */
+	}
+	if (c == 0x3000)
+		return FOLD_SPACE;		/* ideographic space */
+	if (c == 0xfeff)
+		return FOLD_DROP;		/* byte order mark */
+	return c;
+}
+
+/*
+ * fold_char --
+ *  Folds the character at *sp, which ends before end, into out and moves
+ *  *sp past it. out gets the folded character in UTF-8, ASCII letters in
+ *  lower case, or a space if the character separates words. Returns the
+ *  number of bytes written, at most FOLD_MAX, and 0 for the characters
+ *  which are left out, such as combining accents. Bytes which are not
+ *  valid UTF-8 are copied as they are.
+ */
+size_t
+fold_char(const char **sp, const char *end, char *out)
+{
+	const unsigned char *s = (const unsigned char *) *sp;
+	uint32_t c;
+	long f;
+	size_t n, i;
+
+	if (s[0] < 0x80) {
+		out[0] = s[0] >= 'A' && s[0] <= 'Z' ? s[0] - 'A' + 'a' : s[0];
+		*sp += 1;
+		return 1;
+	}
+
+	if (s[0] >= 0xc2 && s[0] < 0xe0) {
+		n = 2;
+		c = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] < 0xf0) {
+		n = 3;
+		c = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] < 0xf5) {
+		n = 4;
+		c = s[0] & 0x07;
+	} else
+		n = 0;
+	if (n == 0 || (size_t) (end - *sp) < n)
+		goto invalid;
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			goto invalid;
+		c = c << 6 | (s[i] & 0x3f);
+	}
+	*sp += n;
+
+	switch (f = fold_code(c)) {
+	case FOLD_DROP:
+		return 0;
+	case FOLD_SPACE:
+		out[0] = ' ';
+		return 1;
+	case 0:
+		for (i = 0; fold_pairs[i].c != c; i++)
+			continue;
+		memcpy(out, fold_pairs[i].s, 2);
+		return 2;
+	}
+	if (f < 0x80) {
+		out[0] = f;
+		return 1;
+	}
+	if ((uint32_t) f == c) {
+		memcpy(out, s, n);
+		return n;
+	}
+	/* The folded letters are all below U+0800 */
+	out[0] = 0xc0 | (f >> 6);
+	out[1] = 0x80 | (f & 0x3f);
+	return 2;
+
+invalid:
+	*sp += 1;
+	out[0] = s[0];
+	return 1;
+}
+
+/*
+ * fold_text --
+ *  Folds the len bytes of text, for the tokenizers. The ASCII bytes are
+ *  copied as they are, the tokenizers lower them themselves. Returns the
+ *  folded text, of *foldlen bytes and NUL terminated. If offsets is not
+ *  NULL, it is set to an array giving the offset in text of every byte of
+ *  the folded text, and of its end; it should be freed like the text.
+ */
+char *
+fold_text(const char *text, size_t len, size_t *foldlen, int **offsets)
+{
+	const char *s = text;
+	const char *end = text + len;
+	char *folded, *out;
+	int *map = NULL;
+	size_t n, i;
+
+	out = folded = emalloc(len + 1);
+	if (offsets != NULL)
+		map = emalloc((len + 1) * sizeof(*map));
+	while (s < end) {
+		n = ascii_span(s, end - s);
+		if (map != NULL)
+			for (i = 0; i < n; i++)
+				map[out - folded + i] = s - text + i;
+		memcpy(out, s, n);
+		out += n;
+		s += n;
+		while (s < end && (*s & 0x80)) {
+			if (map != NULL)
+				map[out - folded] = s - text;
+			n = fold_char(&s, end, out);
+			for (i = 1; map != NULL && i < n; i++)
+				map[out - folded + i] = map[out - folded];
+			out += n;
+		}
+	}
+	*out = '\0';
+	*foldlen = out - folded;
+	if (map != NULL) {
+		map[*foldlen] = len;
+		*offsets = map;
+	}
+	return folded;
+}
+
+/*
+ * next_word --
+ *  Finds the first word of the len bytes of text at or after *start, and
+ *  sets *start and *end to its bounds. The words are split like the
+ *  porter tokenizer splits them, on the ASCII bytes other than letters,
+ *  digits and '_', and on the characters fold_char turns into spaces.
+ *  Returns 0 if there is no word left.
+ */
+int
+next_word(const char *text, size_t len, size_t *start, size_t *end)
+{
+	const char *s, *p;
+	const char *stop = text + len;
+	char out[FOLD_MAX];
+	int inword = 0;
+
+	for (s = text + *start; s < stop; s = p) {
+		p = s;
+		if ((*s & 0x80) == 0) {
+			p++;
+			if (isalnum((unsigned char) *s) || *s == '_') {
+				if (!inword)
+					*start = s - text;
+				inword = 1;
+				continue;
+			}
+		} else if (fold_char(&p, stop, out) == 0 || out[0] != ' ') {
+			if (!inword)
+				*start = s - text;
+			inword = 1;
+			continue;
+		}
+		if (inword)
+			break;
+	}
+	*end = s - text;
+	return inword;
+}
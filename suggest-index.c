@@ -0,0 +1,600 @@
+/*-
+ * Copyright (c) 2011 Abhinav Upadhyay <er.abhinav.upadhyay@gmail.com>
+ * All rights reserved.
+ *
+ * This code was developed as part of Google's Summer of Code 2011 program.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "suggest-index.h"
+
+/*
+ * The index is a trie over the words of mandb_dict, written by makemandb
+ * and mapped read-only by suggest.cgi. It is a header followed by an array
+ * of nodes in breadth-first order, so that the children of a node are
+ * contiguous and sorted by their label. Every node also keeps the highest
+ * frequency of the words below it, which lets the completions be found in
+ * decreasing order of frequency without visiting the rest of the subtree.
+ */
+#define SUGGEST_MAGIC	0x6d6e7367
+#define SUGGEST_VERSION	1
+#define SUGGEST_MAXWORD	64		// Longer words are left out
+#define SUGGEST_MINFUZZ	3		// Shortest prefix matched approximately
+
+typedef struct suggest_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nnodes;
+	uint32_t nwords;
+} suggest_header;
+
+typedef struct trie_node {
+	uint32_t child;		// Index of the first child
+	uint32_t freq;		// Frequency of the word ending here
+	uint32_t best;		// Highest frequency in the subtree
+	uint16_t nchild;
+	uint8_t label;
+	uint8_t word;		// Set if a word ends here
+} trie_node;
+
+struct suggest_index {
+	const trie_node *nodes;
+	uint32_t nnodes;
+	void *base;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	char *path;
+};
+
+/* A node of the trie while it is being built */
+typedef struct build_node {
+	uint32_t first;		// First child, 0 if none
+	uint32_t next;		// Next sibling, 0 if none
+	uint32_t last;		// Last child
+	uint32_t parent;
+	uint32_t freq;
+	uint32_t best;
+	uint16_t nchild;
+	uint8_t label;
+	uint8_t word;
+} build_node;
+
+static uint32_t
+add_node(build_node **nodes, uint32_t *nnodes, size_t *size, uint32_t parent,
+    uint8_t label)
+{
+	build_node *node;
+	build_node *p;
+	uint32_t n = (*nnodes)++;
+
+	if (n == *size) {
+		*size = *size ? *size * 2 : 1024;
+		*nodes = erealloc(*nodes, *size * sizeof(**nodes));
+	}
+	node = &(*nodes)[n];
+	memset(node, 0, sizeof(*node));
+	node->parent = parent;
+	node->label = label;
+	if (n == 0)
+		return n;
+	p = &(*nodes)[parent];
+	if (p->first == 0)
+		p->first = n;
+	else
+		(*nodes)[p->last].next = n;
+	p->last = n;
+	p->nchild++;
+	return n;
+}
+
+/*
+ * write_trie --
+ *  Writes the nodes to fp in breadth-first order. Returns -1 on failure.
+ */
+static int
+write_trie(FILE *fp, build_node *nodes, uint32_t nnodes, uint32_t nwords)
+{
+	suggest_header hdr;
+	trie_node out;
+	uint32_t *queue;
+	uint32_t head, tail;
+	uint32_t n, c;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SUGGEST_MAGIC;
+	hdr.version = SUGGEST_VERSION;
+	hdr.nnodes = nnodes;
+	hdr.nwords = nwords;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+
+	/*
+	 * A node is written when it is taken off the queue, by which time
+	 * all the nodes queued before its children are known.
+	 */
+	queue = emalloc(nnodes * sizeof(*queue));
+	queue[0] = 0;
+	tail = 1;
+	for (head = 0; head < tail; head++) {
+		n = queue[head];
+		memset(&out, 0, sizeof(out));
+		out.child = tail;
+		out.freq = nodes[n].freq;
+		out.best = nodes[n].best;
+		out.nchild = nodes[n].nchild;
+		out.label = nodes[n].label;
+		out.word = nodes[n].word;
+		for (c = nodes[n].first; c != 0; c = nodes[c].next)
+			queue[tail++] = c;
+		if (fwrite(&out, sizeof(out), 1, fp) != 1)
+			break;
+	}
+	free(queue);
+	return head == tail ? 0 : -1;
+}
+
+/*
+ * suggest_build --
+ *  Builds the index of the words of mandb_dict into the file at path. The
+ *  file is written under a temporary name and renamed over the old one,
+ *  so that a suggest.cgi process never sees it half written. Returns -1 on
+ *  failure.
+ */
+int
+suggest_build(sqlite3 *db, const char *path)
+{
+	sqlite3_stmt *stmt;
+	build_node *nodes = NULL;
+	size_t size = 0;
+	uint32_t nnodes = 0;
+	uint32_t nwords = 0;
+	uint32_t path_nodes[SUGGEST_MAXWORD + 1];
+	char prev[SUGGEST_MAXWORD + 1];
+	const char *word;
+	sqlite3_int64 freq;
+	size_t len, common, i;
+	uint32_t n;
+	char *tmppath;
+	FILE *fp;
+	int rc;
+
+	/* The words come in byte order, so a new node is always a last child */
+	rc = sqlite3_prepare_v2(db, "SELECT word, frequency FROM mandb_dict "
+	    "ORDER BY word", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		warnx("%s", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	path_nodes[0] = add_node(&nodes, &nnodes, &size, 0, 0);
+	prev[0] = '\0';
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		word = (const char *) sqlite3_column_text(stmt, 0);
+		freq = sqlite3_column_int64(stmt, 1);
+		if (word == NULL || (len = strlen(word)) == 0 ||
+		    len > SUGGEST_MAXWORD)
+			continue;
+		for (common = 0; prev[common] && prev[common] == word[common];
+		    common++)
+			continue;
+		for (i = common; i < len; i++)
+			path_nodes[i + 1] = add_node(&nodes, &nnodes, &size,
+			    path_nodes[i], word[i]);
+		n = path_nodes[len];
+		if (!nodes[n].word)
+			nwords++;
+		nodes[n].word = 1;
+		nodes[n].freq = freq < 1 ? 1 :
+		    freq > UINT32_MAX ? UINT32_MAX : (uint32_t) freq;
+		memcpy(prev, word, len + 1);
+	}
+	sqlite3_finalize(stmt);
+
+	/* The children come after their parents */
+	for (n = nnodes - 1; n > 0; n--) {
+		if (nodes[n].freq > nodes[n].best)
+			nodes[n].best = nodes[n].freq;
+		if (nodes[n].best > nodes[nodes[n].parent].best)
+			nodes[nodes[n].parent].best = nodes[n].best;
+	}
+
+	easprintf(&tmppath, "%s.tmp", path);
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		warn("%s", tmppath);
+		free(tmppath);
+		free(nodes);
+		return -1;
+	}
+	rc = write_trie(fp, nodes, nnodes, nwords);
+	free(nodes);
+	if (fclose(fp) == EOF)
+		rc = -1;
+	if (rc == 0 && rename(tmppath, path) == -1)
+		rc = -1;
+	if (rc == -1) {
+		warn("%s", path);
+		unlink(tmppath);
+	}
+	free(tmppath);
+	return rc;
+}
+
+/*
+ * suggest_open --
+ *  Maps the index at path. Returns NULL if it does not exist or is not
+ *  usable, in which case the caller should fall back to get_suggestions().
+ */
+suggest_index *
+suggest_open(const char *path)
+{
+	suggest_index *idx;
+	const suggest_header *hdr;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	hdr = base;
+	if (hdr->magic != SUGGEST_MAGIC || hdr->version != SUGGEST_VERSION ||
+	    hdr->nnodes == 0 || (size_t) st.st_size !=
+	    sizeof(*hdr) + (size_t) hdr->nnodes * sizeof(trie_node)) {
+		warnx("%s: Not a usable index", path);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	idx = emalloc(sizeof(*idx));
+	idx->base = base;
+	idx->size = st.st_size;
+	idx->nodes = (const trie_node *) (hdr + 1);
+	idx->nnodes = hdr->nnodes;
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->path = estrdup(path);
+	return idx;
+}
+
+void
+suggest_close(suggest_index *idx)
+{
+	munmap(idx->base, idx->size);
+	free(idx->path);
+	free(idx);
+}
+
+/*
+ * suggest_stale --
+ *  Returns non-zero if makemandb has replaced the index since it was
+ *  opened, in which case a long running process should reopen it.
+ */
+int
+suggest_stale(const suggest_index *idx)
+{
+	struct stat st;
+
+	if (stat(idx->path, &st) == -1)
+		return 0;
+	return st.st_dev != idx->dev || st.st_ino != idx->ino;
+}
+
+/* A node to be expanded in the search for completions, or a found word */
+typedef struct candidate {
+	uint32_t node;
+	uint32_t parent;	// Candidate of the parent node, or NO_PARENT
+	uint32_t key;		// best of the node, or freq of the word
+	uint16_t start;		// Start node the candidate descends from
+	uint8_t dist;		// Edit distance of the start from the prefix
+	uint8_t word;
+} candidate;
+
+#define NO_PARENT	UINT32_MAX
+
+/* A node which approximately matches the prefix, and the path to it */
+typedef struct start_node {
+	uint32_t node;
+	int dist;
+	char path[SUGGEST_MAXWORD + 3];
+} start_node;
+
+typedef struct search {
+	const suggest_index *idx;
+	const char *prefix;
+	size_t len;
+	int maxdist;
+	start_node *starts;
+	size_t nstarts;
+	size_t maxstarts;
+	char path[SUGGEST_MAXWORD + 3];
+	candidate *cands;
+	size_t ncands;
+	size_t size;
+	uint32_t *heap;
+	size_t nheap;
+} search;
+
+/*
+ * find_starts --
+ *  Walks the trie below node, at the given depth, computing the edit
+ *  distance between the prefix and the path to each node a row at a time,
+ *  and records the nodes whose path is within maxdist of the whole prefix.
+ *  Their subtrees hold the completions. The walk goes on below such a node
+ *  only while a closer one may be found there.
+ */
+static void
+find_starts(search *s, uint32_t node, size_t depth, const int *row)
+{
+	const trie_node *nodes = s->idx->nodes;
+	const trie_node *c;
+	int next[SUGGEST_MAXWORD + 1];
+	int min;
+	size_t i;
+	uint32_t k;
+
+	if (nodes[node].child > s->idx->nnodes ||
+	    nodes[node].nchild > s->idx->nnodes - nodes[node].child)
+		return;
+	for (k = 0; k < nodes[node].nchild; k++) {
+		c = &nodes[nodes[node].child + k];
+		next[0] = row[0] + 1;
+		min = next[0];
+		for (i = 1; i <= s->len; i++) {
+			next[i] = row[i - 1] +
+			    ((unsigned char) s->prefix[i - 1] != c->label);
+			if (row[i] + 1 < next[i])
+				next[i] = row[i] + 1;
+			if (next[i - 1] + 1 < next[i])
+				next[i] = next[i - 1] + 1;
+			if (next[i] < min)
+				min = next[i];
+		}
+		if (min > s->maxdist)
+			continue;
+		s->path[depth] = c->label;
+		if (next[s->len] <= s->maxdist && s->nstarts < s->maxstarts) {
+			s->starts[s->nstarts].node = nodes[node].child + k;
+			s->starts[s->nstarts].dist = next[s->len];
+			memcpy(s->starts[s->nstarts].path, s->path, depth + 1);
+			s->starts[s->nstarts].path[depth + 1] = '\0';
+			s->nstarts++;
+			if (min == next[s->len])
+				continue;
+		}
+		if (depth + 1 < s->len + s->maxdist)
+			find_starts(s, nodes[node].child + k, depth + 1, next);
+	}
+}
+
+/* Whether candidate a should come out before candidate b */
+static int
+before(const search *s, uint32_t a, uint32_t b)
+{
+	const candidate *ca = &s->cands[a];
+	const candidate *cb = &s->cands[b];
+
+	if (ca->dist != cb->dist)
+		return ca->dist < cb->dist;
+	if (ca->key != cb->key)
+		return ca->key > cb->key;
+	return ca->word > cb->word;
+}
+
+static void
+push(search *s, uint32_t node, uint32_t parent, uint32_t key, uint16_t start,
+    uint8_t dist, uint8_t word)
+{
+	candidate *cand;
+	size_t i;
+	uint32_t tmp;
+
+	if (s->ncands == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		s->cands = erealloc(s->cands, s->size * sizeof(*s->cands));
+		s->heap = erealloc(s->heap, s->size * sizeof(*s->heap));
+	}
+	cand = &s->cands[s->ncands];
+	cand->node = node;
+	cand->parent = parent;
+	cand->key = key;
+	cand->start = start;
+	cand->dist = dist;
+	cand->word = word;
+
+	i = s->nheap++;
+	s->heap[i] = s->ncands++;
+	while (i > 0 && before(s, s->heap[i], s->heap[(i - 1) / 2])) {
+		tmp = s->heap[i];
+		s->heap[i] = s->heap[(i - 1) / 2];
+		s->heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static uint32_t
+pop(search *s)
+{
+	uint32_t top = s->heap[0];
+	uint32_t tmp;
+	size_t i = 0;
+	size_t c;
+
+	s->heap[0] = s->heap[--s->nheap];
+	while ((c = 2 * i + 1) < s->nheap) {
+		if (c + 1 < s->nheap && before(s, s->heap[c + 1], s->heap[c]))
+			c++;
+		if (!before(s, s->heap[c], s->heap[i]))
+			break;
+		tmp = s->heap[i];
+		s->heap[i] = s->heap[c];
+		s->heap[c] = tmp;
+		i = c;
+	}
+	return top;
+}
+
+static int
+is_start(const search *s, uint32_t node)
+{
+	size_t i;
+
+	for (i = 0; i < s->nstarts; i++)
+		if (s->starts[i].node == node)
+			return 1;
+	return 0;
+}
+
+/*
+ * spell_word --
+ *  Returns the word of a candidate: the path to its start node followed
+ *  by the labels of the nodes from there.
+ */
+static char *
+spell_word(const search *s, uint32_t cand)
+{
+	char labels[SUGGEST_MAXWORD + 1];
+	size_t n = 0;
+	char *word;
+	uint32_t c;
+
+	for (c = cand; s->cands[c].parent != NO_PARENT; c = s->cands[c].parent)
+		labels[n++] = s->idx->nodes[s->cands[c].node].label;
+	easprintf(&word, "%s%*s", s->starts[s->cands[c].start].path, (int) n,
+	    "");
+	for (c = strlen(word) - n; n > 0; c++)
+		word[c] = labels[--n];
+	return word;
+}
+
+/*
+ * complete --
+ *  Searches for the completions of the prefix, or of the ones within
+ *  maxdist edits of it.
+ */
+static size_t
+complete(const suggest_index *idx, const char *prefix, int maxdist,
+    char **words, size_t nwords)
+{
+	const trie_node *node;
+	search s;
+	candidate cand;
+	int row[SUGGEST_MAXWORD + 1];
+	size_t found = 0;
+	size_t i;
+	uint32_t c, k;
+
+	memset(&s, 0, sizeof(s));
+	s.idx = idx;
+	s.prefix = prefix;
+	s.len = strlen(prefix);
+	if (s.len == 0 || s.len > SUGGEST_MAXWORD)
+		return 0;
+	s.maxdist = s.len < SUGGEST_MINFUZZ ? 0 : maxdist > 2 ? 2 : maxdist;
+	s.maxstarts = 1024;
+	s.starts = emalloc(s.maxstarts * sizeof(*s.starts));
+	for (i = 0; i <= s.len; i++)
+		row[i] = i;
+	find_starts(&s, 0, 0, row);
+
+	for (i = 0; i < s.nstarts; i++)
+		push(&s, s.starts[i].node, NO_PARENT,
+		    idx->nodes[s.starts[i].node].best, i, s.starts[i].dist, 0);
+	while (s.nheap > 0 && found < nwords) {
+		c = pop(&s);
+		cand = s.cands[c];
+		node = &idx->nodes[cand.node];
+		if (cand.word) {
+			words[found++] = spell_word(&s, c);
+			continue;
+		}
+		if (node->word)
+			push(&s, cand.node, cand.parent, node->freq, cand.start,
+			    cand.dist, 1);
+		if (node->child > idx->nnodes ||
+		    node->nchild > idx->nnodes - node->child)
+			continue;
+		/* The subtrees of other start nodes are searched from those */
+		for (k = 0; k < node->nchild; k++)
+			if (!is_start(&s, node->child + k))
+				push(&s, node->child + k, c,
+				    idx->nodes[node->child + k].best,
+				    cand.start, cand.dist, 0);
+	}
+	free(s.starts);
+	free(s.cands);
+	free(s.heap);
+	return found;
+}
+
+/*
+ * suggest_complete --
+ *  Finds up to nwords completions of prefix, and stores them in words in
+ *  decreasing order of frequency. With maxdist above 0, prefixes within
+ *  that many edits of the given one are completed as well, after the
+ *  completions of the exact prefix. Returns the number of completions;
+ *  the caller should free them.
+ */
+size_t
+suggest_complete(const suggest_index *idx, const char *prefix, int maxdist,
+    char **words, size_t nwords)
+{
+	size_t found;
+	size_t i;
+
+	/*
+	 * Matching the prefix approximately visits much more of the trie, so
+	 * it is only done if there are not enough exact completions. The
+	 * exact ones come out first again then.
+	 */
+	found = complete(idx, prefix, 0, words, nwords);
+	if (found == nwords || maxdist <= 0)
+		return found;
+	for (i = 0; i < found; i++)
+		free(words[i]);
+	return complete(idx, prefix, maxdist, words, nwords);
+}
@@ -31,26 +31,153 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <util.h>
 
 #include "apropos-utils.h"
 #include "cgi-utils.h"
+#include "suggest-index.h"
 
-int
-main(int argc, char **argv)
+#define SUGGEST_COUNT	10	// Number of completions returned
+#define SUGGEST_FUZZ	1	// Default number of typos allowed in a word
+
+/*
+ * print_quoted --
+ *  Prints the head of the query and a word after it between single quotes,
+ *  escaping the quotes and backslashes in them.
+ */
+static void
+print_quoted(const char *head, const char *word)
 {
-	char * qstr;
+	const char *s;
+
+	putchar('\'');
+	for (s = head ? head : ""; *s; s++) {
+		if (*s == '\'' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	if (head != NULL)
+		putchar(' ');
+	for (s = word; *s; s++) {
+		if (*s == '\'' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('\'');
+}
+
+/*
+ * complete --
+ *  Answers from the suggestion index with the completions of the last word
+ *  of the query, most frequent first, in the format of get_suggestions().
+ *  Once the exact completions run out, the words within fuzz typos of the
+ *  typed one are completed as well.
+ */
+static void
+complete(suggest_index *idx, char *query, int fuzz)
+{
+	char *words[SUGGEST_COUNT];
+	char *head;
+	char *term;
+	size_t n, i;
+
+	if ((term = strrchr(query, ' ')) == NULL) {
+		head = NULL;
+		term = query;
+	} else {
+		*term++ = 0;
+		head = query;
+	}
+	n = suggest_complete(idx, lower(term), fuzz, words, SUGGEST_COUNT);
+
+	printf("Content-type: application/json\n\n");
+	printf("{\n{ query:");
+	print_quoted(head, term);
+	printf(",\n suggestions:[");
+	for (i = 0; i < n; i++) {
+		if (i)
+			putchar(',');
+		print_quoted(head, words[i]);
+		putchar('\n');
+		free(words[i]);
+	}
+	printf("]\n}\n");
+}
+
+/*
+ * suggest --
+ *  Answers a single request with the suggestions for its query, releasing
+ *  everything allocated for it before returning. The suggestion index is
+ *  used if makemandb has built one, otherwise the dictionary is searched
+ *  for words one edit away from the last one of the query.
+ */
+static void
+suggest(sqlite3 *db, suggest_index *idx)
+{
+	char *qstr;
 	char *query;
-	sqlite3 *db;
-	if ((qstr = getenv("QUERY_STRING")) == NULL)
-		exit(EXIT_FAILURE);
-	if ((query = get_param(qstr, "query")) == NULL)
-		exit(EXIT_FAILURE);
+	char *fuzz;
+	char *suggestions;
+	int maxdist = SUGGEST_FUZZ;
+
+	if ((qstr = getenv("QUERY_STRING")) == NULL) {
+		printf("Status: 400 Bad Request\n\n");
+		return;
+	}
+	/* get_param() cuts the string it is given */
+	qstr = estrdup(qstr);
+	fuzz = get_param(qstr, "fuzzy");
+	free(qstr);
+	if (fuzz != NULL)
+		maxdist = atoi(fuzz);
+	free(fuzz);
+	qstr = getenv("QUERY_STRING");
+	if ((query = get_param(qstr, "query")) == NULL) {
+		printf("Status: 400 Bad Request\n\n");
+		return;
+	}
 
-	db = init_db(MANDB_READONLY, MANCONF);
 	query = parse_space(query);
-	char *suggestions = get_suggestions(db, query);
+	if (idx != NULL && *query != '\0') {
+		complete(idx, query, maxdist);
+		free(query);
+		return;
+	}
+	suggestions = get_suggestions(db, query);
 	printf("Content-type: application/json\n\n");
-	printf("%s\n", suggestions);
+	printf("%s\n", suggestions ? suggestions : "{}");
 	free(suggestions);
+	free(query);
+}
+
+/*
+ * Like apropos.cgi, with FastCGI this keeps serving requests over the same
+ * database connection, and the same mapping of the suggestion index until
+ * makemandb replaces it.
+ */
+int
+main(int argc, char **argv)
+{
+	sqlite3 *db;
+	suggest_index *idx;
+	char *path;
+
+	if ((db = init_db(MANDB_READONLY, MANCONF)) == NULL)
+		exit(EXIT_FAILURE);
+	easprintf(&path, "%s%s", get_dbpath(MANCONF), SUGGEST_SUFFIX);
+	idx = suggest_open(path);
+	while (cgi_accept()) {
+		if (idx == NULL || suggest_stale(idx)) {
+			if (idx != NULL)
+				suggest_close(idx);
+			idx = suggest_open(path);
+		}
+		suggest(db, idx);
+	}
+	if (idx != NULL)
+		suggest_close(idx);
+	free(path);
+	close_db(db);
 	return 0;
 }
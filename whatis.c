@@ -34,32 +34,29 @@ __RCSID("$NetBSD: whatis.c,v 1.4 2012/10/06 15:33:59 wiz Exp $");
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <util.h>
 
 #include "apropos-utils.h"
 
 __dead static void
 usage(void)
 {
-	fprintf(stderr, "%s ...\n", "whatis");
+	fprintf(stderr, "%s [-by] ...\n", "whatis");
 	exit(EXIT_FAILURE);
 }
 
 static int
-whatis(sqlite3 *db, const char *cmd)
+whatis(sqlite3_stmt *stmt, const char *cmd)
 {
-	static const char sqlstr[] = "SELECT name, section, name_desc"
-				     " FROM mandb WHERE name MATCH ? AND name=?"
-				     " ORDER BY section, name";
-	sqlite3_stmt *stmt = NULL;
 	int retval;
+	int i;
 
-	if (sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL) != SQLITE_OK)
-		errx(EXIT_FAILURE, "Unable to query database");
-	if (sqlite3_bind_text(stmt, 1, cmd, -1, NULL) != SQLITE_OK)
-		errx(EXIT_FAILURE, "Unable to query database");
-	if (sqlite3_bind_text(stmt, 2, cmd, -1, NULL) != SQLITE_OK)
-		errx(EXIT_FAILURE, "Unable to query database");
+	sqlite3_reset(stmt);
+	for (i = 1; i <= sqlite3_bind_parameter_count(stmt); i++)
+		if (sqlite3_bind_text(stmt, i, cmd, -1, NULL) != SQLITE_OK)
+			errx(EXIT_FAILURE, "Unable to query database");
 	retval = 1;
 	while (sqlite3_step(stmt) == SQLITE_ROW) {
 		printf("%s(%s) - %s\n", sqlite3_column_text(stmt, 0),
@@ -67,20 +64,120 @@ whatis(sqlite3 *db, const char *cmd)
 		    sqlite3_column_text(stmt, 2));
 		retval = 0;
 	}
-	sqlite3_finalize(stmt);
 	if (retval)
 		fprintf(stderr, "%s: not found\n", cmd);
 	return retval;
 }
 
+/*
+ * symbol_callback --
+ *  Prints a page found by whatis_symbol, once even if it documents the
+ *  symbol as more than one kind; these come one after the other.
+ */
+static int
+symbol_callback(void *data, const char *section, const char *name,
+	const char *name_desc, const char *snippet, size_t snippet_length)
+{
+	char **last = data;
+	char *line;
+
+	easprintf(&line, "%s(%s) - %s", name, section, name_desc);
+	if (*last == NULL || strcmp(*last, line) != 0)
+		printf("%s\n", line);
+	free(*last);
+	*last = line;
+	return 0;
+}
+
+/*
+ * whatis_symbol --
+ *  Lists the pages documenting a symbol, from the symbol index.
+ */
+static int
+whatis_symbol(sqlite3 *db, const char *symbol)
+{
+	symbol_args args;
+	char *errmsg = NULL;
+	char *last = NULL;
+	int retval;
+
+	memset(&args, 0, sizeof(args));
+	args.symbol = symbol;
+	args.callback = &symbol_callback;
+	args.callback_data = &last;
+	args.errmsg = &errmsg;
+	if (lookup_symbol(db, &args) < 0) {
+		warnx("%s", errmsg);
+		free(errmsg);
+		free(last);
+		return 1;
+	}
+	retval = last == NULL;
+	if (retval)
+		fprintf(stderr, "%s: not found\n", symbol);
+	free(last);
+	return retval;
+}
+
+/*
+ * lookup --
+ *  Looks up a name with stmt, or a symbol if stmt is NULL.
+ */
+static int
+lookup(sqlite3 *db, sqlite3_stmt *stmt, const char *cmd)
+{
+	return stmt == NULL ? whatis_symbol(db, cmd) : whatis(stmt, cmd);
+}
+
+/*
+ * batch --
+ *  Looks up the names read from stdin, one per line. The results for every
+ *  name are terminated by an empty line and flushed.
+ */
+static int
+batch(sqlite3 *db, sqlite3_stmt *stmt)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+	int retval = 0;
+
+	while ((len = getline(&line, &linesize, stdin)) != -1) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (*line != '\0')
+			retval |= lookup(db, stmt, line);
+		putchar('\n');
+		fflush(stdout);
+	}
+	free(line);
+	return retval;
+}
+
 int
 main(int argc, char *argv[])
 {
+	static const char sqlstr[] = "SELECT name, section, name_desc"
+				     " FROM mandb_names WHERE name = ?"
+				     " ORDER BY section, name";
+	/* For databases built before mandb_names */
+	static const char oldsqlstr[] = "SELECT name, section, name_desc"
+				     " FROM mandb WHERE name MATCH ? AND name=?"
+				     " ORDER BY section, name";
 	sqlite3 *db;
+	sqlite3_stmt *stmt = NULL;
 	int ch, retval;
+	int bflag = 0;
+	int yflag = 0;
 
-	while ((ch = getopt(argc, argv, "")) != -1) {
+	while ((ch = getopt(argc, argv, "by")) != -1) {
 		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		case 'y':
+			yflag = 1;
+			break;
 		default:
 			usage();
 		}
@@ -88,16 +185,25 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc == 0)
+	if (bflag ? argc != 0 : argc == 0)
 		usage();
 
 	if ((db = init_db(MANDB_READONLY, MANCONF)) == NULL)
 		exit(EXIT_FAILURE);
 
+	if (!yflag &&
+	    sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL) != SQLITE_OK &&
+	    sqlite3_prepare_v2(db, oldsqlstr, -1, &stmt, NULL) != SQLITE_OK)
+		errx(EXIT_FAILURE, "Unable to query database");
+
 	retval = 0;
-	while (argc--)
-		retval |= whatis(db, *argv++);
+	if (bflag)
+		retval = batch(db, stmt);
+	else
+		while (argc--)
+			retval |= lookup(db, stmt, *argv++);
 
+	sqlite3_finalize(stmt);
 	close_db(db);
 	return retval;
 }